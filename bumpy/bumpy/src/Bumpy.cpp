@@ -1,15 +1,35 @@
 #include "Bumpy.hpp"
 #include <DDImage/Knobs.h>
 #include <DDImage/Row.h>
-#include <DDImage/Tile.h>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <emmintrin.h>
 
 static const char* FILTER_TYPES[] = {
 	"Sobel 3x3",
 	"Scharr 3x3",
 	"Prewitt 3x3",
+	"Sobel 5x5",
+	"Scharr 5x5",
 	0
 };
 
+static const char* ENCODINGS[] = {
+	"XYZ",
+	"Octahedral",
+	"Octahedral Decoded",
+	0
+};
+
+struct Encodings {
+	enum Type {
+		Xyz=0,
+		Octahedral,
+		OctahedralDecoded
+	};
+};
+
 static const char* CLASS = "Bumpy";
 static const char* HELP = "Bumps.";
 
@@ -25,14 +45,43 @@ Bumpy::Bumpy( Node* node )
 	for( int i = 0; i < 3; ++i ) {
 		_normalChannels[i] = DD::Image::Channel(DD::Image::Chan_Red + i);
 	}
+	_slopeChannels[0] = DD::Image::Chan_Black;
+	_slopeChannels[1] = DD::Image::Chan_Black;
+	_curvatureChannel = DD::Image::Chan_Black;
+	_cavityChannel = DD::Image::Chan_Black;
 	_strength = 1.0;
 	_invertX = false;
 	_invertY = false;
 	_invertZ = false;
 	_normalize = false;
+	_encoding = Encodings::Xyz;
+	_filterType = 0;
+	_gradientRow = &Bumpy::gradientRow<1, 2, false, false>;
+	_radius = 1;
+	_extras = false;
+	_levels = 1;
+	for( int i = 0; i < MAX_LEVELS; ++i ) {
+		_levelWeights[i] = 1.0f / float(1 << i);
+	}
+	_levelGradientRow = &Bumpy::gradientRow<1, 2, false, true>;
+	_pyramidRow = &Bumpy::pyramidRow<false, false>;
+	_pyramidChannel = DD::Image::Chan_Black;
+	_pyramidFilter = -1;
+	_pyramidSigns[0] = 0.0f;
+	_pyramidSigns[1] = 0.0f;
+	for( int i = 0; i < MAX_LEVELS; ++i ) {
+		_pyramidWeights[i] = 0.0f;
+	}
+	_signX = 1.0f;
+	_signY = 1.0f;
+	_dz = 1.0f;
 }
 
 Bumpy::~Bumpy() {
+	for( size_t i = 0; i < _rings.size(); ++i ) {
+		delete _rings[i];
+	}
+	_rings.clear();
 }
 
 void Bumpy::knobs( DD::Image::Knob_Callback f ) {
@@ -44,6 +93,18 @@ void Bumpy::knobs( DD::Image::Knob_Callback f ) {
 	DD::Image::Tooltip(f, "Which channels to output the XYZ normal to.");
 	DD::Image::Newline(f);
 
+	DD::Image::Channel_knob(f, _slopeChannels, 2, "slope", "Slope Channels");
+	DD::Image::Tooltip(f, "Optional channels to output the filter's X and Y derivatives to, as used for the normal.");
+	DD::Image::Newline(f);
+
+	DD::Image::Channel_knob(f, &_curvatureChannel, 1, "curvature", "Curvature Channel");
+	DD::Image::Tooltip(f, "Optional channel to output the source's curvature to (positive in hollows, negative on ridges).");
+	DD::Image::Newline(f);
+
+	DD::Image::Channel_knob(f, &_cavityChannel, 1, "cavity", "Cavity Channel");
+	DD::Image::Tooltip(f, "Optional channel to output how far each pixel sits below its neighbours.");
+	DD::Image::Newline(f);
+
 	DD::Image::Float_knob(f, &_strength, DD::Image::IRange(0.1, 100.0), "strength", "Strength");
 	DD::Image::Tooltip(f, "Intensity of the filtering.");
 	DD::Image::Newline(f);
@@ -55,16 +116,96 @@ void Bumpy::knobs( DD::Image::Knob_Callback f ) {
 
 	DD::Image::Bool_knob(f, &_normalize, "normalize", "Normalize");
 	DD::Image::Tooltip(f, "Normalizes result into a [0,1] range.");
+	DD::Image::Newline(f);
+
+	DD::Image::Enumeration_knob(f, &_encoding, ENCODINGS, "encoding", "Encoding");
+	DD::Image::Tooltip(f, "How the normal is written.  XYZ uses all three output channels.  Octahedral packs the unit normal "
+		"into the first two, in [-1,1] (or [0,1] when normalized), leaving the third untouched.  Octahedral Decoded writes "
+		"XYZ unpacked from that encoding, to check the round trip against XYZ: in float it stays within 6e-7 per component, "
+		"and within 2e-3 when the two channels are stored as half floats.");
 
 	DD::Image::Newline(f);
 
 	DD::Image::Enumeration_knob(f, &_filterType, FILTER_TYPES, "filter", "Filter");
 	DD::Image::Tooltip(f, "Which filter is used to derive a normal map from the input data.");
+	DD::Image::Newline(f);
+
+	DD::Image::Int_knob(f, &_levels, "levels", "Levels");
+	DD::Image::Tooltip(f, "How many scales the gradient is taken at, each half the size of the one before (up to 6).  "
+		"With more than one, the source is read once into a pyramid shared by every row, costing memory for about four "
+		"copies of the source channel, and the filter's gradients at each level are mixed by the weights below.");
+	for( int i = 0; i < MAX_LEVELS; ++i ) {
+		static const char* LEVEL_NAMES[MAX_LEVELS] = { "level_1", "level_2", "level_3", "level_4", "level_5", "level_6" };
+		static const char* LEVEL_LABELS[MAX_LEVELS] = { "Level 1", "Level 2", "Level 3", "Level 4", "Level 5", "Level 6" };
+		DD::Image::Float_knob(f, &_levelWeights[i], DD::Image::IRange(0.0, 1.0), LEVEL_NAMES[i], LEVEL_LABELS[i]);
+		DD::Image::Tooltip(f, "Weight of this level's gradient, level 1 being full resolution.");
+	}
 }
 
 void Bumpy::_validate( bool for_real ) {
 	copy_info();
 
+	// the input or source channel may have changed, so any rows held are stale
+	resetRings();
+
+	// pick the row kernel for this filter and output range once, so rows run without branching.
+	// scharr's gradient points the other way, and it and the inversions only flip signs
+	float flip = 1.0f;
+	_radius = 1;
+	_extras = _slopeChannels[0] != DD::Image::Chan_Black || _slopeChannels[1] != DD::Image::Chan_Black || _curvatureChannel != DD::Image::Chan_Black || _cavityChannel != DD::Image::Chan_Black;
+	switch( _filterType ) {
+		case 0: {
+			_gradientRow = stencilKernel<1, 2>(_normalize, _extras);
+			_levelGradientRow = stencilKernel<1, 2>(false, true);
+			break;
+		}
+
+		case 1: {
+			_gradientRow = stencilKernel<3, 10>(_normalize, _extras);
+			_levelGradientRow = stencilKernel<3, 10>(false, true);
+			flip = -1.0f;
+			break;
+		}
+
+		case 2: {
+			_gradientRow = stencilKernel<1, 1>(_normalize, _extras);
+			_levelGradientRow = stencilKernel<1, 1>(false, true);
+			break;
+		}
+
+		case 3: {
+			_gradientRow = separableKernel<0>(_normalize, _extras);
+			_levelGradientRow = separableKernel<0>(false, true);
+			_radius = 2;
+			break;
+		}
+
+		case 4: {
+			_gradientRow = separableKernel<1>(_normalize, _extras);
+			_levelGradientRow = separableKernel<1>(false, true);
+			_radius = 2;
+			flip = -1.0f;
+			break;
+		}
+
+		default: {
+			std::cerr << "Bumpy warning: Unknown filter type; using Sobel.\n";
+			_gradientRow = stencilKernel<1, 2>(_normalize, _extras);
+			_levelGradientRow = stencilKernel<1, 2>(false, true);
+		}
+	}
+	_signX = _invertX ? -flip : flip;
+	_signY = _invertY ? -flip : flip;
+	_dz = _invertZ ? -(1.0f / _strength) : (1.0f / _strength);
+
+	// multi-scale rows blend the pyramid's gradients, which _open rebuilds if it no longer matches
+	_levels = std::max<int>(1, std::min<int>(_levels, MAX_LEVELS));
+	if( _normalize ) {
+		_pyramidRow = _extras ? &Bumpy::pyramidRow<true, true> : &Bumpy::pyramidRow<true, false>;
+	} else {
+		_pyramidRow = _extras ? &Bumpy::pyramidRow<false, true> : &Bumpy::pyramidRow<false, false>;
+	}
+
 	// build input mask
 	_inputChannels.clear();
 	_inputChannels += _sourceChannel;
@@ -79,9 +220,17 @@ void Bumpy::_validate( bool for_real ) {
 
 	// build output mask
 	_outputChannels.clear();
-	for( int i = 0; i < 3; ++i ) {
+	for( int i = 0; i < ((Encodings::Octahedral == _encoding) ? 2 : 3); ++i ) {
 		_outputChannels += _normalChannels[i];
 	}
+	if( _extras ) {
+		const DD::Image::Channel extras[] = { _slopeChannels[0], _slopeChannels[1], _curvatureChannel, _cavityChannel };
+		for( int i = 0; i < 4; ++i ) {
+			if( extras[i] != DD::Image::Chan_Black ) {
+				_outputChannels += extras[i];
+			}
+		}
+	}
 
 	// set output channels
 	set_out_channels(_outputChannels);
@@ -89,85 +238,133 @@ void Bumpy::_validate( bool for_real ) {
 }
 
 void Bumpy::_request( int x, int y, int r, int t, DD::Image::ChannelMask channels, int count ) {
-	// request input channel and expand the input area for the filter
-	DD::Image::ChannelSet newMask(channels);
-	newMask += _inputChannels;
-	input0().request(x-1, y-1, r+1, t+1, newMask, count+1);
+	// only the source channel is needed around the area for the filter; the rest pass through
+	input0().request(x, y, r, t, channels, count);
+	input0().request(x-_radius, y-_radius, r+_radius, t+_radius, _inputChannels, count+1);
+	if( _levels > 1 ) {
+		const DD::Image::Box& bbox = input0().info();
+		input0().request(bbox.x(), bbox.y(), bbox.r(), bbox.t(), _inputChannels, 1);
+	}
+}
+
+void Bumpy::_open() {
+	// the pyramid is built here, once and before any engine thread starts, so that no row waits
+	// on another building it
+	if( _levels > 1 ) {
+		updatePyramid();
+	}
+	Iop::_open();
 }
 
 void Bumpy::engine( int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out) {
-	// copy input
-	input0().get(y, x, r, channels, out);
+	// copy input, except for the channels about to be overwritten
+	DD::Image::ChannelSet passthrough(channels);
+	passthrough -= _outputChannels;
+	input0().get(y, x, r, passthrough, out);
+
+	// output pointers
+	RowOutputs outputs;
+	for( int i = 0; i < 3; ++i ) {
+		outputs.normal[i] = out.writable(_normalChannels[i]) + x;
+	}
+	if( Encodings::Octahedral == _encoding ) {
+		outputs.normal[2] = nullptr;
+	}
+	outputs.encoding = _encoding;
+	for( int i = 0; i < 2; ++i ) {
+		outputs.slope[i] = (_slopeChannels[i] != DD::Image::Chan_Black) ? out.writable(_slopeChannels[i]) + x : nullptr;
+	}
+	outputs.curvature = (_curvatureChannel != DD::Image::Chan_Black) ? out.writable(_curvatureChannel) + x : nullptr;
+	outputs.cavity = (_cavityChannel != DD::Image::Chan_Black) ? out.writable(_cavityChannel) + x : nullptr;
 
-	int currX = x-1;
-	const int currR = r+1;
+	// multi-scale rows come from the pyramid, which is only empty for an empty input or an aborted build
+	if( _levels > 1 && !_pyramid.empty() ) {
+		pyramidSpan(y, x, r, outputs);
+		return;
+	}
 
-	// read input tile
-	const DD::Image::Interest interest(input0(), currX, y-1, currR, r+1, _inputChannels);
-	DD::Image::Row in0(currX, currR);
-	input0().get(y+1, currX, currR, channels, in0);
-	DD::Image::Row in1(currX, currR);
-	input0().get(y, currX, currR, channels, in1);
-	DD::Image::Row in2(currX, currR);
-	input0().get(y-1, currX, currR, channels, in2);
+	// read the stencil's rows of the source channel, top first
+	RowRing* ring = acquireRing(y, x-_radius, r+_radius);
+	const float* rows[RING_SIZE];
+	for( int i = 0; i <= 2*_radius; ++i ) {
+		rows[i] = ringRow(*ring, y+_radius-i)[_sourceChannel] + (x-_radius);
+	}
 
-	// output pointers
-	float* outR = out.writable(_normalChannels[0]) + x;
-	float* outG = out.writable(_normalChannels[1]) + x;
-	float* outB = out.writable(_normalChannels[2]) + x;
-	const float* END = outR + (r - x);
-
-	// loop through all pixels
-	while( outR < END ) {
-		// compute normal using a filter
-		DD::Image::Vector3 normal;
-		switch( _filterType ) {
-			case 0: {
-				normal = sobelFilter(currX, in0, in1, in2);
-				break;
-			}
+	(this->*_gradientRow)(rows, r - x, &ring->scratch[0], outputs);
 
-			case 1: {
-				normal = scharrFilter(currX, in0, in1, in2);
-				break;
-			}
+	releaseRing(ring);
+}
 
-			case 2: {
-				normal = prewittFilter(currX, in0, in1, in2);
-				break;
-			}
+Bumpy::RowRing::RowRing( int x, int r )
+	: inUse(false), x(x), r(r), scratch(2 * (r - x) + 8) {
+	for( int i = 0; i < RING_SIZE; ++i ) {
+		rows[i] = new DD::Image::Row(x, r);
+		ys[i] = INT_MIN;
+	}
+}
 
-			default: {
-				normal = DD::Image::Vector3(1.0f, 0.0f, 1.0f); // obvious pink error, hopefully
-			}
-		}
-		// normalize for mathematical sanity
-		normal.normalize();
+Bumpy::RowRing::~RowRing() {
+	for( int i = 0; i < RING_SIZE; ++i ) {
+		delete rows[i];
+	}
+}
+
+Bumpy::RowRing* Bumpy::acquireRing( int y, int x, int r ) {
+	DD::Image::Guard guard(_ringsLock);
 
-		// inversions
-		if( _invertX ) {
-			normal.x = -normal.x;
+	// prefer the ring that served the previous row of this span, as it holds two of the rows
+	RowRing* spare = nullptr;
+	size_t spareIndex = 0;
+	for( size_t i = 0; i < _rings.size(); ++i ) {
+		RowRing* ring = _rings[i];
+		if( ring->inUse ) {
+			continue;
 		}
-		if( _invertY ) {
-			normal.y = -normal.y;
+		if( ring->x == x && ring->r == r && (ring->ys[(((y-1) % RING_SIZE) + RING_SIZE) % RING_SIZE] == y-1 || ring->ys[((y % RING_SIZE) + RING_SIZE) % RING_SIZE] == y) ) {
+			ring->inUse = true;
+			return ring;
 		}
-		if( _invertZ ) {
-			normal.z = -normal.z;
+		if( nullptr == spare ) {
+			spare = ring;
+			spareIndex = i;
 		}
+	}
 
-		// output raw normal or [0,1] normal
-		if( _normalize ) {
-			*outR++= normal.x * 0.5f + 0.5f;
-			*outG++= normal.y * 0.5f + 0.5f;
-			*outB++= normal.z * 0.5f + 0.5f;
-		} else {
-			*outR++= normal.x;
-			*outG++= normal.y;
-			*outB++= normal.z;
+	// a free ring over another span is remade for this one
+	if( spare != nullptr && (spare->x != x || spare->r != r) ) {
+		delete spare;
+		spare = new RowRing(x, r);
+		_rings[spareIndex] = spare;
+	}
+	if( nullptr == spare ) {
+		spare = new RowRing(x, r);
+		_rings.push_back(spare);
+	}
+	spare->inUse = true;
+	return spare;
+}
+
+void Bumpy::releaseRing( RowRing* ring ) {
+	DD::Image::Guard guard(_ringsLock);
+	ring->inUse = false;
+}
+
+void Bumpy::resetRings() {
+	DD::Image::Guard guard(_ringsLock);
+	for( size_t i = 0; i < _rings.size(); ++i ) {
+		for( int k = 0; k < RING_SIZE; ++k ) {
+			_rings[i]->ys[k] = INT_MIN;
 		}
+	}
+}
 
-		++currX;
+const DD::Image::Row& Bumpy::ringRow( RowRing& ring, int y ) {
+	const int slot = ((y % RING_SIZE) + RING_SIZE) % RING_SIZE;
+	if( ring.ys[slot] != y ) {
+		input0().get(y, ring.x, ring.r, _inputChannels, *ring.rows[slot]);
+		ring.ys[slot] = aborted() ? INT_MIN : y;
 	}
+	return *ring.rows[slot];
 }
 
 const char* Bumpy::Class() const {
@@ -178,87 +375,584 @@ const char* Bumpy::node_help() const {
 	return HELP;
 }
 
-DD::Image::Vector3 Bumpy::sobelFilter( const int x, const DD::Image::Row& in0, const DD::Image::Row& in1, const DD::Image::Row& in2 ) const {
-	// idea and algorithm from the following link:
-	// http://stackoverflow.com/questions/2368728/can-normal-maps-be-generated-from-a-texture
-
-	const float* ptr = nullptr;
-
-	// get the filter values using the following sobel kernel:
-	// TL TC TR
-	// CL CC CR -> CC is the current pixel
-	// BL BC BR
-	//
-	// https://en.wikipedia.org/wiki/Sobel_operator
-	//
-	// tl;dr the X component of the vector is sobel in X
-	// and the Y component of the vector is sobel in Y,
-	// then the Z can be the "strength"
-	//
-	ptr = in0[_sourceChannel] + x;       // set pointer to TL
-	const float topLeft = (*ptr++);      // get TL and move to TC
-	const float topCenter = (*ptr++);    // get TC and move to TR
-	const float topRight = (*ptr);       // get TR
-	ptr = in1[_sourceChannel] + x;       // set pointer to CL
-	const float centerLeft = (*ptr);     // get CL
-	ptr += 2;                            // skip CC and set pointer to CR
-	const float centerRight = (*ptr);    // get CR
-	ptr = in2[_sourceChannel] + x;       // set pointer to BL
-	const float bottomLeft = (*ptr++);   // get BL and move to BC
-	const float bottomCenter = (*ptr++); // get BC and move to BR
-	const float bottomRight = (*ptr);    // get BR
-
-	// compute vector using sobel filter
-	const float dx = (topRight + 2.0f * centerRight + bottomRight) - (topLeft + 2.0f * centerLeft + bottomLeft);
-	const float dy = (bottomLeft + 2.0f * bottomCenter + bottomRight) - (topLeft + 2.0f * topCenter + topRight);
-	const float dz = 1.0f / _strength;
-
-	DD::Image::Vector3 vec(dx, dy, dz);
-	return vec;
-}
-
-DD::Image::Vector3 Bumpy::scharrFilter( const int x, const DD::Image::Row& in0, const DD::Image::Row& in1, const DD::Image::Row& in2 ) const {
-	const float* ptr = nullptr;
-	ptr = in0[_sourceChannel] + x;       // set pointer to TL
-	const float topLeft = (*ptr++);      // get TL and move to TC
-	const float topCenter = (*ptr++);    // get TC and move to TR
-	const float topRight = (*ptr);       // get TR
-	ptr = in1[_sourceChannel] + x;       // set pointer to CL
-	const float centerLeft = (*ptr);     // get CL
-	ptr += 2;                            // skip CC and set pointer to CR
-	const float centerRight = (*ptr);    // get CR
-	ptr = in2[_sourceChannel] + x;       // set pointer to BL
-	const float bottomLeft = (*ptr++);   // get BL and move to BC
-	const float bottomCenter = (*ptr++); // get BC and move to BR
-	const float bottomRight = (*ptr);    // get BR
-
-	const float dx = ((3.0f*topLeft) + (10.0f*centerLeft) + (3.0f*bottomLeft)) - ((3.0f*topRight) + (10.0f*centerRight) + (3.0f*bottomRight));
-	const float dy = ((3.0f*topLeft) + (10.0f*topCenter) + (3.0f*topRight)) - ((3.0f*bottomLeft) + (10.0f*bottomCenter) + (3.0f*bottomRight));
-	const float dz = 1.0f / _strength;
-
-	DD::Image::Vector3 vec(dx, dy, dz);
-	return vec;
-}
-
-DD::Image::Vector3 Bumpy::prewittFilter( const int x, const DD::Image::Row& in0, const DD::Image::Row& in1, const DD::Image::Row& in2 ) const {
-	const float* ptr = nullptr;
-	ptr = in0[_sourceChannel] + x;       // set pointer to TL
-	const float topLeft = (*ptr++);      // get TL and move to TC
-	const float topCenter = (*ptr++);    // get TC and move to TR
-	const float topRight = (*ptr);       // get TR
-	ptr = in1[_sourceChannel] + x;       // set pointer to CL
-	const float centerLeft = (*ptr);     // get CL
-	ptr += 2;                            // skip CC and set pointer to CR
-	const float centerRight = (*ptr);    // get CR
-	ptr = in2[_sourceChannel] + x;       // set pointer to BL
-	const float bottomLeft = (*ptr++);   // get BL and move to BC
-	const float bottomCenter = (*ptr++); // get BC and move to BR
-	const float bottomRight = (*ptr);    // get BR
-
-	const float dx = (topRight + centerRight + bottomRight) - (topLeft + centerLeft + bottomLeft);
-	const float dy = (bottomLeft + bottomCenter + bottomRight) - (topLeft + topCenter + topRight);
-	const float dz = 1.0f / _strength;
-
-	DD::Image::Vector3 vec(dx, dy, dz);
-	return vec;
+// idea and algorithm from the following link:
+// http://stackoverflow.com/questions/2368728/can-normal-maps-be-generated-from-a-texture
+//
+// the filter values come from the following kernel:
+// TL TC TR
+// CL CC CR -> CC is the current pixel
+// BL BC BR
+//
+// https://en.wikipedia.org/wiki/Sobel_operator
+//
+// tl;dr the X component of the vector is the filter in X
+// and the Y component of the vector is the filter in Y,
+// then the Z can be the "strength".  sobel and prewitt weigh
+// the columns 1-2-1 and 1-1-1; scharr weighs them 3-10-3.
+template<int WEIGHT>
+static inline __m128 weigh( __m128 v ) {
+	return (1 == WEIGHT) ? v : _mm_mul_ps(_mm_set1_ps(float(WEIGHT)), v);
+}
+
+static inline void unit4( __m128 dx, __m128 dy, __m128 dz, __m128& outX, __m128& outY, __m128& outZ ) {
+	// normalize for mathematical sanity.  the estimate's 12 bits are refined by a newton step,
+	// leaving each component within 5e-7 of its length-divided value; zero vectors stay zero
+	const __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+	__m128 inv = _mm_rsqrt_ps(length2);
+	inv = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), inv), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_mul_ps(length2, inv), inv)));
+	inv = _mm_and_ps(inv, _mm_cmpgt_ps(length2, _mm_setzero_ps()));
+	outX = _mm_mul_ps(dx, inv);
+	outY = _mm_mul_ps(dy, inv);
+	outZ = _mm_mul_ps(dz, inv);
+}
+
+// folds the lower hemisphere over the upper one: v = (1 - |v.yx|) * sign(v) where z is below zero
+static inline void foldOctahedron( __m128 z, __m128& x, __m128& y ) {
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 below = _mm_cmplt_ps(z, _mm_setzero_ps());
+	const __m128 foldedX = _mm_xor_ps(_mm_sub_ps(one, _mm_andnot_ps(signBit, y)), _mm_and_ps(signBit, x));
+	const __m128 foldedY = _mm_xor_ps(_mm_sub_ps(one, _mm_andnot_ps(signBit, x)), _mm_and_ps(signBit, y));
+	x = _mm_or_ps(_mm_and_ps(below, foldedX), _mm_andnot_ps(below, x));
+	y = _mm_or_ps(_mm_and_ps(below, foldedY), _mm_andnot_ps(below, y));
+}
+
+// octahedral encoding: the unit normal projected onto the |x|+|y|+|z| = 1 octahedron, which is then
+// unfolded into the [-1,1] square.  decoding reverses the fold and renormalizes.  in float, a round trip
+// stays within 6e-7 of the three-channel normal per component, and when the two channels are stored as
+// 16-bit half floats, within 2e-3
+static inline void encodeOctahedral( __m128 x, __m128 y, __m128 z, __m128& u, __m128& v ) {
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	const __m128 manhattan = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signBit, x), _mm_andnot_ps(signBit, y)), _mm_andnot_ps(signBit, z));
+	const __m128 inv = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1.0f), manhattan), _mm_cmpgt_ps(manhattan, _mm_setzero_ps()));
+	u = _mm_mul_ps(x, inv);
+	v = _mm_mul_ps(y, inv);
+	foldOctahedron(z, u, v);
+}
+
+static inline void decodeOctahedral( __m128 u, __m128 v, __m128& x, __m128& y, __m128& z ) {
+	const __m128 signBit = _mm_set1_ps(-0.0f);
+	const __m128 height = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), _mm_andnot_ps(signBit, u)), _mm_andnot_ps(signBit, v));
+	foldOctahedron(height, u, v);
+	unit4(u, v, height, x, y, z);
+}
+
+template<int EDGE, int MIDDLE>
+static inline void gradient4( const float* above, const float* centre, const float* below, __m128 signX, __m128 signY, __m128& dx, __m128& dy ) {
+	const __m128 topLeft = _mm_loadu_ps(above);
+	const __m128 topCenter = _mm_loadu_ps(above + 1);
+	const __m128 topRight = _mm_loadu_ps(above + 2);
+	const __m128 centerLeft = _mm_loadu_ps(centre);
+	const __m128 centerRight = _mm_loadu_ps(centre + 2);
+	const __m128 bottomLeft = _mm_loadu_ps(below);
+	const __m128 bottomCenter = _mm_loadu_ps(below + 1);
+	const __m128 bottomRight = _mm_loadu_ps(below + 2);
+
+	// right minus left and bottom minus top, with any flip folded into the signs
+	const __m128 right = _mm_add_ps(_mm_add_ps(weigh<EDGE>(topRight), weigh<MIDDLE>(centerRight)), weigh<EDGE>(bottomRight));
+	const __m128 left = _mm_add_ps(_mm_add_ps(weigh<EDGE>(topLeft), weigh<MIDDLE>(centerLeft)), weigh<EDGE>(bottomLeft));
+	const __m128 bottom = _mm_add_ps(_mm_add_ps(weigh<EDGE>(bottomLeft), weigh<MIDDLE>(bottomCenter)), weigh<EDGE>(bottomRight));
+	const __m128 top = _mm_add_ps(_mm_add_ps(weigh<EDGE>(topLeft), weigh<MIDDLE>(topCenter)), weigh<EDGE>(topRight));
+	dx = _mm_mul_ps(signX, _mm_sub_ps(right, left));
+	dy = _mm_mul_ps(signY, _mm_sub_ps(bottom, top));
+}
+
+// stores the first count lanes, as a row's last few pixels don't fill a whole vector
+static inline void storeLanes( float* out, __m128 v, int count ) {
+	if( count >= 4 ) {
+		_mm_storeu_ps(out, v);
+		return;
+	}
+	float lanes[4];
+	_mm_storeu_ps(lanes, v);
+	for( int i = 0; i < count; ++i ) {
+		out[i] = lanes[i];
+	}
+}
+
+// copies the 3x3 stencil's rows under a row's last few pixels, so that whole vectors can be read from them
+static inline void copyStencil( const float* above, const float* centre, const float* below, int count, float stencil[3][8] ) {
+	for( int i = 0; i < 8; ++i ) {
+		const bool inside = i < count + 2;
+		stencil[0][i] = inside ? above[i] : 0.0f;
+		stencil[1][i] = inside ? centre[i] : 0.0f;
+		stencil[2][i] = inside ? below[i] : 0.0f;
+	}
+}
+
+// writes four pixels' normals and, when asked for, the extra outputs.  these share the normal's gradient
+// and the 3x3 stencil around the pixel, so each costs a few operations on values already in cache:
+// the curvature is the 4-neighbour laplacian and the cavity is how far the pixel sits below the
+// mean of its 8 neighbours.  outputs are written in turn, so one sharing a channel with another wins
+template<bool NORMALIZE, bool EXTRAS>
+static inline void emit4( const Bumpy::RowOutputs& outputs, int i, int count, __m128 dx, __m128 dy, __m128 dz, const float* above, const float* centre, const float* below ) {
+	__m128 nx, ny, nz;
+	unit4(dx, dy, dz, nx, ny, nz);
+	if( Encodings::Xyz != outputs.encoding ) {
+		__m128 u, v;
+		encodeOctahedral(nx, ny, nz, u, v);
+		if( Encodings::Octahedral == outputs.encoding ) {
+			nx = u;
+			ny = v;
+		} else {
+			decodeOctahedral(u, v, nx, ny, nz);
+		}
+	}
+
+	// output raw normal or [0,1] normal
+	if( NORMALIZE ) {
+		const __m128 half = _mm_set1_ps(0.5f);
+		nx = _mm_add_ps(_mm_mul_ps(nx, half), half);
+		ny = _mm_add_ps(_mm_mul_ps(ny, half), half);
+		nz = _mm_add_ps(_mm_mul_ps(nz, half), half);
+	}
+	storeLanes(outputs.normal[0] + i, nx, count - i);
+	storeLanes(outputs.normal[1] + i, ny, count - i);
+	if( outputs.normal[2] != nullptr ) {
+		storeLanes(outputs.normal[2] + i, nz, count - i);
+	}
+	if( !EXTRAS ) {
+		return;
+	}
+
+	if( outputs.slope[0] != nullptr ) {
+		storeLanes(outputs.slope[0] + i, dx, count - i);
+	}
+	if( outputs.slope[1] != nullptr ) {
+		storeLanes(outputs.slope[1] + i, dy, count - i);
+	}
+	if( outputs.curvature != nullptr || outputs.cavity != nullptr ) {
+		const __m128 centerCenter = _mm_loadu_ps(centre + 1);
+		const __m128 cross = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(above + 1), _mm_loadu_ps(below + 1)), _mm_add_ps(_mm_loadu_ps(centre), _mm_loadu_ps(centre + 2)));
+		if( outputs.curvature != nullptr ) {
+			storeLanes(outputs.curvature + i, _mm_sub_ps(cross, _mm_mul_ps(_mm_set1_ps(4.0f), centerCenter)), count - i);
+		}
+		if( outputs.cavity != nullptr ) {
+			const __m128 corners = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(above), _mm_loadu_ps(above + 2)), _mm_add_ps(_mm_loadu_ps(below), _mm_loadu_ps(below + 2)));
+			const __m128 mean = _mm_mul_ps(_mm_add_ps(cross, corners), _mm_set1_ps(0.125f));
+			storeLanes(outputs.cavity + i, _mm_max_ps(_mm_sub_ps(mean, centerCenter), _mm_setzero_ps()), count - i);
+		}
+	}
+}
+
+template<int EDGE, int MIDDLE, bool NORMALIZE, bool EXTRAS>
+void Bumpy::gradientRow( const float* const* rows, int count, float*, const RowOutputs& outputs ) const {
+	const float* above = rows[0];
+	const float* centre = rows[1];
+	const float* below = rows[2];
+	const __m128 signX = _mm_set1_ps(_signX);
+	const __m128 signY = _mm_set1_ps(_signY);
+	const __m128 dz = _mm_set1_ps(_dz);
+	__m128 dx0, dy0, dx1, dy1;
+
+	// eight pixels a time
+	int i = 0;
+	for( ; i + 8 <= count; i += 8 ) {
+		gradient4<EDGE, MIDDLE>(above + i, centre + i, below + i, signX, signY, dx0, dy0);
+		gradient4<EDGE, MIDDLE>(above + i + 4, centre + i + 4, below + i + 4, signX, signY, dx1, dy1);
+		emit4<NORMALIZE, EXTRAS>(outputs, i, count, dx0, dy0, dz, above + i, centre + i, below + i);
+		emit4<NORMALIZE, EXTRAS>(outputs, i + 4, count, dx1, dy1, dz, above + i + 4, centre + i + 4, below + i + 4);
+	}
+	for( ; i + 4 <= count; i += 4 ) {
+		gradient4<EDGE, MIDDLE>(above + i, centre + i, below + i, signX, signY, dx0, dy0);
+		emit4<NORMALIZE, EXTRAS>(outputs, i, count, dx0, dy0, dz, above + i, centre + i, below + i);
+	}
+
+	// the last few pixels go through the same lanes from a copy, as the rows end two pixels past them
+	if( i < count ) {
+		float stencil[3][8];
+		copyStencil(above + i, centre + i, below + i, count - i, stencil);
+		gradient4<EDGE, MIDDLE>(stencil[0], stencil[1], stencil[2], signX, signY, dx0, dy0);
+		emit4<NORMALIZE, EXTRAS>(outputs, i, count, dx0, dy0, dz, stencil[0], stencil[1], stencil[2]);
+	}
+}
+
+template<int EDGE, int MIDDLE>
+Bumpy::GradientRow Bumpy::stencilKernel( bool normalize, bool extras ) {
+	if( normalize ) {
+		return extras ? &Bumpy::gradientRow<EDGE, MIDDLE, true, true> : &Bumpy::gradientRow<EDGE, MIDDLE, true, false>;
+	}
+	return extras ? &Bumpy::gradientRow<EDGE, MIDDLE, false, true> : &Bumpy::gradientRow<EDGE, MIDDLE, false, false>;
+}
+
+// 5x5 sobel and scharr from SobelScharrGradients5x5.pdf.  neither kernel there is separable, so each is
+// its closest smoothing-times-derivative product (keeping 98.1% of the sobel's energy and 97.8% of the
+// scharr's), which costs ten taps a pixel rather than twenty five.  the smoothing sums to one and the derivative is scaled so that a ramp
+// gives the same slope as the 3x3 filter of the same name, keeping strength comparable between them.
+// each row is the smoothing's outer, inner and centre taps followed by the derivative's outer and inner.
+static const float SEPARABLE_KERNELS[2][5] = {
+	{ 0.101560f, 0.212890f, 0.371100f, 1.131212f, 1.737575f }, // sobel 5x5
+	{ 0.092228f, 0.184455f, 0.446634f, 4.453964f, 7.092072f }  // scharr 5x5
+};
+
+template<int KERNEL, bool NORMALIZE, bool EXTRAS>
+void Bumpy::separableRow( const float* const* rows, int count, float* scratch, const RowOutputs& outputs ) const {
+	const float* k = SEPARABLE_KERNELS[KERNEL];
+	const __m128 smoothOuter = _mm_set1_ps(k[0]);
+	const __m128 smoothInner = _mm_set1_ps(k[1]);
+	const __m128 smoothCentre = _mm_set1_ps(k[2]);
+	const __m128 deriveOuter = _mm_set1_ps(k[3]);
+	const __m128 deriveInner = _mm_set1_ps(k[4]);
+
+	// vertical pass: each column smoothed and differentiated bottom minus top.  both are padded
+	// past the stencil so that the horizontal pass can always read whole lanes
+	const int width = count + 4;
+	float* smooth = scratch;
+	float* derive = scratch + width + 4;
+	int i = 0;
+	for( ; i + 4 <= width; i += 4 ) {
+		const __m128 r0 = _mm_loadu_ps(rows[0] + i);
+		const __m128 r1 = _mm_loadu_ps(rows[1] + i);
+		const __m128 r2 = _mm_loadu_ps(rows[2] + i);
+		const __m128 r3 = _mm_loadu_ps(rows[3] + i);
+		const __m128 r4 = _mm_loadu_ps(rows[4] + i);
+		_mm_storeu_ps(smooth + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(smoothOuter, _mm_add_ps(r0, r4)), _mm_mul_ps(smoothInner, _mm_add_ps(r1, r3))), _mm_mul_ps(smoothCentre, r2)));
+		_mm_storeu_ps(derive + i, _mm_add_ps(_mm_mul_ps(deriveOuter, _mm_sub_ps(r4, r0)), _mm_mul_ps(deriveInner, _mm_sub_ps(r3, r1))));
+	}
+	for( ; i < width; ++i ) {
+		smooth[i] = (k[0] * (rows[0][i] + rows[4][i]) + k[1] * (rows[1][i] + rows[3][i])) + k[2] * rows[2][i];
+		derive[i] = k[3] * (rows[4][i] - rows[0][i]) + k[4] * (rows[3][i] - rows[1][i]);
+	}
+	for( int p = 0; p < 4; ++p ) {
+		smooth[width + p] = 0.0f;
+		derive[width + p] = 0.0f;
+	}
+
+	// horizontal pass: the smoothed columns differentiated right minus left give x, the
+	// differentiated columns smoothed give y
+	const __m128 signX = _mm_set1_ps(_signX);
+	const __m128 signY = _mm_set1_ps(_signY);
+	const __m128 dz = _mm_set1_ps(_dz);
+	for( i = 0; i < count; i += 4 ) {
+		const __m128 dx = _mm_add_ps(_mm_mul_ps(deriveOuter, _mm_sub_ps(_mm_loadu_ps(smooth + i + 4), _mm_loadu_ps(smooth + i))), _mm_mul_ps(deriveInner, _mm_sub_ps(_mm_loadu_ps(smooth + i + 3), _mm_loadu_ps(smooth + i + 1))));
+		const __m128 dy = _mm_add_ps(_mm_add_ps(_mm_mul_ps(smoothOuter, _mm_add_ps(_mm_loadu_ps(derive + i), _mm_loadu_ps(derive + i + 4))), _mm_mul_ps(smoothInner, _mm_add_ps(_mm_loadu_ps(derive + i + 1), _mm_loadu_ps(derive + i + 3)))), _mm_mul_ps(smoothCentre, _mm_loadu_ps(derive + i + 2)));
+
+		// the extra outputs use the middle 3x3 of the stencil
+		const float* above = rows[1] + i + 1;
+		const float* centre = rows[2] + i + 1;
+		const float* below = rows[3] + i + 1;
+		float stencil[3][8];
+		if( EXTRAS && i + 4 > count ) {
+			copyStencil(above, centre, below, count - i, stencil);
+			above = stencil[0];
+			centre = stencil[1];
+			below = stencil[2];
+		}
+		emit4<NORMALIZE, EXTRAS>(outputs, i, count, _mm_mul_ps(signX, dx), _mm_mul_ps(signY, dy), dz, above, centre, below);
+	}
+}
+
+template<int KERNEL>
+Bumpy::GradientRow Bumpy::separableKernel( bool normalize, bool extras ) {
+	if( normalize ) {
+		return extras ? &Bumpy::separableRow<KERNEL, true, true> : &Bumpy::separableRow<KERNEL, true, false>;
+	}
+	return extras ? &Bumpy::separableRow<KERNEL, false, true> : &Bumpy::separableRow<KERNEL, false, false>;
+}
+
+template<bool NORMALIZE, bool EXTRAS>
+void Bumpy::pyramidRow( int y, int x, int r, const float* gradientX, const float* gradientY, const RowOutputs& outputs ) const {
+	// the extra outputs' stencil comes from the full resolution level, whose edges are already padded
+	const PyramidLevel& level = _pyramid[0];
+	const float* above = level.heightRow(y+1) + (x-1);
+	const float* centre = level.heightRow(y) + (x-1);
+	const float* below = level.heightRow(y-1) + (x-1);
+	const __m128 dz = _mm_set1_ps(_dz);
+	const int count = r - x;
+	for( int i = 0; i < count; i += 4 ) {
+		// the signs and weights are already in the blended slopes, whose row may end within these lanes
+		__m128 dx, dy;
+		if( i + 4 <= count ) {
+			dx = _mm_loadu_ps(gradientX + i);
+			dy = _mm_loadu_ps(gradientY + i);
+		} else {
+			float lanes[2][4] = {};
+			std::copy(gradientX + i, gradientX + count, lanes[0]);
+			std::copy(gradientY + i, gradientY + count, lanes[1]);
+			dx = _mm_loadu_ps(lanes[0]);
+			dy = _mm_loadu_ps(lanes[1]);
+		}
+		if( EXTRAS && i + 4 > count ) {
+			float stencil[3][8];
+			copyStencil(above + i, centre + i, below + i, count - i, stencil);
+			emit4<NORMALIZE, EXTRAS>(outputs, i, count, dx, dy, dz, stencil[0], stencil[1], stencil[2]);
+		} else {
+			emit4<NORMALIZE, EXTRAS>(outputs, i, count, dx, dy, dz, above + i, centre + i, below + i);
+		}
+	}
+}
+
+void Bumpy::pyramidSpan( int y, int x, int r, const RowOutputs& outputs ) const {
+	// the columns of the span within the pyramid.  a span that misses it altogether makes its one
+	// nearest column into edge, which every pixel then repeats
+	const PyramidLevel& level = _pyramid[0];
+	const int left = std::max<int>(level.x, std::min<int>(x, level.r - 1));
+	const int right = std::max<int>(level.x, std::min<int>(r - 1, level.r - 1)) + 1;
+	const bool inside = left >= x && right <= r;
+	float* targets[7] = { outputs.normal[0], outputs.normal[1], outputs.normal[2], outputs.slope[0], outputs.slope[1], outputs.curvature, outputs.cavity };
+	float edge[7];
+	float* sources[7];
+	for( int k = 0; k < 7; ++k ) {
+		sources[k] = (nullptr == targets[k]) ? nullptr : (inside ? targets[k] + (left - x) : &edge[k]);
+	}
+	RowOutputs spanOutputs = outputs;
+	spanOutputs.normal[0] = sources[0];
+	spanOutputs.normal[1] = sources[1];
+	spanOutputs.normal[2] = sources[2];
+	spanOutputs.slope[0] = sources[3];
+	spanOutputs.slope[1] = sources[4];
+	spanOutputs.curvature = sources[5];
+	spanOutputs.cavity = sources[6];
+
+	const int row = (std::max<int>(level.y, std::min<int>(y, level.t - 1)) - level.y) * (level.r - level.x) + (left - level.x);
+	(this->*_pyramidRow)(y, left, right, &level.dx[row], &level.dy[row], spanOutputs);
+
+	if( left == x && right == r ) {
+		return;
+	}
+	for( int k = 0; k < 7; ++k ) {
+		if( nullptr == targets[k] ) {
+			continue;
+		}
+		const float first = sources[k][0];
+		const float last = sources[k][right - left - 1];
+		for( int currX = x; currX < std::min<int>(left, r); ++currX ) {
+			targets[k][currX - x] = first;
+		}
+		for( int currX = std::max<int>(right, x); currX < r; ++currX ) {
+			targets[k][currX - x] = last;
+		}
+	}
+}
+
+const float* Bumpy::PyramidLevel::heightRow( int row ) const {
+	const int clamped = std::max<int>(y - PYRAMID_PAD, std::min<int>(row, t - 1 + PYRAMID_PAD));
+	return &height[(clamped - y + PYRAMID_PAD) * stride + PYRAMID_PAD] - x;
+}
+
+void Bumpy::updatePyramid() {
+	// the heights only change with the input, and the slopes with the filter, its signs and the weights.
+	// the strength is applied per row
+	const DD::Image::Hash& hash = input0().hash();
+	const bool heights = !_pyramid.empty() && _pyramidHash == hash && _pyramidChannel == _sourceChannel && static_cast<int>(_pyramid.size()) == _levels;
+	bool slopes = heights && _pyramidFilter == _filterType && _pyramidSigns[0] == _signX && _pyramidSigns[1] == _signY;
+	for( int l = 0; l < _levels; ++l ) {
+		slopes = slopes && _pyramidWeights[l] == _levelWeights[l];
+	}
+	if( slopes ) {
+		return;
+	}
+
+	buildPyramid(heights);
+	if( aborted() ) {
+		_pyramid.clear();
+		return;
+	}
+	_pyramidHash = hash;
+	_pyramidChannel = _sourceChannel;
+	_pyramidFilter = _filterType;
+	_pyramidSigns[0] = _signX;
+	_pyramidSigns[1] = _signY;
+	for( int l = 0; l < _levels; ++l ) {
+		_pyramidWeights[l] = _levelWeights[l];
+	}
+}
+
+static int floorHalf( int v ) {
+	return (v >= 0) ? (v / 2) : -((1 - v) / 2);
+}
+
+void Bumpy::buildPyramid( bool keepHeights ) {
+	const int threads = std::max<int>(1, static_cast<int>(DD::Image::Thread::numThreads));
+	PyramidJob job;
+	job.bumpy = this;
+
+	if( !keepHeights ) {
+		_pyramid.clear();
+		const DD::Image::Box& bbox = input0().info();
+		if( bbox.w() <= 0 || bbox.h() <= 0 ) {
+			return;
+		}
+
+		// each level covers the one before it, so an odd edge gets a pixel of its own
+		_pyramid.resize(_levels);
+		for( int l = 0; l < _levels; ++l ) {
+			PyramidLevel& level = _pyramid[l];
+			if( 0 == l ) {
+				level.x = bbox.x();
+				level.y = bbox.y();
+				level.r = bbox.r();
+				level.t = bbox.t();
+			} else {
+				const PyramidLevel& finer = _pyramid[l-1];
+				level.x = floorHalf(finer.x);
+				level.y = floorHalf(finer.y);
+				level.r = -floorHalf(-finer.r);
+				level.t = -floorHalf(-finer.t);
+			}
+			const int width = level.r - level.x;
+			const int height = level.t - level.y;
+			level.stride = width + 2 * PYRAMID_PAD;
+			level.height.assign(level.stride * (height + 2 * PYRAMID_PAD), 0.0f);
+			level.dx.assign(width * height, 0.0f);
+			level.dy.assign(width * height, 0.0f);
+		}
+
+		// each level is filtered from the one before
+		job.stage = PyramidJob::Heights;
+		for( int l = 0; l < _levels; ++l ) {
+			job.level = l;
+			DD::Image::Thread::spawn(pyramidThread, threads, &job);
+			DD::Image::Thread::wait(&job);
+			if( aborted() ) {
+				return;
+			}
+			padPyramidLevel(_pyramid[l]);
+		}
+	}
+
+	// every level's slopes, then collapsed from the coarsest so that the full resolution level holds the blend
+	job.stage = PyramidJob::Slopes;
+	for( int l = 0; l < _levels; ++l ) {
+		job.level = l;
+		DD::Image::Thread::spawn(pyramidThread, threads, &job);
+		DD::Image::Thread::wait(&job);
+		if( aborted() ) {
+			return;
+		}
+	}
+	job.stage = PyramidJob::Collapse;
+	for( int l = _levels - 1; l >= 0; --l ) {
+		job.level = l;
+		DD::Image::Thread::spawn(pyramidThread, threads, &job);
+		DD::Image::Thread::wait(&job);
+		if( aborted() ) {
+			return;
+		}
+	}
+}
+
+void Bumpy::padPyramidLevel( PyramidLevel& level ) {
+	// rows already repeat their ends; the rows above and below repeat the top and bottom rows
+	const int height = level.t - level.y;
+	for( int p = 0; p < PYRAMID_PAD; ++p ) {
+		std::copy(&level.height[PYRAMID_PAD * level.stride], &level.height[(PYRAMID_PAD + 1) * level.stride], &level.height[p * level.stride]);
+		std::copy(&level.height[(PYRAMID_PAD + height - 1) * level.stride], &level.height[(PYRAMID_PAD + height) * level.stride], &level.height[(PYRAMID_PAD + height + p) * level.stride]);
+	}
+}
+
+void Bumpy::pyramidThread( unsigned index, unsigned nThreads, void* data ) {
+	// each thread takes interleaved rows of the level
+	PyramidJob* job = static_cast<PyramidJob*>(data);
+	Bumpy* bumpy = job->bumpy;
+	PyramidLevel& level = bumpy->_pyramid[job->level];
+	const int width = level.r - level.x;
+
+	switch( job->stage ) {
+		case PyramidJob::Heights: {
+			DD::Image::Row row(level.x, level.r);
+			for( int y = level.y + static_cast<int>(index); y < level.t; y += static_cast<int>(nThreads) ) {
+				if( bumpy->aborted() ) {
+					return;
+				}
+				float* out = &level.height[(y - level.y + PYRAMID_PAD) * level.stride + PYRAMID_PAD] - level.x;
+				if( 0 == job->level ) {
+					bumpy->input0().get(y, level.x, level.r, bumpy->_inputChannels, row);
+					const float* in = row[bumpy->_sourceChannel];
+					std::copy(in + level.x, in + level.r, out + level.x);
+				} else {
+					// a 2x2 box of the finer level, whose padding stands in for pixels past its edges
+					const PyramidLevel& finer = bumpy->_pyramid[job->level - 1];
+					const float* upper = finer.heightRow(2*y+1);
+					const float* lower = finer.heightRow(2*y);
+					for( int x = level.x; x < level.r; ++x ) {
+						out[x] = ((lower[2*x] + lower[2*x+1]) + (upper[2*x] + upper[2*x+1])) * 0.25f;
+					}
+				}
+				for( int p = 1; p <= PYRAMID_PAD; ++p ) {
+					out[level.x - p] = out[level.x];
+					out[level.r - 1 + p] = out[level.r - 1];
+				}
+			}
+			break;
+		}
+
+		case PyramidJob::Slopes: {
+			// the filter's own row kernel, with the normals it also makes thrown away
+			const int radius = bumpy->_radius;
+			std::vector<float> scratch(2 * (width + 2 * radius) + 8);
+			std::vector<float> normals(3 * width);
+			Bumpy::RowOutputs outputs;
+			for( int i = 0; i < 3; ++i ) {
+				outputs.normal[i] = &normals[i * width];
+			}
+			outputs.encoding = Encodings::Xyz;
+			outputs.curvature = nullptr;
+			outputs.cavity = nullptr;
+			for( int y = level.y + static_cast<int>(index); y < level.t; y += static_cast<int>(nThreads) ) {
+				if( bumpy->aborted() ) {
+					return;
+				}
+				const float* rows[RING_SIZE];
+				for( int i = 0; i <= 2*radius; ++i ) {
+					rows[i] = level.heightRow(y+radius-i) + (level.x-radius);
+				}
+				outputs.slope[0] = &level.dx[(y - level.y) * width];
+				outputs.slope[1] = &level.dy[(y - level.y) * width];
+				(bumpy->*bumpy->_levelGradientRow)(rows, width, &scratch[0], outputs);
+			}
+			break;
+		}
+
+		case PyramidJob::Collapse: {
+			// a level's pixel spans 2^l of the source's, so its slopes are that much steeper.  the coarser
+			// level, already holding everything below it, is sampled bilinearly at this level's pixel centres,
+			// clamped to its edges: its two rows around this one are mixed, then stepped across at half a pixel
+			const float scaled = bumpy->_levelWeights[job->level] / float(1 << job->level);
+			const bool coarsest = (job->level + 1 == static_cast<int>(bumpy->_pyramid.size()));
+			const PyramidLevel* coarse = coarsest ? nullptr : &bumpy->_pyramid[job->level + 1];
+			const int columns = coarsest ? 0 : (coarse->r - coarse->x);
+			std::vector<float> mixed(2 * (columns + 2));
+			for( int y = level.y + static_cast<int>(index); y < level.t; y += static_cast<int>(nThreads) ) {
+				if( bumpy->aborted() ) {
+					return;
+				}
+				float* dx = &level.dx[(y - level.y) * width];
+				float* dy = &level.dy[(y - level.y) * width];
+				for( int i = 0; i < width; ++i ) {
+					dx[i] *= scaled;
+					dy[i] *= scaled;
+				}
+				if( coarsest ) {
+					continue;
+				}
+
+				const float v = (float(y) + 0.5f) * 0.5f - 0.5f;
+				const int row0 = int(floorf(v));
+				const float fy = v - float(row0);
+				const int rowA = (std::max<int>(coarse->y, std::min<int>(row0, coarse->t - 1)) - coarse->y) * columns;
+				const int rowB = (std::max<int>(coarse->y, std::min<int>(row0 + 1, coarse->t - 1)) - coarse->y) * columns;
+				float* mixedX = &mixed[0];
+				float* mixedY = &mixed[columns + 2];
+				for( int c = 0; c < columns; ++c ) {
+					mixedX[c + 1] = coarse->dx[rowA + c] + (coarse->dx[rowB + c] - coarse->dx[rowA + c]) * fy;
+					mixedY[c + 1] = coarse->dy[rowA + c] + (coarse->dy[rowB + c] - coarse->dy[rowA + c]) * fy;
+				}
+				mixedX[0] = mixedX[1];
+				mixedY[0] = mixedY[1];
+				mixedX[columns + 1] = mixedX[columns];
+				mixedY[columns + 1] = mixedY[columns];
+
+				// pixel x sits at coarse (x+0.5)/2-0.5, between coarse pixels c and c+1 a quarter or three quarters across
+				for( int i = 0; i < width; ++i ) {
+					const int x = level.x + i;
+					const int c = floorHalf(x - 1) - coarse->x + 1;
+					const float fx = (x & 1) ? 0.25f : 0.75f;
+					dx[i] += mixedX[c] + (mixedX[c + 1] - mixedX[c]) * fx;
+					dy[i] += mixedY[c] + (mixedY[c + 1] - mixedY[c]) * fx;
+				}
+			}
+			break;
+		}
+	}
 }
\ No newline at end of file
@@ -1,4 +1,6 @@
 #include <DDImage/Iop.h>
+#include <DDImage/Thread.h>
+#include <vector>
 
 class Bumpy : public DD::Image::Iop {
 public:
@@ -8,6 +10,7 @@ public:
 	virtual void knobs( DD::Image::Knob_Callback f ) override;
 	virtual void _validate( bool for_real ) override;
 	virtual void _request( int x, int y, int r, int t, DD::Image::ChannelMask channels, int count ) override;
+	virtual void _open() override;
 	virtual void engine( int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out) override;
 
 public:
@@ -15,22 +18,126 @@ public:
 	virtual const char* node_help() const override;
 	static const DD::Image::Iop::Description description;
 
+public:
+	// where a row's results go, each starting at the row's first pixel.  extra outputs not asked for are null
+	struct RowOutputs {
+		float* normal[3];
+		float* slope[2];
+		float* curvature;
+		float* cavity;
+		int encoding; // how the normal is written; normal[2] is null when it only takes two channels
+	};
+
+private:
+	// computes a row of normals (and any extra outputs) from the stencil's rows, top first, each starting at the
+	// stencil's left column.  the scratch holds two rows of the stencil's width plus eight floats
+	typedef void (Bumpy::*GradientRow)( const float* const* rows, int count, float* scratch, const RowOutputs& outputs ) const;
+	template<int EDGE, int MIDDLE, bool NORMALIZE, bool EXTRAS>
+	void gradientRow( const float* const* rows, int count, float* scratch, const RowOutputs& outputs ) const;
+	template<int KERNEL, bool NORMALIZE, bool EXTRAS>
+	void separableRow( const float* const* rows, int count, float* scratch, const RowOutputs& outputs ) const;
+	template<int EDGE, int MIDDLE>
+	static GradientRow stencilKernel( bool normalize, bool extras );
+	template<int KERNEL>
+	static GradientRow separableKernel( bool normalize, bool extras );
+
+	// writes a row of normals (and any extra outputs) from the pyramid's blended slopes
+	typedef void (Bumpy::*PyramidRow)( int y, int x, int r, const float* gradientX, const float* gradientY, const RowOutputs& outputs ) const;
+	template<bool NORMALIZE, bool EXTRAS>
+	void pyramidRow( int y, int x, int r, const float* gradientX, const float* gradientY, const RowOutputs& outputs ) const;
+	// any span of a multi-scale row; pixels outside the pyramid repeat its edge columns
+	void pyramidSpan( int y, int x, int r, const RowOutputs& outputs ) const;
+
+private:
+	// the source channel's rows around the current one (padded by the stencil's radius either side),
+	// kept across calls so that a thread moving down one row only fetches the row entering the
+	// stencil.  row y lives in slot y % RING_SIZE, and a slot holding another row is refetched.
+	enum { RING_SIZE = 5 };
+	struct RowRing {
+		bool inUse;
+		int x;
+		int r;
+		DD::Image::Row* rows[RING_SIZE];
+		int ys[RING_SIZE];
+		std::vector<float> scratch;
+
+		RowRing( int x, int r );
+		~RowRing();
+	private:
+		RowRing( const RowRing& );
+		RowRing& operator=( const RowRing& );
+	};
+	RowRing* acquireRing( int y, int x, int r );
+	void releaseRing( RowRing* ring );
+	void resetRings();
+	const DD::Image::Row& ringRow( RowRing& ring, int y );
+
 private:
-	DD::Image::Vector3 sobelFilter( const int x, const DD::Image::Row& in0, const DD::Image::Row& in1, const DD::Image::Row& in2 ) const;
-	DD::Image::Vector3 scharrFilter( const int x, const DD::Image::Row& in0, const DD::Image::Row& in1, const DD::Image::Row& in2 ) const;
-	DD::Image::Vector3 prewittFilter( const int x, const DD::Image::Row& in0, const DD::Image::Row& in1, const DD::Image::Row& in2 ) const;
+	// the multi-scale mode's source pyramid over the input's bounding box, each level a 2x2 box filter of
+	// the one before.  every level's slopes come from the chosen filter, and are collapsed coarsest first
+	// into the full resolution level's, so a row reads one blended slope per pixel however many levels
+	// there are.  it is built in _open, before any row, and only read by the rows; changing only the
+	// filter or weights keeps the heights.  heights are padded by PYRAMID_PAD with the edges.
+	enum { MAX_LEVELS = 6, PYRAMID_PAD = 2 };
+	struct PyramidLevel {
+		int x;
+		int y;
+		int r;
+		int t;
+		int stride;
+		std::vector<float> height;
+		std::vector<float> dx;
+		std::vector<float> dy;
+
+		const float* heightRow( int row ) const; // indexable from x-PYRAMID_PAD to r+PYRAMID_PAD
+	};
+	struct PyramidJob {
+		enum Stage { Heights, Slopes, Collapse };
+		Bumpy* bumpy;
+		Stage stage;
+		int level;
+	};
+	void updatePyramid();
+	void buildPyramid( bool keepHeights );
+	void padPyramidLevel( PyramidLevel& level );
+	static void pyramidThread( unsigned index, unsigned nThreads, void* data );
 
 private:
 	DD::Image::Channel _sourceChannel;
 	DD::Image::Channel _normalChannels[3];
+	DD::Image::Channel _slopeChannels[2];
+	DD::Image::Channel _curvatureChannel;
+	DD::Image::Channel _cavityChannel;
 	float _strength;
 	bool _invertX;
 	bool _invertY;
 	bool _invertZ;
 	bool _normalize;
+	int _encoding;
 
 	DD::Image::ChannelSet _inputChannels;
 	DD::Image::ChannelSet _outputChannels;
 
 	int _filterType;
+	int _levels;
+	float _levelWeights[MAX_LEVELS];
+
+	GradientRow _gradientRow;
+	int _radius;
+	bool _extras;
+	float _signX;
+	float _signY;
+	float _dz;
+
+	std::vector<RowRing*> _rings;
+	DD::Image::Lock _ringsLock;
+
+	GradientRow _levelGradientRow; // raw slopes only, for the pyramid's levels
+	PyramidRow _pyramidRow;
+	std::vector<PyramidLevel> _pyramid;
+	DD::Image::Hash _pyramidHash;
+	DD::Image::Channel _pyramidChannel;
+	int _pyramidFilter;
+	float _pyramidSigns[2];
+	float _pyramidWeights[MAX_LEVELS];
 };
\ No newline at end of file
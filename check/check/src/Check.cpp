@@ -1,5 +1,8 @@
 #include "Check.hpp"
 #include <DDImage/Knobs.h>
+#include <emmintrin.h>
+#include <cmath>
+#include <algorithm>
 
 static const char* CLASS = "Check";
 static const char* HELP = "Makes a badass checkerboard.";
@@ -86,6 +89,21 @@ Check::Check( Node* node )
 	_offsetY = 0.0f;
 	_rotationCenter[0] = 0.0f;
 	_rotationCenter[1] = 0.0f;
+	_boxFilter = false;
+	_drawable = false;
+	_uPerX = 0.0;
+	_uPerY = 0.0;
+	_uOrigin = 0.0;
+	_vPerX = 0.0;
+	_vPerY = 0.0;
+	_vOrigin = 0.0;
+	_fuzz = 0.0f;
+	_footprintU = 0.0f;
+	_footprintV = 0.0f;
+	_spanFill = false;
+	_bandRowsValid = false;
+	_bandX = 0;
+	_bandR = 0;
 }
 
 Check::~Check() {
@@ -102,46 +120,206 @@ void Check::knobs( DD::Image::Knob_Callback f ) {
 	DD::Image::Float_knob(f, &_fuzzy, "fuzzy", "Fuzzy");
 	DD::Image::Float_knob(f, &_angle, "rotation", "Rotation (degrees)");
 	DD::Image::XY_knob(f, &_rotationCenter[0], "rotationpivot", "Rotation Pivot");
+	DD::Image::Bool_knob(f, &_boxFilter, "boxfilter", "Box Filter");
+	DD::Image::Tooltip(f, "Each pixel gets the checker's coverage over a box around it instead of a single sample, "
+		"so edges are anti-aliased and fine checkers fade to grey.  The coverage is exact when Rotation is 0; otherwise "
+		"the box is the one that bounds the rotated pixel, which softens edges a little more, most at 45 degrees.  "
+		"Fuzzy then widens the box by that percentage of a square.");
 
 	// outputs
 	output_knobs(f);
 }
 
+// the checker repeats every two squares, so a row's starting coordinates are brought into [0,2) in double;
+// the pattern is then exact however far the row is from the origin, and the floats stepped across it stay small
+static inline float wrapPeriod( double value ) {
+	return static_cast<float>(value - 2.0 * floor(value * 0.5));
+}
+
 void Check::_validate( bool for_real ) {
 	DrawIop::_validate(for_real);
+
+	// u = (c*(x-px) + s*(y-py)) / scaleX + offsetX and v = (c*(y-py) - s*(x-px)) / scaleY + offsetY,
+	// each square being one unit of u and v
+	_drawable = (_scaleX != 0.0f) && (_scaleY != 0.0f);
+	if( !_drawable ) {
+		return;
+	}
+	const double DEG_TO_RAD = 0.017453292519943295;
+	const double c = cos(_angle * DEG_TO_RAD);
+	const double s = sin(_angle * DEG_TO_RAD);
+	const double pivotX = -_rotationCenter[0];
+	const double pivotY = -_rotationCenter[1];
+	_uPerX = c / _scaleX;
+	_uPerY = s / _scaleX;
+	_uOrigin = (c * pivotX + s * pivotY) / _scaleX + _offsetX;
+	_vPerX = -s / _scaleY;
+	_vPerY = c / _scaleY;
+	_vOrigin = (c * pivotY - s * pivotX) / _scaleY + _offsetY;
+
+	// fuzzy is a percentage of a square.  a pixel covers this much of u and v
+	_fuzz = (_fuzzy > 0.0f) ? (_fuzzy / 100.0f) : 0.0f;
+	_footprintU = static_cast<float>(fabs(_uPerX) + fabs(_uPerY)) + _fuzz;
+	_footprintV = static_cast<float>(fabs(_vPerX) + fabs(_vPerY)) + _fuzz;
+
+	// finding a span's end costs about what drawRow spends on a hundred pixels, so only fill spans that
+	// average over 128 pixels
+	const bool hard = !_boxFilter && (_fuzz == 0.0f);
+	_spanFill = hard && (fabs(_uPerX) + fabs(_vPerX) <= 1.0 / 128.0);
+
+	_bandRowsValid = hard && (_uPerY == 0.0) && (_vPerX == 0.0) && (info_.r() > info_.x());
+	if( _bandRowsValid ) {
+		_bandX = info_.x();
+		_bandR = info_.r();
+		const float uStart = wrapPeriod(_uPerX * _bandX + _uOrigin);
+		for( int parity = 0; parity < 2; ++parity ) {
+			_bandRows[parity].resize(_bandR - _bandX);
+			if( _spanFill ) {
+				fillSpans(uStart, static_cast<float>(parity), &_bandRows[parity][0], _bandR - _bandX);
+			} else {
+				drawRow(uStart, static_cast<float>(parity), &_bandRows[parity][0], _bandR - _bandX);
+			}
+		}
+	}
+}
+
+static inline __m128 floor4( __m128 v ) {
+	const __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+	return _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, v), _mm_set1_ps(1.0f)));
+}
+
+// smoothPulse(0, fuzz, 1-fuzz, 1, t) for t in [0,1): smoothstep up over the first fuzz and down over the last
+static inline __m128 smoothPulse4( __m128 t, __m128 fuzz, __m128 invFuzz ) {
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 rising = _mm_cmplt_ps(t, fuzz);
+	__m128 w = _mm_mul_ps(_mm_or_ps(_mm_and_ps(rising, t), _mm_andnot_ps(rising, _mm_sub_ps(one, t))), invFuzz);
+	w = _mm_min_ps(w, one);
+	return _mm_mul_ps(_mm_mul_ps(w, w), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_add_ps(w, w)));
+}
+
+// the integral of the square wave that is +1 on even squares and -1 on odd ones: a triangle wave
+static inline __m128 integratedSquare4( __m128 u ) {
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 phase = _mm_sub_ps(u, _mm_mul_ps(_mm_set1_ps(2.0f), floor4(_mm_mul_ps(u, _mm_set1_ps(0.5f)))));
+	return _mm_sub_ps(one, _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(phase, one)));
+}
+
+// the square wave's mean over [u - width/2, u + width/2]
+static inline __m128 boxedSquare4( __m128 u, __m128 halfWidth, __m128 invWidth ) {
+	return _mm_mul_ps(_mm_sub_ps(integratedSquare4(_mm_add_ps(u, halfWidth)), integratedSquare4(_mm_sub_ps(u, halfWidth))), invWidth);
+}
+
+// floorf without the library call, for the magnitudes wrapPeriod leaves
+static inline int floorToInt( float value ) {
+	const int truncated = static_cast<int>(value);
+	return truncated - (static_cast<float>(truncated) > value ? 1 : 0);
+}
+
+// the first index after i whose square differs from i's, or count.  found from the crossing's position and
+// then settled against the same float stepping drawRow uses, so both paths agree on every edge
+static inline int nextSquare( float start, float step, float invStep, int i, int count ) {
+	if( step == 0.0f ) {
+		return count;
+	}
+	const int square = floorToInt(start + static_cast<float>(i) * step);
+	const float edge = static_cast<float>((step > 0.0f) ? (square + 1) : square);
+	const float estimate = (edge - start) * invStep;
+	int j = (estimate >= static_cast<float>(count)) ? count : std::max<int>(i + 1, static_cast<int>(estimate));
+	while( j > i + 1 && floorToInt(start + static_cast<float>(j - 1) * step) != square ) {
+		--j;
+	}
+	while( j < count && floorToInt(start + static_cast<float>(j) * step) == square ) {
+		++j;
+	}
+	return j;
+}
+
+void Check::fillSpans( float uStart, float vStart, float* out, int count ) const {
+	const float uStep = static_cast<float>(_uPerX);
+	const float vStep = static_cast<float>(_vPerX);
+	const float invUStep = (uStep != 0.0f) ? (1.0f / uStep) : 0.0f;
+	const float invVStep = (vStep != 0.0f) ? (1.0f / vStep) : 0.0f;
+	int i = 0;
+	while( i < count ) {
+		const int squareU = floorToInt(uStart + static_cast<float>(i) * uStep);
+		const int squareV = floorToInt(vStart + static_cast<float>(i) * vStep);
+		const int end = std::min<int>(nextSquare(uStart, uStep, invUStep, i, count), nextSquare(vStart, vStep, invVStep, i, count));
+		std::fill(out + i, out + end, static_cast<float>((squareU + squareV) & 1));
+		i = end;
+	}
 }
 
 bool Check::draw_engine( int y, int x, int r, float* buffer ) {
-	const float rotationCenterX = -_rotationCenter[0];
-	const float rotationCenterY = -_rotationCenter[1];
-
-	const float DEG_TO_RAD = 0.0174532924f;
-	const float c = cosf(_angle * DEG_TO_RAD);
-	const float s = sinf(_angle * DEG_TO_RAD);
-	const float m00 = c;
-	const float m01 = s;
-	const float m10 = -s;
-	const float m11 = c;
-
-	for( int currX = x; currX < r; ++currX ) {
-		const float nx = ((m00 * (static_cast<float>(currX) + rotationCenterX) + m01 * (static_cast<float>(y) + rotationCenterY)) / _scaleX);
-		const float ny = ((m10 * (static_cast<float>(currX) + rotationCenterX) + m11 * (static_cast<float>(y) + rotationCenterY)) / _scaleY);
-		float f = (int)(nx + _offsetX + 100000.0f) % 2 != (int)(ny + _offsetY + 100000.0f) % 2 ? 1.0f : 0.0f;
-		if( _fuzzy != 0 ) {
-			const float fuzz = _fuzzy / 100.0f;
-			const float fx = ccmath::smoothPulse(0.0f, fuzz, 1.0f - fuzz, 1.0f, fmodf((nx + _offsetX + 100000.0f), 1.0f));
-			const float fy = ccmath::smoothPulse(0.0f, fuzz, 1.0f - fuzz, 1.0f, fmodf((ny + _offsetY + 100000.0f), 1.0f));
-			//const float fx = ccmath::smoothstep(0.0f, 1.0f-fuzz, fmodf(nx + _offsetX, 1.0f));
-			//const float fy = ccmath::smoothstep(0.0f, 1.0f-fuzz, fmodf(ny + _offsetY, 1.0f));
-			f *= fx * fy;
-		}
-		const float newColor = ccmath::lerp<float>(0.0f, 1.0f, f);
-		buffer[currX] = newColor;
+	if( !_drawable ) {
+		return false;
+	}
+
+	// the box is centred on the pixel; point samples stay on its corner, where they have always been
+	const double centre = _boxFilter ? 0.5 : 0.0;
+	const float vStart = wrapPeriod(_vPerX * (x + centre) + _vPerY * (y + centre) + _vOrigin);
+	if( _bandRowsValid && x >= _bandX && r <= _bandR ) {
+		const std::vector<float>& band = _bandRows[floorToInt(vStart) & 1];
+		std::copy(&band[0] + (x - _bandX), &band[0] + (r - _bandX), buffer + x);
+		return true;
+	}
+
+	const float uStart = wrapPeriod(_uPerX * (x + centre) + _uPerY * (y + centre) + _uOrigin);
+	if( _spanFill ) {
+		fillSpans(uStart, vStart, buffer + x, r - x);
+	} else {
+		drawRow(uStart, vStart, buffer + x, r - x);
 	}
-	
 	return true;
 }
 
+void Check::drawRow( float uStart, float vStart, float* out, int count ) const {
+	const __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+	const __m128 uStep = _mm_set1_ps(static_cast<float>(_uPerX));
+	const __m128 vStep = _mm_set1_ps(static_cast<float>(_vPerX));
+	const __m128 half = _mm_set1_ps(0.5f);
+
+	// the box filter's coverage is 1/2 - 1/2 * (mean square wave in u) * (mean square wave in v), taken
+	// over the box around the pixel's footprint in checker space
+	const __m128 halfWidthU = _mm_set1_ps(_footprintU * 0.5f);
+	const __m128 halfWidthV = _mm_set1_ps(_footprintV * 0.5f);
+	const __m128 invWidthU = _mm_set1_ps(1.0f / _footprintU);
+	const __m128 invWidthV = _mm_set1_ps(1.0f / _footprintV);
+	const __m128 fuzz = _mm_set1_ps(_fuzz);
+	const __m128 invFuzz = _mm_set1_ps((_fuzz > 0.0f) ? (1.0f / _fuzz) : 0.0f);
+
+	for( int i = 0; i < count; i += 4 ) {
+		// stepped from the row's start rather than accumulated, so no error builds up along the row
+		const __m128 index = _mm_add_ps(_mm_set1_ps(static_cast<float>(i)), lane);
+		const __m128 u = _mm_add_ps(_mm_set1_ps(uStart), _mm_mul_ps(index, uStep));
+		const __m128 v = _mm_add_ps(_mm_set1_ps(vStart), _mm_mul_ps(index, vStep));
+
+		__m128 f;
+		if( _boxFilter ) {
+			f = _mm_sub_ps(half, _mm_mul_ps(half, _mm_mul_ps(boxedSquare4(u, halfWidthU, invWidthU), boxedSquare4(v, halfWidthV, invWidthV))));
+			f = _mm_min_ps(_mm_max_ps(f, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+		} else {
+			// white where the squares' indices differ in parity
+			const __m128 squareU = floor4(u);
+			const __m128 squareV = floor4(v);
+			const __m128i parity = _mm_and_si128(_mm_add_epi32(_mm_cvttps_epi32(squareU), _mm_cvttps_epi32(squareV)), _mm_set1_epi32(1));
+			f = _mm_cvtepi32_ps(parity);
+			if( _fuzz > 0.0f ) {
+				f = _mm_mul_ps(f, _mm_mul_ps(smoothPulse4(_mm_sub_ps(u, squareU), fuzz, invFuzz), smoothPulse4(_mm_sub_ps(v, squareV), fuzz, invFuzz)));
+			}
+		}
+
+		if( i + 4 <= count ) {
+			_mm_storeu_ps(out + i, f);
+		} else {
+			float lanes[4];
+			_mm_storeu_ps(lanes, f);
+			for( int k = 0; k < count - i; ++k ) {
+				out[i + k] = lanes[k];
+			}
+		}
+	}
+}
+
 const char* Check::Class() const {
 	return CLASS;
 }
@@ -3,6 +3,7 @@
 
 #include <DDImage/DrawIop.h>
 #include <DDImage/LookupCurves.h>
+#include <vector>
 
 class Check : public DD::Image::DrawIop {
 public:
@@ -15,6 +16,10 @@ public:
 	virtual const char* Class() const override;
 	virtual const char* node_help() const override;
 
+private:
+	void drawRow( float uStart, float vStart, float* out, int count ) const;
+	void fillSpans( float uStart, float vStart, float* out, int count ) const;
+
 public:
 	static const DD::Image::Iop::Description description;
 
@@ -26,6 +31,30 @@ private:
 	float _offsetX;
 	float _offsetY;
 	float _rotationCenter[2];
+	bool _boxFilter;
+
+	// the checker coordinates are affine in the pixel position, so a row starts from its first pixel
+	// and steps by the per-x terms.  set in _validate
+	bool _drawable;
+	double _uPerX;
+	double _uPerY;
+	double _uOrigin;
+	double _vPerX;
+	double _vPerY;
+	double _vOrigin;
+	float _fuzz;
+	float _footprintU;
+	float _footprintV;
+
+	// a hard checker is runs of 0 and 1, filled span by span when the squares are wide enough
+	bool _spanFill;
+
+	// unrotated, a hard checker has only two distinct rows (which band parity y falls in), so both are
+	// drawn over the bounding box in _validate and each engine row copies one
+	bool _bandRowsValid;
+	int _bandX;
+	int _bandR;
+	std::vector<float> _bandRows[2];
 };
 
 #endif /* __gradient__ */
\ No newline at end of file
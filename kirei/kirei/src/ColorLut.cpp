@@ -0,0 +1,318 @@
+#include "ColorLut.hpp"
+#include "CpuFeatures.hpp"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <emmintrin.h>
+
+// selects a where mask is set and b elsewhere
+static inline __m128 select( __m128 mask, __m128 a, __m128 b ) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+template<int LANE>
+static inline __m128 broadcast( __m128 v ) {
+	return _mm_shuffle_ps(v, v, _MM_SHUFFLE(LANE, LANE, LANE, LANE));
+}
+
+// weighted sum of the four corners of one lane's tetrahedron
+template<int LANE>
+static inline __m128 tetrahedron( const float* data, const int* base, const int* v1, const int* v2, int v3, __m128 w0, __m128 w1, __m128 w2, __m128 w3 ) {
+	const float* entry = data + base[LANE];
+	__m128 acc = _mm_mul_ps(broadcast<LANE>(w0), _mm_loadu_ps(entry));
+	acc = _mm_add_ps(acc, _mm_mul_ps(broadcast<LANE>(w1), _mm_loadu_ps(entry + v1[LANE])));
+	acc = _mm_add_ps(acc, _mm_mul_ps(broadcast<LANE>(w2), _mm_loadu_ps(entry + v2[LANE])));
+	acc = _mm_add_ps(acc, _mm_mul_ps(broadcast<LANE>(w3), _mm_loadu_ps(entry + v3)));
+	return acc;
+}
+
+ColorLut::ColorLut()
+	: _size(0) {
+	for( int c = 0; c < 3; ++c ) {
+		_domainMin[c] = 0.0f;
+		_domainMax[c] = 1.0f;
+	}
+}
+
+ColorLut::~ColorLut() {
+}
+
+void ColorLut::resize( int size ) {
+	_size = size;
+	_data.assign(4 * size * size * size, 0.0f);
+}
+
+int ColorLut::size() const {
+	return _size;
+}
+
+void ColorLut::setDomain( const float* domainMin, const float* domainMax ) {
+	for( int c = 0; c < 3; ++c ) {
+		_domainMin[c] = domainMin[c];
+		_domainMax[c] = domainMax[c];
+	}
+}
+
+const float* ColorLut::domainMin() const {
+	return _domainMin;
+}
+
+const float* ColorLut::domainMax() const {
+	return _domainMax;
+}
+
+float ColorLut::latticeValue( int axis, int index ) const {
+	const float t = static_cast<float>(index) / static_cast<float>(_size - 1);
+	return _domainMin[axis] + t * (_domainMax[axis] - _domainMin[axis]);
+}
+
+void ColorLut::set( int r, int g, int b, float red, float green, float blue ) {
+	float* entry = &_data[4 * (r + _size * (g + _size * b))];
+	entry[0] = red;
+	entry[1] = green;
+	entry[2] = blue;
+	entry[3] = 0.0f;
+}
+
+void ColorLut::apply( float* rPtr, float* gPtr, float* bPtr, int count ) const {
+	if( _size < 2 ) {
+		return;
+	}
+	if( CpuFeatures::hasSSE2() ) {
+		applySSE(rPtr, gPtr, bPtr, count);
+	} else {
+		applyScalar(rPtr, gPtr, bPtr, 0, count);
+	}
+}
+
+// the lattice cell is split into six tetrahedra along its main diagonal.  walking from the
+// cell's origin corner along the axes in order of decreasing fraction visits the four corners
+// of the one containing the point, and the weights are the differences of sorted fractions.
+void ColorLut::applyScalar( float* rPtr, float* gPtr, float* bPtr, int start, int count ) const {
+	const float last = static_cast<float>(_size - 1);
+	const int stride[3] = { 4, 4 * _size, 4 * _size * _size };
+	float scale[3];
+	float offset[3];
+	for( int c = 0; c < 3; ++c ) {
+		scale[c] = last / (_domainMax[c] - _domainMin[c]);
+		offset[c] = -_domainMin[c] * scale[c];
+	}
+	float* planes[3] = { rPtr, gPtr, bPtr };
+
+	for( int i = start; i < count; ++i ) {
+		int index = 0;
+		float frac[3];
+		for( int c = 0; c < 3; ++c ) {
+			float t = planes[c][i] * scale[c] + offset[c];
+			t = t > 0.0f ? t : 0.0f;
+			t = t < last ? t : last;
+			float cell = static_cast<float>(static_cast<int>(t));
+			cell = cell < last - 1.0f ? cell : last - 1.0f;
+			frac[c] = t - cell;
+			index += static_cast<int>(cell) * stride[c];
+		}
+
+		// order the axes by fraction, largest first
+		int order[3] = { 0, 1, 2 };
+		if( frac[order[1]] > frac[order[0]] ) { const int tmp = order[0]; order[0] = order[1]; order[1] = tmp; }
+		if( frac[order[2]] > frac[order[1]] ) { const int tmp = order[1]; order[1] = order[2]; order[2] = tmp; }
+		if( frac[order[1]] > frac[order[0]] ) { const int tmp = order[0]; order[0] = order[1]; order[1] = tmp; }
+
+		const float* c0 = &_data[index];
+		const float* c1 = c0 + stride[order[0]];
+		const float* c2 = c1 + stride[order[1]];
+		const float* c3 = c2 + stride[order[2]];
+		const float w0 = 1.0f - frac[order[0]];
+		const float w1 = frac[order[0]] - frac[order[1]];
+		const float w2 = frac[order[1]] - frac[order[2]];
+		const float w3 = frac[order[2]];
+		for( int c = 0; c < 3; ++c ) {
+			planes[c][i] = w0 * c0[c] + w1 * c1[c] + w2 * c2[c] + w3 * c3[c];
+		}
+	}
+}
+
+// cell origins, corner offsets and weights are found for four pixels at once; each corner
+// is then a single four-float load and the four results are transposed back into planes.
+// offsets are computed in float, which is exact for any lattice that fits in memory.
+void ColorLut::applySSE( float* rPtr, float* gPtr, float* bPtr, int count ) const {
+	const float last = static_cast<float>(_size - 1);
+	const float strideR = 4.0f;
+	const float strideG = 4.0f * _size;
+	const float strideB = 4.0f * _size * _size;
+	const int diagonal = static_cast<int>(strideR + strideG + strideB);
+
+	__m128 scale[3];
+	__m128 offset[3];
+	for( int c = 0; c < 3; ++c ) {
+		const float s = last / (_domainMax[c] - _domainMin[c]);
+		scale[c] = _mm_set1_ps(s);
+		offset[c] = _mm_set1_ps(-_domainMin[c] * s);
+	}
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 top = _mm_set1_ps(last);
+	const __m128 topCell = _mm_set1_ps(last - 1.0f);
+	const __m128 sR = _mm_set1_ps(strideR);
+	const __m128 sG = _mm_set1_ps(strideG);
+	const __m128 sB = _mm_set1_ps(strideB);
+	const __m128 sAll = _mm_set1_ps(static_cast<float>(diagonal));
+	const float* data = &_data[0];
+
+	float* planes[3] = { rPtr, gPtr, bPtr };
+	int i = 0;
+	for( ; i + 4 <= count; i += 4 ) {
+		__m128 frac[3];
+		__m128 cell[3];
+		for( int c = 0; c < 3; ++c ) {
+			__m128 t = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(planes[c] + i), scale[c]), offset[c]);
+			t = _mm_min_ps(_mm_max_ps(t, zero), top);
+			cell[c] = _mm_min_ps(_mm_cvtepi32_ps(_mm_cvttps_epi32(t)), topCell);
+			frac[c] = _mm_sub_ps(t, cell[c]);
+		}
+		const __m128 fr = frac[0];
+		const __m128 fg = frac[1];
+		const __m128 fb = frac[2];
+
+		const __m128 rg = _mm_cmpgt_ps(fr, fg);
+		const __m128 gb = _mm_cmpgt_ps(fg, fb);
+		const __m128 rb = _mm_cmpgt_ps(fr, fb);
+		const __m128 rMax = _mm_and_ps(rg, rb);
+		const __m128 gMax = _mm_andnot_ps(rg, gb);
+		const __m128 bMin = _mm_and_ps(rb, gb);
+		const __m128 gMin = _mm_andnot_ps(gb, rg);
+
+		const __m128 hi = _mm_max_ps(_mm_max_ps(fr, fg), fb);
+		const __m128 lo = _mm_min_ps(_mm_min_ps(fr, fg), fb);
+		const __m128 mid = _mm_max_ps(_mm_min_ps(fr, fg), _mm_min_ps(_mm_max_ps(fr, fg), fb));
+		const __m128 w0 = _mm_sub_ps(one, hi);
+		const __m128 w1 = _mm_sub_ps(hi, mid);
+		const __m128 w2 = _mm_sub_ps(mid, lo);
+		const __m128 w3 = lo;
+
+		// first corner steps along the largest fraction, the second lacks only the smallest
+		const __m128 first = select(rMax, sR, select(gMax, sG, sB));
+		const __m128 second = _mm_sub_ps(sAll, select(bMin, sB, select(gMin, sG, sR)));
+		const __m128 origin = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cell[0], sR), _mm_mul_ps(cell[1], sG)), _mm_mul_ps(cell[2], sB));
+
+		int base[4];
+		int v1[4];
+		int v2[4];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(base), _mm_cvttps_epi32(origin));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(v1), _mm_cvttps_epi32(first));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(v2), _mm_cvttps_epi32(second));
+
+		__m128 p0 = tetrahedron<0>(data, base, v1, v2, diagonal, w0, w1, w2, w3);
+		__m128 p1 = tetrahedron<1>(data, base, v1, v2, diagonal, w0, w1, w2, w3);
+		__m128 p2 = tetrahedron<2>(data, base, v1, v2, diagonal, w0, w1, w2, w3);
+		__m128 p3 = tetrahedron<3>(data, base, v1, v2, diagonal, w0, w1, w2, w3);
+		_MM_TRANSPOSE4_PS(p0, p1, p2, p3);
+		_mm_storeu_ps(rPtr + i, p0);
+		_mm_storeu_ps(gPtr + i, p1);
+		_mm_storeu_ps(bPtr + i, p2);
+	}
+	applyScalar(rPtr, gPtr, bPtr, i, count);
+}
+
+bool ColorLut::load( const std::string& path, std::string& error ) {
+	std::ifstream file(path.c_str());
+	if( !file ) {
+		error = "cannot open " + path;
+		return false;
+	}
+
+	int size = 0;
+	float domainMin[3] = { 0.0f, 0.0f, 0.0f };
+	float domainMax[3] = { 1.0f, 1.0f, 1.0f };
+	std::vector<float> values;
+	std::string line;
+	while( std::getline(file, line) ) {
+		std::istringstream stream(line);
+		std::string word;
+		if( !(stream >> word) || '#' == word[0] ) {
+			continue;
+		}
+
+		const char first = word[0];
+		if( (first >= '0' && first <= '9') || '-' == first || '+' == first || '.' == first ) {
+			std::istringstream entry(line);
+			float rgb[3];
+			if( !(entry >> rgb[0] >> rgb[1] >> rgb[2]) ) {
+				error = "malformed entry '" + line + "' in " + path;
+				return false;
+			}
+			values.insert(values.end(), rgb, rgb + 3);
+		} else if( "LUT_3D_SIZE" == word ) {
+			stream >> size;
+		} else if( "DOMAIN_MIN" == word ) {
+			stream >> domainMin[0] >> domainMin[1] >> domainMin[2];
+		} else if( "DOMAIN_MAX" == word ) {
+			stream >> domainMax[0] >> domainMax[1] >> domainMax[2];
+		} else if( "LUT_3D_INPUT_RANGE" == word ) {
+			float low = 0.0f;
+			float high = 1.0f;
+			stream >> low >> high;
+			for( int c = 0; c < 3; ++c ) {
+				domainMin[c] = low;
+				domainMax[c] = high;
+			}
+		} else if( "LUT_1D_SIZE" == word ) {
+			error = "1d luts are not supported (" + path + ")";
+			return false;
+		}
+		// TITLE and vendor keywords are ignored
+	}
+
+	if( size < 2 || size > 256 ) {
+		error = "missing or invalid LUT_3D_SIZE in " + path;
+		return false;
+	}
+	if( values.size() != static_cast<size_t>(3 * size * size * size) ) {
+		error = "entry count does not match LUT_3D_SIZE in " + path;
+		return false;
+	}
+	for( int c = 0; c < 3; ++c ) {
+		if( !(domainMax[c] > domainMin[c]) ) {
+			error = "empty domain in " + path;
+			return false;
+		}
+	}
+
+	resize(size);
+	setDomain(domainMin, domainMax);
+	const float* src = &values[0];
+	for( int b = 0; b < size; ++b ) {
+		for( int g = 0; g < size; ++g ) {
+			for( int r = 0; r < size; ++r, src += 3 ) {
+				set(r, g, b, src[0], src[1], src[2]);
+			}
+		}
+	}
+	return true;
+}
+
+bool ColorLut::save( const std::string& path, std::string& error ) const {
+	std::ofstream file(path.c_str());
+	if( !file ) {
+		error = "cannot write " + path;
+		return false;
+	}
+
+	file << "TITLE \"Kirei\"\n";
+	file << "LUT_3D_SIZE " << _size << "\n";
+	file << std::setprecision(9);
+	file << "DOMAIN_MIN " << _domainMin[0] << " " << _domainMin[1] << " " << _domainMin[2] << "\n";
+	file << "DOMAIN_MAX " << _domainMax[0] << " " << _domainMax[1] << " " << _domainMax[2] << "\n";
+	file << std::fixed << std::setprecision(6);
+	const int entries = _size * _size * _size;
+	for( int i = 0; i < entries; ++i ) {
+		const float* entry = &_data[4 * i];
+		file << entry[0] << " " << entry[1] << " " << entry[2] << "\n";
+	}
+
+	if( !file ) {
+		error = "failed writing " + path;
+		return false;
+	}
+	return true;
+}
\ No newline at end of file
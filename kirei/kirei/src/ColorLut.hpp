@@ -0,0 +1,44 @@
+#ifndef __color_lut__
+#define __color_lut__
+
+#include <string>
+#include <vector>
+
+// 3D colour lookup table with tetrahedral interpolation.  entries are stored red fastest, as
+// in .cube files, and padded to four floats so that each one is a single vector load.
+class ColorLut {
+public:
+	ColorLut();
+	~ColorLut();
+
+	void resize( int size );
+	int size() const;
+
+	// input range mapped onto the lattice; values outside are clamped to it
+	void setDomain( const float* domainMin, const float* domainMax );
+	const float* domainMin() const;
+	const float* domainMax() const;
+
+	// input colour of lattice point index along one axis
+	float latticeValue( int axis, int index ) const;
+	void set( int r, int g, int b, float red, float green, float blue );
+
+	// interpolates count pixels of three planes in place
+	void apply( float* rPtr, float* gPtr, float* bPtr, int count ) const;
+
+	// .cube (Adobe/Resolve) text format.  on failure, false is returned with a reason in error.
+	bool load( const std::string& path, std::string& error );
+	bool save( const std::string& path, std::string& error ) const;
+
+private:
+	void applyScalar( float* rPtr, float* gPtr, float* bPtr, int start, int count ) const;
+	void applySSE( float* rPtr, float* gPtr, float* bPtr, int count ) const;
+
+private:
+	int _size;
+	float _domainMin[3];
+	float _domainMax[3];
+	std::vector<float> _data;
+};
+
+#endif /* __color_lut__ */
\ No newline at end of file
@@ -0,0 +1,247 @@
+#include "Convolution.hpp"
+#include "CpuFeatures.hpp"
+#include <cmath>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+static void weightedSumScalar( const float* const* srcs, const float* weights, int taps, int start, int count, float* dst ) {
+	for( int i = start; i < count; ++i ) {
+		float acc = 0.0f;
+		for( int t = 0; t < taps; ++t ) {
+			acc += weights[t] * srcs[t][i];
+		}
+		dst[i] = acc;
+	}
+}
+
+// the vector versions accumulate taps in the same order as the scalar one, so every lane
+// gives the same bits as the scalar loop would
+static void weightedSumSSE( const float* const* srcs, const float* weights, int taps, int count, float* dst ) {
+	int i = 0;
+	for( ; i + 4 <= count; i += 4 ) {
+		__m128 acc = _mm_setzero_ps();
+		for( int t = 0; t < taps; ++t ) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(srcs[t] + i)));
+		}
+		_mm_storeu_ps(dst + i, acc);
+	}
+	weightedSumScalar(srcs, weights, taps, i, count, dst);
+}
+
+KIREI_TARGET_AVX static void weightedSumAVX( const float* const* srcs, const float* weights, int taps, int count, float* dst ) {
+	int i = 0;
+	for( ; i + 8 <= count; i += 8 ) {
+		__m256 acc = _mm256_setzero_ps();
+		for( int t = 0; t < taps; ++t ) {
+			acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_set1_ps(weights[t]), _mm256_loadu_ps(srcs[t] + i)));
+		}
+		_mm256_storeu_ps(dst + i, acc);
+	}
+	for( ; i + 4 <= count; i += 4 ) {
+		__m128 acc = _mm_setzero_ps();
+		for( int t = 0; t < taps; ++t ) {
+			acc = _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(weights[t]), _mm_loadu_ps(srcs[t] + i)));
+		}
+		_mm_storeu_ps(dst + i, acc);
+	}
+	weightedSumScalar(srcs, weights, taps, i, count, dst);
+}
+
+Convolution::Convolution()
+	: _size(1), _separable(true), _identity(true) {
+	_kernel.assign(1, 1.0f);
+	_column.assign(1, 1.0f);
+	_row.assign(1, 1.0f);
+	findTaps();
+}
+
+Convolution::~Convolution() {
+}
+
+bool Convolution::setKernel( const float* kernel, int size ) {
+	if( size <= 0 || (size % 2) == 0 || nullptr == kernel ) {
+		const float identity = 1.0f;
+		setKernel(&identity, 1);
+		return false;
+	}
+
+	_size = size;
+	_kernel.assign(kernel, kernel + size * size);
+
+	const int center = (size / 2) * size + (size / 2);
+	_identity = true;
+	for( int i = 0; i < size * size; ++i ) {
+		if( _kernel[i] != ((i == center) ? 1.0f : 0.0f) ) {
+			_identity = false;
+			break;
+		}
+	}
+
+	findSeparable();
+	findTaps();
+	return true;
+}
+
+int Convolution::size() const {
+	return _size;
+}
+
+int Convolution::radius() const {
+	return _size / 2;
+}
+
+bool Convolution::isSeparable() const {
+	return _separable;
+}
+
+bool Convolution::isIdentity() const {
+	return _identity;
+}
+
+void Convolution::findSeparable() {
+	// a kernel is separable when it is the outer product of a column and a row.  take the
+	// largest weight as pivot, read the factors off its row and column, and check that they
+	// rebuild every weight.
+	const int size = _size;
+	int pivot = 0;
+	for( int i = 1; i < size * size; ++i ) {
+		if( fabsf(_kernel[i]) > fabsf(_kernel[pivot]) ) {
+			pivot = i;
+		}
+	}
+	const float largest = fabsf(_kernel[pivot]);
+
+	_separable = false;
+	_column.clear();
+	_row.clear();
+	if( 0.0f == largest ) {
+		return;
+	}
+
+	const int pivotRow = pivot / size;
+	const int pivotCol = pivot % size;
+	_column.resize(size);
+	_row.resize(size);
+	for( int i = 0; i < size; ++i ) {
+		_column[i] = _kernel[i * size + pivotCol];
+		_row[i] = _kernel[pivotRow * size + i] / _kernel[pivot];
+	}
+
+	const float tolerance = largest * 1e-6f;
+	for( int ky = 0; ky < size; ++ky ) {
+		for( int kx = 0; kx < size; ++kx ) {
+			if( fabsf(_column[ky] * _row[kx] - _kernel[ky * size + kx]) > tolerance ) {
+				_column.clear();
+				_row.clear();
+				return;
+			}
+		}
+	}
+	_separable = true;
+}
+
+void Convolution::findTaps() {
+	_columnTaps.clear();
+	_columnWeights.clear();
+	_rowTaps.clear();
+	_rowWeights.clear();
+	_taps.clear();
+	_tapWeights.clear();
+	if( _separable ) {
+		for( int k = 0; k < _size; ++k ) {
+			if( _column[k] != 0.0f ) {
+				_columnTaps.push_back(k);
+				_columnWeights.push_back(_column[k]);
+			}
+			if( _row[k] != 0.0f ) {
+				_rowTaps.push_back(k);
+				_rowWeights.push_back(_row[k]);
+			}
+		}
+		return;
+	}
+	for( int i = 0; i < _size * _size; ++i ) {
+		if( _kernel[i] != 0.0f ) {
+			_taps.push_back(i);
+			_tapWeights.push_back(_kernel[i]);
+		}
+	}
+}
+
+void Convolution::apply( const float* const* rows, int left, int right, int x, int r, float* out, Scratch& scratch ) const {
+	const int rad = radius();
+	const int count = r - x;
+	const int padded = count + 2 * rad;
+	if( count <= 0 ) {
+		return;
+	}
+
+	if( _separable ) {
+		if( _columnTaps.empty() ) {
+			for( int i = 0; i < count; ++i ) {
+				out[i] = 0.0f;
+			}
+			return;
+		}
+
+		// vertical pass over the available columns, then clamp that line out to the padded span
+		// and run the horizontal pass over it
+		const int width = right - left;
+		scratch.lines.resize(width + padded);
+		float* vertical = &scratch.lines[0];
+		float* line = &scratch.lines[width];
+		scratch.srcs.resize(_size);
+
+		const int columnTaps = static_cast<int>(_columnTaps.size());
+		for( int t = 0; t < columnTaps; ++t ) {
+			scratch.srcs[t] = rows[_columnTaps[t]] + left;
+		}
+		weightedSum(&scratch.srcs[0], &_columnWeights[0], columnTaps, width, vertical);
+		clampedCopy(vertical - left, left, right, x - rad, r + rad, line);
+
+		const int rowTaps = static_cast<int>(_rowTaps.size());
+		for( int t = 0; t < rowTaps; ++t ) {
+			scratch.srcs[t] = line + _rowTaps[t];
+		}
+		weightedSum(&scratch.srcs[0], &_rowWeights[0], rowTaps, count, out);
+		return;
+	}
+
+	if( _taps.empty() ) {
+		for( int i = 0; i < count; ++i ) {
+			out[i] = 0.0f;
+		}
+		return;
+	}
+
+	// full 2d kernel; clamp every input line out to the padded span once, then every non-zero
+	// weight becomes one tap
+	scratch.lines.resize(_size * padded);
+	for( int k = 0; k < _size; ++k ) {
+		clampedCopy(rows[k], left, right, x - rad, r + rad, &scratch.lines[k * padded]);
+	}
+	const int taps = static_cast<int>(_taps.size());
+	scratch.srcs.resize(_taps.size());
+	for( int t = 0; t < taps; ++t ) {
+		scratch.srcs[t] = &scratch.lines[(_taps[t] / _size) * padded] + (_taps[t] % _size);
+	}
+	weightedSum(&scratch.srcs[0], &_tapWeights[0], taps, count, out);
+}
+
+void Convolution::weightedSum( const float* const* srcs, const float* weights, int taps, int count, float* dst ) {
+	if( CpuFeatures::hasAVX() ) {
+		weightedSumAVX(srcs, weights, taps, count, dst);
+	} else if( CpuFeatures::hasSSE2() ) {
+		weightedSumSSE(srcs, weights, taps, count, dst);
+	} else {
+		weightedSumScalar(srcs, weights, taps, 0, count, dst);
+	}
+}
+
+void Convolution::clampedCopy( const float* src, int left, int right, int x, int r, float* dst ) {
+	// copies src[x..r) to dst, repeating the edge samples of [left, right) outside it
+	for( int currX = x; currX < r; ++currX ) {
+		const int clamped = (currX < left) ? left : ((currX >= right) ? right - 1 : currX);
+		*dst++= src[clamped];
+	}
+}
\ No newline at end of file
@@ -0,0 +1,59 @@
+#ifndef __convolution__
+#define __convolution__
+
+#include <vector>
+
+// square convolution kernel of any odd size.  rank one kernels are found automatically and
+// run as a vertical and a horizontal 1d pass, so a separable 7x7 costs 14 taps rather than 49.
+// the inner loops run 8 (avx) or 4 (sse) pixels at a time, with a scalar fallback.
+class Convolution {
+public:
+	Convolution();
+	~Convolution();
+
+	// kernel holds size*size weights row by row, the first row being the top (+y) of the kernel.
+	// returns false (and becomes an identity) if size is not odd and positive.
+	bool setKernel( const float* kernel, int size );
+	int size() const;
+	int radius() const;
+	bool isSeparable() const;
+	bool isIdentity() const;
+
+	// working memory for apply.  keep one per thread and pass it to every call, so lines after
+	// the first allocate nothing
+	struct Scratch {
+		std::vector<float> lines;
+		std::vector<const float*> srcs;
+	};
+
+	// convolves one output line.  rows[k] is the input line for kernel row k (so y+radius-k),
+	// indexed by absolute x and valid over [left, right); columns outside are clamped.
+	// out receives the r-x results for [x, r).
+	void apply( const float* const* rows, int left, int right, int x, int r, float* out, Scratch& scratch ) const;
+
+	// dst[i] = sum of weights[t] * srcs[t][i] over all taps, using the best instruction set
+	static void weightedSum( const float* const* srcs, const float* weights, int taps, int count, float* dst );
+
+private:
+	void findSeparable();
+	void findTaps();
+	static void clampedCopy( const float* src, int left, int right, int x, int r, float* dst );
+
+private:
+	int _size;
+	bool _separable;
+	bool _identity;
+	std::vector<float> _kernel;
+	std::vector<float> _column; // vertical factor of a separable kernel, top to bottom
+	std::vector<float> _row;    // horizontal factor of a separable kernel, left to right
+
+	// the non-zero weights apply runs as taps, found once per kernel
+	std::vector<int> _columnTaps; // separable: kernel row of each vertical tap
+	std::vector<float> _columnWeights;
+	std::vector<int> _rowTaps;    // separable: kernel column of each horizontal tap
+	std::vector<float> _rowWeights;
+	std::vector<int> _taps;       // otherwise: ky*size+kx of each tap
+	std::vector<float> _tapWeights;
+};
+
+#endif /* __convolution__ */
\ No newline at end of file
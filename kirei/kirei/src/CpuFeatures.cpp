@@ -0,0 +1,67 @@
+#include "CpuFeatures.hpp"
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#include <immintrin.h>
+#else
+	#include <cpuid.h>
+#endif
+
+bool CpuFeatures::_detected = false;
+bool CpuFeatures::_sse2 = false;
+bool CpuFeatures::_avx = false;
+
+// detect when the plugin is loaded, before any engine thread can ask
+static struct CpuFeaturesAtLoad {
+	CpuFeaturesAtLoad() {
+		CpuFeatures::hasSSE2();
+	}
+} cpuFeaturesAtLoad;
+
+bool CpuFeatures::hasSSE2() {
+	detect();
+	return _sse2;
+}
+
+bool CpuFeatures::hasAVX() {
+	detect();
+	return _avx;
+}
+
+void CpuFeatures::detect() {
+	if( _detected ) {
+		return;
+	}
+
+	unsigned int ecx = 0;
+	unsigned int edx = 0;
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	ecx = static_cast<unsigned int>(info[2]);
+	edx = static_cast<unsigned int>(info[3]);
+#else
+	unsigned int eax = 0;
+	unsigned int ebx = 0;
+	__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+#endif
+
+	_sse2 = (edx & (1u << 26)) != 0;
+
+	// avx needs both the cpu flag and the os saving the ymm registers on context switches
+	const bool osxsave = (ecx & (1u << 27)) != 0;
+	const bool avx = (ecx & (1u << 28)) != 0;
+	_avx = false;
+	if( osxsave && avx ) {
+#if defined(_MSC_VER)
+		const unsigned long long xcr0 = _xgetbv(0);
+#else
+		unsigned int lo = 0;
+		unsigned int hi = 0;
+		__asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+		const unsigned long long xcr0 = (static_cast<unsigned long long>(hi) << 32) | lo;
+#endif
+		_avx = (xcr0 & 0x6) == 0x6;
+	}
+
+	_detected = true;
+}
\ No newline at end of file
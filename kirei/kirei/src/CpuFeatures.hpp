@@ -0,0 +1,29 @@
+#ifndef __cpu_features__
+#define __cpu_features__
+
+// which vector instruction sets the host can run.  detected once on first use so that a
+// single binary picks the fastest path on every machine it is loaded on.
+class CpuFeatures {
+public:
+	static bool hasSSE2();
+	static bool hasAVX();
+
+private:
+	CpuFeatures();
+	static void detect();
+
+private:
+	static bool _detected;
+	static bool _sse2;
+	static bool _avx;
+};
+
+// functions using AVX intrinsics are marked so that gcc/clang emit them without -mavx;
+// msvc allows the intrinsics anywhere
+#if defined(_MSC_VER)
+	#define KIREI_TARGET_AVX
+#else
+	#define KIREI_TARGET_AVX __attribute__((target("avx")))
+#endif
+
+#endif /* __cpu_features__ */
\ No newline at end of file
@@ -0,0 +1,240 @@
+#include "Fft.hpp"
+#include <cmath>
+
+Fft::Fft()
+	: _n(0) {
+}
+
+Fft::~Fft() {
+}
+
+void Fft::setSize( int n ) {
+	if( n == _n ) {
+		return;
+	}
+	_n = n;
+
+	// radix 4 first as it is the cheapest per point, then 2, then the odd primes
+	_factors.clear();
+	int remaining = n;
+	int p = 4;
+	const int root = static_cast<int>(floor(sqrt(static_cast<double>(n))));
+	while( remaining > 1 ) {
+		while( remaining % p != 0 ) {
+			p = (4 == p) ? 2 : ((2 == p) ? 3 : p + 2);
+			if( p > root ) {
+				p = remaining;
+			}
+		}
+		remaining /= p;
+		_factors.push_back(p);
+		_factors.push_back(remaining);
+	}
+
+	// twiddles are worked out in double so that large sizes stay accurate
+	const double pi = 3.14159265358979323846;
+	_forward.resize(n);
+	_inverse.resize(n);
+	for( int i = 0; i < n; ++i ) {
+		const double phase = -2.0 * pi * static_cast<double>(i) / static_cast<double>(n);
+		_forward[i] = Complex(static_cast<float>(cos(phase)), static_cast<float>(sin(phase)));
+		_inverse[i] = std::conj(_forward[i]);
+	}
+}
+
+int Fft::size() const {
+	return _n;
+}
+
+void Fft::transform( const Complex* in, int inStride, Complex* out, bool inverse ) const {
+	if( _n <= 1 ) {
+		if( 1 == _n ) {
+			out[0] = in[0];
+		}
+		return;
+	}
+	work(out, in, 1, inStride, &_factors[0], inverse ? &_inverse[0] : &_forward[0], inverse);
+}
+
+void Fft::transform2d( Complex* data, int nonZeroRows, bool inverse, std::vector<Complex>& scratch ) const {
+	const int n = _n;
+	scratch.resize(2 * n);
+	Complex* line = &scratch[0];
+	Complex* result = &scratch[n];
+
+	// the rows that are known to be zero stay zero through the row transforms
+	const int rows = inverse ? n : nonZeroRows;
+	for( int y = 0; y < rows; ++y ) {
+		Complex* row = data + static_cast<size_t>(y) * n;
+		for( int x = 0; x < n; ++x ) {
+			line[x] = row[x];
+		}
+		transform(line, 1, row, inverse);
+	}
+	for( int x = 0; x < n; ++x ) {
+		transform(data + x, n, result, inverse);
+		for( int y = 0; y < n; ++y ) {
+			data[static_cast<size_t>(y) * n + x] = result[y];
+		}
+	}
+}
+
+int Fft::goodSize( int minimum ) {
+	int n = (minimum < 1) ? 1 : minimum;
+	for( ;; ++n ) {
+		int m = n;
+		while( 0 == m % 2 ) {
+			m /= 2;
+		}
+		while( 0 == m % 3 ) {
+			m /= 3;
+		}
+		while( 0 == m % 5 ) {
+			m /= 5;
+		}
+		if( 1 == m ) {
+			return n;
+		}
+	}
+}
+
+void Fft::work( Complex* out, const Complex* in, int fstride, int inStride, const int* factors, const Complex* twiddles, bool inverse ) const {
+	const int p = factors[0];
+	const int m = factors[1];
+	const Complex* outEnd = out + p * m;
+
+	// the p interleaved subsequences are transformed into consecutive blocks of m, then combined
+	if( 1 == m ) {
+		for( Complex* o = out; o != outEnd; ++o ) {
+			*o = *in;
+			in += fstride * inStride;
+		}
+	} else {
+		for( Complex* o = out; o != outEnd; o += m ) {
+			work(o, in, fstride * p, inStride, factors + 2, twiddles, inverse);
+			in += fstride * inStride;
+		}
+	}
+
+	switch( p ) {
+		case 2: {
+			butterfly2(out, fstride, m, twiddles);
+			break;
+		}
+
+		case 3: {
+			butterfly3(out, fstride, m, twiddles);
+			break;
+		}
+
+		case 4: {
+			butterfly4(out, fstride, m, twiddles, inverse);
+			break;
+		}
+
+		case 5: {
+			butterfly5(out, fstride, m, twiddles);
+			break;
+		}
+
+		default: {
+			butterflyGeneric(out, fstride, m, p, twiddles);
+		}
+	}
+}
+
+void Fft::butterfly2( Complex* out, int fstride, int m, const Complex* twiddles ) const {
+	Complex* out2 = out + m;
+	for( int k = 0; k < m; ++k ) {
+		const Complex t = out2[k] * twiddles[k * fstride];
+		out2[k] = out[k] - t;
+		out[k] += t;
+	}
+}
+
+void Fft::butterfly3( Complex* out, int fstride, int m, const Complex* twiddles ) const {
+	// the imaginary part of the twiddle a third of the way round carries the direction
+	const float epi3 = twiddles[fstride * m].imag();
+	for( int k = 0; k < m; ++k ) {
+		const Complex s1 = out[k + m] * twiddles[k * fstride];
+		const Complex s2 = out[k + 2 * m] * twiddles[2 * k * fstride];
+		const Complex s3 = s1 + s2;
+		const Complex s0 = (s1 - s2) * epi3;
+		const Complex half = out[k] - s3 * 0.5f;
+		out[k] += s3;
+		out[k + 2 * m] = Complex(half.real() + s0.imag(), half.imag() - s0.real());
+		out[k + m] = Complex(half.real() - s0.imag(), half.imag() + s0.real());
+	}
+}
+
+void Fft::butterfly4( Complex* out, int fstride, int m, const Complex* twiddles, bool inverse ) const {
+	for( int k = 0; k < m; ++k ) {
+		const Complex s0 = out[k + m] * twiddles[k * fstride];
+		const Complex s1 = out[k + 2 * m] * twiddles[2 * k * fstride];
+		const Complex s2 = out[k + 3 * m] * twiddles[3 * k * fstride];
+		const Complex s5 = out[k] - s1;
+		const Complex s6 = out[k] + s1;
+		const Complex s3 = s0 + s2;
+		const Complex s4 = s0 - s2;
+		out[k + 2 * m] = s6 - s3;
+		out[k] = s6 + s3;
+		if( inverse ) {
+			out[k + m] = Complex(s5.real() - s4.imag(), s5.imag() + s4.real());
+			out[k + 3 * m] = Complex(s5.real() + s4.imag(), s5.imag() - s4.real());
+		} else {
+			out[k + m] = Complex(s5.real() + s4.imag(), s5.imag() - s4.real());
+			out[k + 3 * m] = Complex(s5.real() - s4.imag(), s5.imag() + s4.real());
+		}
+	}
+}
+
+void Fft::butterfly5( Complex* out, int fstride, int m, const Complex* twiddles ) const {
+	const Complex ya = twiddles[fstride * m];
+	const Complex yb = twiddles[fstride * 2 * m];
+	for( int u = 0; u < m; ++u ) {
+		const Complex s0 = out[u];
+		const Complex s1 = out[u + m] * twiddles[u * fstride];
+		const Complex s2 = out[u + 2 * m] * twiddles[2 * u * fstride];
+		const Complex s3 = out[u + 3 * m] * twiddles[3 * u * fstride];
+		const Complex s4 = out[u + 4 * m] * twiddles[4 * u * fstride];
+		const Complex s7 = s1 + s4;
+		const Complex s10 = s1 - s4;
+		const Complex s8 = s2 + s3;
+		const Complex s9 = s2 - s3;
+
+		out[u] = s0 + s7 + s8;
+
+		const Complex s5(s0.real() + s7.real() * ya.real() + s8.real() * yb.real(), s0.imag() + s7.imag() * ya.real() + s8.imag() * yb.real());
+		const Complex s6(s10.imag() * ya.imag() + s9.imag() * yb.imag(), -s10.real() * ya.imag() - s9.real() * yb.imag());
+		out[u + m] = s5 - s6;
+		out[u + 4 * m] = s5 + s6;
+
+		const Complex s11(s0.real() + s7.real() * yb.real() + s8.real() * ya.real(), s0.imag() + s7.imag() * yb.real() + s8.imag() * ya.real());
+		const Complex s12(-s10.imag() * yb.imag() + s9.imag() * ya.imag(), s10.real() * yb.imag() - s9.real() * ya.imag());
+		out[u + 2 * m] = s11 + s12;
+		out[u + 3 * m] = s11 - s12;
+	}
+}
+
+void Fft::butterflyGeneric( Complex* out, int fstride, int m, int p, const Complex* twiddles ) const {
+	// plain dft over the p points of each butterfly
+	std::vector<Complex> scratch(p);
+	for( int u = 0; u < m; ++u ) {
+		for( int q = 0; q < p; ++q ) {
+			scratch[q] = out[u + q * m];
+		}
+		for( int q = 0; q < p; ++q ) {
+			const int k = u + q * m;
+			Complex sum = scratch[0];
+			int index = 0;
+			for( int j = 1; j < p; ++j ) {
+				index += fstride * k;
+				if( index >= _n ) {
+					index %= _n;
+				}
+				sum += scratch[j] * twiddles[index];
+			}
+			out[k] = sum;
+		}
+	}
+}
\ No newline at end of file
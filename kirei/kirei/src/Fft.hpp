@@ -0,0 +1,47 @@
+#ifndef __fft__
+#define __fft__
+
+#include <complex>
+#include <vector>
+
+// mixed radix complex fft (radix 4, 2, 3 and 5 butterflies, with a generic one for any other
+// prime), in the decimation in time layout of kiss fft.  real images are transformed two at a
+// time as the real and imaginary parts of one complex image; filtering them with a real kernel
+// keeps them apart, so no separate real transform is needed.
+class Fft {
+public:
+	typedef std::complex<float> Complex;
+
+	Fft();
+	~Fft();
+
+	void setSize( int n );
+	int size() const;
+
+	// out[k] = sum of in[j*inStride] * e^(-+2 pi i jk/n).  the inverse is not scaled by 1/n.
+	// in and out must not overlap.
+	void transform( const Complex* in, int inStride, Complex* out, bool inverse ) const;
+
+	// in place transform of a row-major size*size image: rows, then columns.  on the forward
+	// transform only the first nonZeroRows rows are transformed, the others must be zero.
+	void transform2d( Complex* data, int nonZeroRows, bool inverse, std::vector<Complex>& scratch ) const;
+
+	// smallest n >= minimum with no prime factors but 2, 3 and 5, which the butterflies handle best
+	static int goodSize( int minimum );
+
+private:
+	void work( Complex* out, const Complex* in, int fstride, int inStride, const int* factors, const Complex* twiddles, bool inverse ) const;
+	void butterfly2( Complex* out, int fstride, int m, const Complex* twiddles ) const;
+	void butterfly3( Complex* out, int fstride, int m, const Complex* twiddles ) const;
+	void butterfly4( Complex* out, int fstride, int m, const Complex* twiddles, bool inverse ) const;
+	void butterfly5( Complex* out, int fstride, int m, const Complex* twiddles ) const;
+	void butterflyGeneric( Complex* out, int fstride, int m, int p, const Complex* twiddles ) const;
+
+private:
+	int _n;
+	std::vector<int> _factors; // pairs of radix and remaining length
+	std::vector<Complex> _forward;
+	std::vector<Complex> _inverse;
+};
+
+#endif /* __fft__ */
\ No newline at end of file
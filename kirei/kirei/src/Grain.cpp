@@ -0,0 +1,188 @@
+#include "Grain.hpp"
+#include "CpuFeatures.hpp"
+#include <emmintrin.h>
+
+static const unsigned int PHILOX_M0 = 0xD2511F53u;
+static const unsigned int PHILOX_M1 = 0xCD9E8D57u;
+static const unsigned int PHILOX_W0 = 0x9E3779B9u;
+static const unsigned int PHILOX_W1 = 0xBB67AE85u;
+static const unsigned int PHILOX_KEY1 = 0x6B69u; // second key word, fixed
+
+// the top 24 bits of each word are a uniform in [0, 1), and four of them sum to mean 2 and
+// variance 1/3
+static const float UNIFORM_SCALE = 1.0f / 16777216.0f;
+static const float UNIT_VARIANCE = 1.7320508f;
+
+static void philoxScalar( unsigned int& c0, unsigned int& c1, unsigned int& c2, unsigned int& c3, unsigned int seed ) {
+	unsigned int k0 = seed;
+	unsigned int k1 = PHILOX_KEY1;
+	for( int round = 0; round < 10; ++round ) {
+		const unsigned long long p0 = static_cast<unsigned long long>(PHILOX_M0) * c0;
+		const unsigned long long p1 = static_cast<unsigned long long>(PHILOX_M1) * c2;
+		c0 = static_cast<unsigned int>(p1 >> 32) ^ c1 ^ k0;
+		c1 = static_cast<unsigned int>(p1);
+		c2 = static_cast<unsigned int>(p0 >> 32) ^ c3 ^ k1;
+		c3 = static_cast<unsigned int>(p0);
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+}
+
+static float sampleScalar( unsigned int c0, unsigned int c1, unsigned int c2, unsigned int c3, unsigned int seed ) {
+	philoxScalar(c0, c1, c2, c3, seed);
+	const float sum = static_cast<float>(c0 >> 8) * UNIFORM_SCALE + static_cast<float>(c1 >> 8) * UNIFORM_SCALE
+		+ static_cast<float>(c2 >> 8) * UNIFORM_SCALE + static_cast<float>(c3 >> 8) * UNIFORM_SCALE;
+	return (sum - 2.0f) * UNIT_VARIANCE;
+}
+
+// full 32x32 bit products of four lanes, from the two lanes _mm_mul_epu32 does at a time
+static void mulHiLo( __m128i a, __m128i m, __m128i& hi, __m128i& lo ) {
+	const __m128i even = _mm_mul_epu32(a, m);
+	const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), m);
+	lo = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	hi = _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 3, 1)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 3, 1)));
+}
+
+static __m128 uniformSSE( __m128i word ) {
+	return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(word, 8)), _mm_set1_ps(UNIFORM_SCALE));
+}
+
+// philox rounds on four neighbouring pixels at a time, doing the same operations as philoxScalar
+static void philoxSSE( __m128i& c0, __m128i& c1, __m128i& c2, __m128i& c3, unsigned int seed ) {
+	const __m128i m0 = _mm_set1_epi32(static_cast<int>(PHILOX_M0));
+	const __m128i m1 = _mm_set1_epi32(static_cast<int>(PHILOX_M1));
+	unsigned int k0 = seed;
+	unsigned int k1 = PHILOX_KEY1;
+	for( int round = 0; round < 10; ++round ) {
+		__m128i hi0, lo0, hi1, lo1;
+		mulHiLo(c0, m0, hi0, lo0);
+		mulHiLo(c2, m1, hi1, lo1);
+		c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1), _mm_set1_epi32(static_cast<int>(k0)));
+		c1 = lo1;
+		c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3), _mm_set1_epi32(static_cast<int>(k1)));
+		c3 = lo0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+}
+
+static int noiseSSE( float* dst, int x, int y, int count, int frame, int channel, unsigned int seed ) {
+	int i = 0;
+	for( ; i + 4 <= count; i += 4 ) {
+		__m128i c0 = _mm_add_epi32(_mm_set1_epi32(x + i), _mm_set_epi32(3, 2, 1, 0));
+		__m128i c1 = _mm_set1_epi32(y);
+		__m128i c2 = _mm_set1_epi32(frame);
+		__m128i c3 = _mm_set1_epi32(channel);
+		philoxSSE(c0, c1, c2, c3, seed);
+		const __m128 sum = _mm_add_ps(_mm_add_ps(_mm_add_ps(uniformSSE(c0), uniformSSE(c1)), uniformSSE(c2)), uniformSSE(c3));
+		_mm_storeu_ps(dst + i, _mm_mul_ps(_mm_sub_ps(sum, _mm_set1_ps(2.0f)), _mm_set1_ps(UNIT_VARIANCE)));
+	}
+	return i;
+}
+
+// dst[i] is the sum of the four 24 bit words behind the sample at (x + i, y), below 2^26
+static void words( int* dst, int x, int y, int count, int frame, int channel, unsigned int seed ) {
+	int i = 0;
+	if( CpuFeatures::hasSSE2() ) {
+		for( ; i + 4 <= count; i += 4 ) {
+			__m128i c0 = _mm_add_epi32(_mm_set1_epi32(x + i), _mm_set_epi32(3, 2, 1, 0));
+			__m128i c1 = _mm_set1_epi32(y);
+			__m128i c2 = _mm_set1_epi32(frame);
+			__m128i c3 = _mm_set1_epi32(channel);
+			philoxSSE(c0, c1, c2, c3, seed);
+			const __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_srli_epi32(c0, 8), _mm_srli_epi32(c1, 8)), _mm_add_epi32(_mm_srli_epi32(c2, 8), _mm_srli_epi32(c3, 8)));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), sum);
+		}
+	}
+	for( ; i < count; ++i ) {
+		unsigned int c0 = static_cast<unsigned int>(x + i);
+		unsigned int c1 = static_cast<unsigned int>(y);
+		unsigned int c2 = static_cast<unsigned int>(frame);
+		unsigned int c3 = static_cast<unsigned int>(channel);
+		philoxScalar(c0, c1, c2, c3, seed);
+		dst[i] = static_cast<int>((c0 >> 8) + (c1 >> 8) + (c2 >> 8) + (c3 >> 8));
+	}
+}
+
+// sums of each run of size words along row y, for the count outputs from x; a running sum,
+// exact in integers
+static void rowSums( long long* dst, std::vector<int>& scratch, int x, int y, int count, int radius, int frame, int channel, unsigned int seed ) {
+	const int size = 2 * radius + 1;
+	scratch.resize(count + 2 * radius);
+	int* line = &scratch[0];
+	words(line, x - radius, y, count + 2 * radius, frame, channel, seed);
+	long long sum = 0;
+	for( int k = 0; k < size; ++k ) {
+		sum += line[k];
+	}
+	dst[0] = sum;
+	for( int i = 1; i < count; ++i ) {
+		sum += line[i + size - 1] - line[i - 1];
+		dst[i] = sum;
+	}
+}
+
+void Grain::noise( float* dst, int x, int y, int count, int frame, int channel, unsigned int seed ) {
+	int i = CpuFeatures::hasSSE2() ? noiseSSE(dst, x, y, count, frame, channel, seed) : 0;
+	for( ; i < count; ++i ) {
+		dst[i] = sampleScalar(static_cast<unsigned int>(x + i), static_cast<unsigned int>(y), static_cast<unsigned int>(frame), static_cast<unsigned int>(channel), seed);
+	}
+}
+
+Grain::Window::Window()
+	: x(0), y(0), count(0), radius(0), frame(0), channel(0), seed(0), valid(false) {
+}
+
+void Grain::blurred( float* dst, int x, int y, int count, int radius, int frame, int channel, unsigned int seed, Window& window ) {
+	if( radius <= 0 ) {
+		noise(dst, x, y, count, frame, channel, seed);
+		return;
+	}
+	if( count <= 0 ) {
+		return;
+	}
+
+	// the window keeps the row sums of its last 2*radius+1 rows, row y in slot y mod size, and
+	// their column sums.  the next row only generates the row entering the window, whose slot
+	// is that of the row leaving it.
+	const int size = 2 * radius + 1;
+	const bool same = window.valid && window.x == x && window.count == count && window.radius == radius
+		&& window.frame == frame && window.channel == channel && window.seed == seed;
+	if( !same || (window.y != y && window.y != y - 1) ) {
+		window.x = x;
+		window.count = count;
+		window.radius = radius;
+		window.frame = frame;
+		window.channel = channel;
+		window.seed = seed;
+		window.rows.resize(static_cast<size_t>(size) * count);
+		window.columns.assign(count, 0);
+		for( int row = y - radius; row <= y + radius; ++row ) {
+			long long* line = &window.rows[static_cast<size_t>(((row % size) + size) % size) * count];
+			rowSums(line, window.words, x, row, count, radius, frame, channel, seed);
+			for( int i = 0; i < count; ++i ) {
+				window.columns[i] += line[i];
+			}
+		}
+		window.valid = true;
+	} else if( window.y == y - 1 ) {
+		const int enter = y + radius;
+		long long* line = &window.rows[static_cast<size_t>(((enter % size) + size) % size) * count];
+		window.sums.resize(count);
+		long long* entering = &window.sums[0];
+		rowSums(entering, window.words, x, enter, count, radius, frame, channel, seed);
+		for( int i = 0; i < count; ++i ) {
+			window.columns[i] += entering[i] - line[i];
+			line[i] = entering[i];
+		}
+	}
+	window.y = y;
+
+	// a box of size^2 unit variance samples has variance 1/size^2, hence the 1/size.  the sums
+	// are exact, so every output is the same whatever the span or the rows before it.
+	const double area = static_cast<double>(size) * static_cast<double>(size);
+	const double scale = static_cast<double>(UNIT_VARIANCE) / static_cast<double>(size);
+	for( int i = 0; i < count; ++i ) {
+		dst[i] = static_cast<float>((static_cast<double>(window.columns[i]) * UNIFORM_SCALE - 2.0 * area) * scale);
+	}
+}
\ No newline at end of file
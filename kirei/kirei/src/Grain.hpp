@@ -0,0 +1,43 @@
+#ifndef __grain__
+#define __grain__
+
+#include <vector>
+
+// film grain from a counter-based generator, philox 4x32-10: Salmon et al., "Parallel random
+// numbers: as easy as 1, 2, 3", SC 2011.  each sample is a pure function of its (frame, x, y,
+// channel) and the seed, so any row on any thread, host or instruction set gets the same grain.
+// a sample is the sum of the four uniforms philox gives, rescaled to zero mean and unit variance.
+class Grain {
+public:
+	// dst[i] is the sample at (x + i, y)
+	static void noise( float* dst, int x, int y, int count, int frame, int channel, unsigned int seed );
+
+	// running sums of blurred's box for one thread's run of consecutive rows of a span and
+	// channel.  keep one per thread and channel and pass it to every call, so that the next row
+	// only generates the one row entering the box.
+	struct Window {
+		Window();
+		int x;
+		int y;
+		int count;
+		int radius;
+		int frame;
+		int channel;
+		unsigned int seed;
+		bool valid;
+		std::vector<long long> rows;    // box-wide sums along the last 2*radius+1 rows
+		std::vector<long long> columns; // sums of those rows, one per output
+		std::vector<long long> sums;
+		std::vector<int> words;
+	};
+
+	// the samples box filtered over the (2*radius+1)^2 window around each and rescaled back to
+	// unit variance, for grain about 2*radius+1 pixels across.  the box is summed in integers,
+	// so no output depends on how the row is split or which rows the window saw before.
+	static void blurred( float* dst, int x, int y, int count, int radius, int frame, int channel, unsigned int seed, Window& window );
+
+private:
+	Grain();
+};
+
+#endif /* __grain__ */
\ No newline at end of file
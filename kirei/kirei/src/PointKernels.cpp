@@ -0,0 +1,356 @@
+#include "PointKernels.hpp"
+#include "CpuFeatures.hpp"
+#include <cstddef>
+#include <cmath>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+// each kernel works on one pixel (scalar) or one vector of pixels per channel, in place.
+// min and max take the constant first so that a nan input comes through as nan, like the
+// comparisons in the scalar versions.
+
+struct CopyKernel {
+	void operator()( float&, float&, float& ) const {
+	}
+	void operator()( __m128&, __m128&, __m128& ) const {
+	}
+	KIREI_TARGET_AVX void operator()( __m256&, __m256&, __m256& ) const {
+	}
+};
+
+struct InvertKernel {
+	void operator()( float& r, float& g, float& b ) const {
+		r = 1.0f - r;
+		g = 1.0f - g;
+		b = 1.0f - b;
+	}
+	void operator()( __m128& r, __m128& g, __m128& b ) const {
+		const __m128 one = _mm_set1_ps(1.0f);
+		r = _mm_sub_ps(one, r);
+		g = _mm_sub_ps(one, g);
+		b = _mm_sub_ps(one, b);
+	}
+	KIREI_TARGET_AVX void operator()( __m256& r, __m256& g, __m256& b ) const {
+		const __m256 one = _mm256_set1_ps(1.0f);
+		r = _mm256_sub_ps(one, r);
+		g = _mm256_sub_ps(one, g);
+		b = _mm256_sub_ps(one, b);
+	}
+};
+
+// http://stackoverflow.com/questions/1061093/how-is-a-sepia-tone-created
+struct SepiaKernel {
+	void operator()( float& r, float& g, float& b ) const {
+		const float red   = (r * 0.393f) + (g * 0.769f) + (b * 0.189f);
+		const float green = (r * 0.349f) + (g * 0.686f) + (b * 0.168f);
+		const float blue  = (r * 0.272f) + (g * 0.534f) + (b * 0.131f);
+		r = (red >= 1.0f) ? 1.0f : red;
+		g = (green >= 1.0f) ? 1.0f : green;
+		b = (blue >= 1.0f) ? 1.0f : blue;
+	}
+	void operator()( __m128& r, __m128& g, __m128& b ) const {
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 red   = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.393f)), _mm_mul_ps(g, _mm_set1_ps(0.769f))), _mm_mul_ps(b, _mm_set1_ps(0.189f)));
+		const __m128 green = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.349f)), _mm_mul_ps(g, _mm_set1_ps(0.686f))), _mm_mul_ps(b, _mm_set1_ps(0.168f)));
+		const __m128 blue  = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.272f)), _mm_mul_ps(g, _mm_set1_ps(0.534f))), _mm_mul_ps(b, _mm_set1_ps(0.131f)));
+		r = _mm_min_ps(one, red);
+		g = _mm_min_ps(one, green);
+		b = _mm_min_ps(one, blue);
+	}
+	KIREI_TARGET_AVX void operator()( __m256& r, __m256& g, __m256& b ) const {
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 red   = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.393f)), _mm256_mul_ps(g, _mm256_set1_ps(0.769f))), _mm256_mul_ps(b, _mm256_set1_ps(0.189f)));
+		const __m256 green = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.349f)), _mm256_mul_ps(g, _mm256_set1_ps(0.686f))), _mm256_mul_ps(b, _mm256_set1_ps(0.168f)));
+		const __m256 blue  = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.272f)), _mm256_mul_ps(g, _mm256_set1_ps(0.534f))), _mm256_mul_ps(b, _mm256_set1_ps(0.131f)));
+		r = _mm256_min_ps(one, red);
+		g = _mm256_min_ps(one, green);
+		b = _mm256_min_ps(one, blue);
+	}
+};
+
+struct GainKernel {
+	float gains[3];
+
+	void operator()( float& r, float& g, float& b ) const {
+		r = r * gains[0];
+		g = g * gains[1];
+		b = b * gains[2];
+	}
+	void operator()( __m128& r, __m128& g, __m128& b ) const {
+		r = _mm_mul_ps(r, _mm_set1_ps(gains[0]));
+		g = _mm_mul_ps(g, _mm_set1_ps(gains[1]));
+		b = _mm_mul_ps(b, _mm_set1_ps(gains[2]));
+	}
+	KIREI_TARGET_AVX void operator()( __m256& r, __m256& g, __m256& b ) const {
+		r = _mm256_mul_ps(r, _mm256_set1_ps(gains[0]));
+		g = _mm256_mul_ps(g, _mm256_set1_ps(gains[1]));
+		b = _mm256_mul_ps(b, _mm256_set1_ps(gains[2]));
+	}
+};
+
+// per channel: into, mix, 1 - mix and 1 - into
+struct MixKernel {
+	float weights[3][4];
+
+	static float mixScalar( const float* w, float self, float a, float b ) {
+		const float value = w[0] * (w[1] * a + w[2] * b) + w[3] * self;
+		if( value < 0.0f ) {
+			return 0.0f;
+		}
+		if( value > 1.0f ) {
+			return 1.0f;
+		}
+		return value;
+	}
+	static __m128 mixSSE( const float* w, __m128 self, __m128 a, __m128 b ) {
+		const __m128 mixed = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(w[1]), a), _mm_mul_ps(_mm_set1_ps(w[2]), b));
+		const __m128 value = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(w[0]), mixed), _mm_mul_ps(_mm_set1_ps(w[3]), self));
+		return _mm_min_ps(_mm_set1_ps(1.0f), _mm_max_ps(_mm_setzero_ps(), value));
+	}
+	KIREI_TARGET_AVX static __m256 mixAVX( const float* w, __m256 self, __m256 a, __m256 b ) {
+		const __m256 mixed = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(w[1]), a), _mm256_mul_ps(_mm256_set1_ps(w[2]), b));
+		const __m256 value = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(w[0]), mixed), _mm256_mul_ps(_mm256_set1_ps(w[3]), self));
+		return _mm256_min_ps(_mm256_set1_ps(1.0f), _mm256_max_ps(_mm256_setzero_ps(), value));
+	}
+
+	void operator()( float& r, float& g, float& b ) const {
+		const float red = mixScalar(weights[0], r, g, b);
+		const float green = mixScalar(weights[1], g, b, r);
+		const float blue = mixScalar(weights[2], b, r, g);
+		r = red;
+		g = green;
+		b = blue;
+	}
+	void operator()( __m128& r, __m128& g, __m128& b ) const {
+		const __m128 red = mixSSE(weights[0], r, g, b);
+		const __m128 green = mixSSE(weights[1], g, b, r);
+		const __m128 blue = mixSSE(weights[2], b, r, g);
+		r = red;
+		g = green;
+		b = blue;
+	}
+	KIREI_TARGET_AVX void operator()( __m256& r, __m256& g, __m256& b ) const {
+		const __m256 red = mixAVX(weights[0], r, g, b);
+		const __m256 green = mixAVX(weights[1], g, b, r);
+		const __m256 blue = mixAVX(weights[2], b, r, g);
+		r = red;
+		g = green;
+		b = blue;
+	}
+};
+
+// the runners go left to right, so the kernel keeps the position of the pixel it is given next
+struct VignetteKernel {
+	float left;
+	float width;
+	float v2;
+	float radius;
+	float range; // (radius - softness) - radius, as smoothstep works it out
+	mutable float x;
+
+	float weight( float u ) const {
+		const float distance = sqrtf(u * u + v2);
+		float t = (distance - radius) / range;
+		t = (1.0f >= t) ? t : 1.0f;
+		t = (0.0f <= t) ? t : 0.0f;
+		return t * t * (3.0f - 2.0f * t);
+	}
+	void operator()( float& r, float& g, float& b ) const {
+		const float w = weight((x - left) / width - 0.5f);
+		r = r + (r * w - r) * 0.5f;
+		g = g + (g * w - g) * 0.5f;
+		b = b + (b * w - b) * 0.5f;
+		x += 1.0f;
+	}
+	void operator()( __m128& r, __m128& g, __m128& b ) const {
+		const __m128 u = _mm_sub_ps(_mm_div_ps(_mm_sub_ps(_mm_add_ps(_mm_set1_ps(x), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f)), _mm_set1_ps(left)), _mm_set1_ps(width)), _mm_set1_ps(0.5f));
+		const __m128 distance = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(u, u), _mm_set1_ps(v2)));
+		__m128 t = _mm_div_ps(_mm_sub_ps(distance, _mm_set1_ps(radius)), _mm_set1_ps(range));
+		t = _mm_max_ps(_mm_min_ps(t, _mm_set1_ps(1.0f)), _mm_setzero_ps());
+		const __m128 w = _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_set1_ps(2.0f), t)));
+		const __m128 half = _mm_set1_ps(0.5f);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(r, w), r), half));
+		g = _mm_add_ps(g, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(g, w), g), half));
+		b = _mm_add_ps(b, _mm_mul_ps(_mm_sub_ps(_mm_mul_ps(b, w), b), half));
+		x += 4.0f;
+	}
+	KIREI_TARGET_AVX void operator()( __m256& r, __m256& g, __m256& b ) const {
+		const __m256 u = _mm256_sub_ps(_mm256_div_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_set1_ps(x), _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f)), _mm256_set1_ps(left)), _mm256_set1_ps(width)), _mm256_set1_ps(0.5f));
+		const __m256 distance = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(u, u), _mm256_set1_ps(v2)));
+		__m256 t = _mm256_div_ps(_mm256_sub_ps(distance, _mm256_set1_ps(radius)), _mm256_set1_ps(range));
+		t = _mm256_max_ps(_mm256_min_ps(t, _mm256_set1_ps(1.0f)), _mm256_setzero_ps());
+		const __m256 w = _mm256_mul_ps(_mm256_mul_ps(t, t), _mm256_sub_ps(_mm256_set1_ps(3.0f), _mm256_mul_ps(_mm256_set1_ps(2.0f), t)));
+		const __m256 half = _mm256_set1_ps(0.5f);
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(r, w), r), half));
+		g = _mm256_add_ps(g, _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(g, w), g), half));
+		b = _mm256_add_ps(b, _mm256_mul_ps(_mm256_sub_ps(_mm256_mul_ps(b, w), b), half));
+		x += 8.0f;
+	}
+};
+
+// amount * (1 - response + response * m) of each channel's noise is added, m being 4l(1 - l) of
+// the luminance l clamped to [0, 1].  like the vignette, the kernel steps along the noise as the
+// runners go left to right.
+struct GrainKernel {
+	float amount;
+	float response;
+	mutable const float* noise[3];
+
+	void operator()( float& r, float& g, float& b ) const {
+		const float luminance = (r * 0.3f) + (g * 0.59f) + (b * 0.11f);
+		float midtones = 4.0f * luminance * (1.0f - luminance);
+		midtones = (1.0f >= midtones) ? midtones : 1.0f;
+		midtones = (0.0f <= midtones) ? midtones : 0.0f;
+		const float weight = amount * (1.0f - response + response * midtones);
+		r = r + weight * *noise[0]++;
+		g = g + weight * *noise[1]++;
+		b = b + weight * *noise[2]++;
+	}
+	void operator()( __m128& r, __m128& g, __m128& b ) const {
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 luminance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.3f)), _mm_mul_ps(g, _mm_set1_ps(0.59f))), _mm_mul_ps(b, _mm_set1_ps(0.11f)));
+		__m128 midtones = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(4.0f), luminance), _mm_sub_ps(one, luminance));
+		midtones = _mm_max_ps(_mm_min_ps(midtones, one), _mm_setzero_ps());
+		const __m128 weight = _mm_mul_ps(_mm_set1_ps(amount), _mm_add_ps(_mm_sub_ps(one, _mm_set1_ps(response)), _mm_mul_ps(_mm_set1_ps(response), midtones)));
+		r = _mm_add_ps(r, _mm_mul_ps(weight, _mm_loadu_ps(noise[0])));
+		g = _mm_add_ps(g, _mm_mul_ps(weight, _mm_loadu_ps(noise[1])));
+		b = _mm_add_ps(b, _mm_mul_ps(weight, _mm_loadu_ps(noise[2])));
+		noise[0] += 4;
+		noise[1] += 4;
+		noise[2] += 4;
+	}
+	KIREI_TARGET_AVX void operator()( __m256& r, __m256& g, __m256& b ) const {
+		const __m256 one = _mm256_set1_ps(1.0f);
+		const __m256 luminance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.3f)), _mm256_mul_ps(g, _mm256_set1_ps(0.59f))), _mm256_mul_ps(b, _mm256_set1_ps(0.11f)));
+		__m256 midtones = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(4.0f), luminance), _mm256_sub_ps(one, luminance));
+		midtones = _mm256_max_ps(_mm256_min_ps(midtones, one), _mm256_setzero_ps());
+		const __m256 weight = _mm256_mul_ps(_mm256_set1_ps(amount), _mm256_add_ps(_mm256_sub_ps(one, _mm256_set1_ps(response)), _mm256_mul_ps(_mm256_set1_ps(response), midtones)));
+		r = _mm256_add_ps(r, _mm256_mul_ps(weight, _mm256_loadu_ps(noise[0])));
+		g = _mm256_add_ps(g, _mm256_mul_ps(weight, _mm256_loadu_ps(noise[1])));
+		b = _mm256_add_ps(b, _mm256_mul_ps(weight, _mm256_loadu_ps(noise[2])));
+		noise[0] += 8;
+		noise[1] += 8;
+		noise[2] += 8;
+	}
+};
+
+template<class Kernel>
+static void runScalar( const Kernel& kernel, const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int start, int count ) {
+	for( int i = start; i < count; ++i ) {
+		float red = rIn[i];
+		float green = gIn[i];
+		float blue = bIn[i];
+		kernel(red, green, blue);
+		rOut[i] = red;
+		gOut[i] = green;
+		bOut[i] = blue;
+	}
+}
+
+// number of pixels to do one at a time before ptr is aligned to the vector size, so that the
+// vector stores do not straddle cache lines
+static int alignedHead( const float* ptr, size_t alignment, int count ) {
+	const size_t misalignment = reinterpret_cast<size_t>(ptr) % alignment;
+	const int head = (0 == misalignment) ? 0 : static_cast<int>((alignment - misalignment) / sizeof(float));
+	return (head < count) ? head : count;
+}
+
+template<class Kernel>
+static void runSSE( const Kernel& kernel, const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count ) {
+	int i = alignedHead(rOut, 16, count);
+	runScalar(kernel, rIn, gIn, bIn, rOut, gOut, bOut, 0, i);
+	for( ; i + 4 <= count; i += 4 ) {
+		__m128 red = _mm_loadu_ps(rIn + i);
+		__m128 green = _mm_loadu_ps(gIn + i);
+		__m128 blue = _mm_loadu_ps(bIn + i);
+		kernel(red, green, blue);
+		_mm_storeu_ps(rOut + i, red);
+		_mm_storeu_ps(gOut + i, green);
+		_mm_storeu_ps(bOut + i, blue);
+	}
+	runScalar(kernel, rIn, gIn, bIn, rOut, gOut, bOut, i, count);
+}
+
+template<class Kernel>
+KIREI_TARGET_AVX static void runAVX( const Kernel& kernel, const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count ) {
+	int i = alignedHead(rOut, 32, count);
+	runScalar(kernel, rIn, gIn, bIn, rOut, gOut, bOut, 0, i);
+	for( ; i + 8 <= count; i += 8 ) {
+		__m256 red = _mm256_loadu_ps(rIn + i);
+		__m256 green = _mm256_loadu_ps(gIn + i);
+		__m256 blue = _mm256_loadu_ps(bIn + i);
+		kernel(red, green, blue);
+		_mm256_storeu_ps(rOut + i, red);
+		_mm256_storeu_ps(gOut + i, green);
+		_mm256_storeu_ps(bOut + i, blue);
+	}
+	runScalar(kernel, rIn, gIn, bIn, rOut, gOut, bOut, i, count);
+}
+
+template<class Kernel>
+static void run( const Kernel& kernel, const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count ) {
+	if( CpuFeatures::hasAVX() ) {
+		runAVX(kernel, rIn, gIn, bIn, rOut, gOut, bOut, count);
+	} else if( CpuFeatures::hasSSE2() ) {
+		runSSE(kernel, rIn, gIn, bIn, rOut, gOut, bOut, count);
+	} else {
+		runScalar(kernel, rIn, gIn, bIn, rOut, gOut, bOut, 0, count);
+	}
+}
+
+void PointKernels::copy( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count ) {
+	run(CopyKernel(), rIn, gIn, bIn, rOut, gOut, bOut, count);
+}
+
+void PointKernels::invert( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count ) {
+	run(InvertKernel(), rIn, gIn, bIn, rOut, gOut, bOut, count);
+}
+
+void PointKernels::sepia( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count ) {
+	run(SepiaKernel(), rIn, gIn, bIn, rOut, gOut, bOut, count);
+}
+
+void PointKernels::gain( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count, float rGain, float gGain, float bGain ) {
+	GainKernel kernel;
+	kernel.gains[0] = rGain;
+	kernel.gains[1] = gGain;
+	kernel.gains[2] = bGain;
+	run(kernel, rIn, gIn, bIn, rOut, gOut, bOut, count);
+}
+
+void PointKernels::mix( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count,
+	float intoRed, float mixRed, float intoGreen, float mixGreen, float intoBlue, float mixBlue ) {
+	MixKernel kernel;
+	const float into[3] = { intoRed, intoGreen, intoBlue };
+	const float mix[3] = { mixRed, mixGreen, mixBlue };
+	for( int c = 0; c < 3; ++c ) {
+		kernel.weights[c][0] = into[c];
+		kernel.weights[c][1] = mix[c];
+		kernel.weights[c][2] = 1.0f - mix[c];
+		kernel.weights[c][3] = 1.0f - into[c];
+	}
+	run(kernel, rIn, gIn, bIn, rOut, gOut, bOut, count);
+}
+
+void PointKernels::vignette( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count,
+	int x, float left, float width, float v2, float radius, float softness ) {
+	VignetteKernel kernel;
+	kernel.left = left;
+	kernel.width = width;
+	kernel.v2 = v2;
+	kernel.radius = radius;
+	kernel.range = (radius - softness) - radius;
+	kernel.x = static_cast<float>(x);
+	run(kernel, rIn, gIn, bIn, rOut, gOut, bOut, count);
+}
+
+void PointKernels::grain( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count,
+	const float* rNoise, const float* gNoise, const float* bNoise, float amount, float response ) {
+	GrainKernel kernel;
+	kernel.amount = amount;
+	kernel.response = response;
+	kernel.noise[0] = rNoise;
+	kernel.noise[1] = gNoise;
+	kernel.noise[2] = bNoise;
+	run(kernel, rIn, gIn, bIn, rOut, gOut, bOut, count);
+}
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef __point_kernels__
+#define __point_kernels__
+
+// the per-pixel colour filters over three planes of count floats, vectorised with the widest
+// instruction set CpuFeatures reports.  the vector paths do the same operations in the same
+// order as the scalar ones (no fused multiply-add), so every host gets identical bits.
+// in and out may be the same planes.
+class PointKernels {
+public:
+	static void copy( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count );
+	static void invert( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count );
+	static void sepia( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count );
+	static void gain( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count, float rGain, float gGain, float bGain );
+
+	// each channel becomes into * (mix * a + (1 - mix) * b) + (1 - into) * itself, clamped to [0, 1],
+	// with a and b the other two channels in the order red <- (g, b), green <- (b, r), blue <- (r, g)
+	static void mix( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count,
+		float intoRed, float mixRed, float intoGreen, float mixGreen, float intoBlue, float mixBlue );
+
+	// pixel x + i is scaled by lerp(1, w, 0.5), w being the smoothstep from radius down to
+	// radius - softness of its distance sqrt(u^2 + v2) from the centre, u = (x + i - left) / width - 0.5
+	static void vignette( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count,
+		int x, float left, float width, float v2, float radius, float softness );
+
+	// film grain: count samples of each channel's noise are added, scaled by amount and by how
+	// close to the midtones the pixel is, (1 - response) + response * clamp(4l(1 - l), 0, 1) for
+	// the luminance l = 0.3r + 0.59g + 0.11b
+	static void grain( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int count,
+		const float* rNoise, const float* gNoise, const float* bNoise, float amount, float response );
+
+private:
+	PointKernels();
+};
+
+#endif /* __point_kernels__ */
\ No newline at end of file
@@ -0,0 +1,222 @@
+#include "RankFilter.hpp"
+#include <climits>
+#include <cstddef>
+
+namespace {
+	inline int clampIndex( int i, int length ) {
+		return (i < 0) ? 0 : ((i >= length) ? length - 1 : i);
+	}
+
+	struct Maximum {
+		static float pick( float a, float b ) {
+			return (b > a) ? b : a;
+		}
+	};
+
+	struct Minimum {
+		static float pick( float a, float b ) {
+			return (b < a) ? b : a;
+		}
+	};
+
+	template<class Op>
+	void extremumLine( const float* src, int srcStride, int length, int first, int count, int radius, float* dst, int dstStride, std::vector<float>& scratch ) {
+		// the clamped line is cut into blocks of the window size.  g runs forward from each block
+		// start and h backward from each block end, so any window is h at its start combined with
+		// g at its end: three comparisons per sample whatever the radius.
+		const int window = 2 * radius + 1;
+		const int padded = count + 2 * radius;
+		scratch.resize(2 * padded);
+		float* g = &scratch[0];
+		float* h = &scratch[padded];
+		const int start = first - radius;
+
+		for( int j = 0; j < padded; ++j ) {
+			const float value = src[static_cast<long long>(clampIndex(start + j, length)) * srcStride];
+			g[j] = (0 == j % window) ? value : Op::pick(g[j - 1], value);
+		}
+		for( int j = padded - 1; j >= 0; --j ) {
+			const float value = src[static_cast<long long>(clampIndex(start + j, length)) * srcStride];
+			h[j] = (j == padded - 1 || window - 1 == j % window) ? value : Op::pick(h[j + 1], value);
+		}
+		for( int i = 0; i < count; ++i ) {
+			dst[static_cast<long long>(i) * dstStride] = Op::pick(h[i], g[i + window - 1]);
+		}
+	}
+
+	struct Quantiser {
+		float low;
+		float high;
+		float scale;
+		float step;
+
+		Quantiser( float lo, float hi )
+			: low(lo), high(hi), scale(0.0f), step(0.0f) {
+			if( hi > lo ) {
+				scale = static_cast<float>(RankFilter::LEVELS - 1) / (hi - lo);
+				step = (hi - lo) / static_cast<float>(RankFilter::LEVELS - 1);
+			}
+		}
+		int level( float value ) const {
+			const float t = (value - low) * scale + 0.5f;
+			if( !(t > 0.0f) ) {
+				return 0;
+			}
+			return (t < static_cast<float>(RankFilter::LEVELS - 1)) ? static_cast<int>(t) : RankFilter::LEVELS - 1;
+		}
+		float value( int level ) const {
+			// the ends come back exactly, so flat black and white areas stay flat
+			return (RankFilter::LEVELS - 1 == level) ? high : low + static_cast<float>(level) * step;
+		}
+	};
+}
+
+RankFilter::RankFilter() {
+}
+
+void RankFilter::extremum( const float* src, int srcStride, int length, int first, int count, int radius, bool maximum,
+	float* dst, int dstStride, std::vector<float>& scratch ) {
+	if( count <= 0 || length <= 0 ) {
+		return;
+	}
+	if( maximum ) {
+		extremumLine<Maximum>(src, srcStride, length, first, count, radius, dst, dstStride, scratch);
+	} else {
+		extremumLine<Minimum>(src, srcStride, length, first, count, radius, dst, dstStride, scratch);
+	}
+}
+
+void RankFilter::median( const float* src, int width, int height, int x, int y, int columns, int rows, int radius,
+	float low, float high, float* dst, int dstStride ) {
+	if( columns <= 0 || rows <= 0 || width <= 0 || height <= 0 ) {
+		return;
+	}
+
+	const Quantiser quantiser(low, high);
+	if( 0.0f == quantiser.scale ) {
+		// a single level; every window has the same median
+		for( int j = 0; j < rows; ++j ) {
+			for( int i = 0; i < columns; ++i ) {
+				dst[static_cast<long long>(j) * dstStride + i] = low;
+			}
+		}
+		return;
+	}
+
+	// a coarse and a fine histogram per source column the windows touch, counting the 2r+1 rows
+	// around the current one.  the window histogram adds 2r+1 column histograms and slides along
+	// the row; its fine part is only brought up to date for the coarse bin the median falls in.
+	const int window = 2 * radius + 1;
+	const int half = (window * window) / 2;
+	const int firstColumn = clampIndex(x - radius, width);
+	const int lastColumn = clampIndex(x + columns - 1 + radius, width);
+	const int columnCount = lastColumn - firstColumn + 1;
+	std::vector<unsigned short> columnCoarse(static_cast<size_t>(columnCount) * COARSE, 0);
+	std::vector<unsigned short> columnFine(static_cast<size_t>(columnCount) * LEVELS, 0);
+
+	for( int k = -radius; k <= radius; ++k ) {
+		const float* line = src + static_cast<long long>(clampIndex(y + k, height)) * width;
+		for( int c = 0; c < columnCount; ++c ) {
+			const int level = quantiser.level(line[firstColumn + c]);
+			++columnCoarse[c * COARSE + level / FINE];
+			++columnFine[static_cast<size_t>(c) * LEVELS + level];
+		}
+	}
+
+	std::vector<int> kernelCoarse(COARSE);
+	std::vector<int> kernelFine(LEVELS);
+	std::vector<int> kernelValid(COARSE);
+
+	for( int j = 0; j < rows; ++j ) {
+		if( j > 0 ) {
+			// slide the column histograms down one row
+			const int enter = clampIndex(y + j + radius, height);
+			const int leave = clampIndex(y + j - radius - 1, height);
+			if( enter != leave ) {
+				const float* enterLine = src + static_cast<long long>(enter) * width + firstColumn;
+				const float* leaveLine = src + static_cast<long long>(leave) * width + firstColumn;
+				for( int c = 0; c < columnCount; ++c ) {
+					const int in = quantiser.level(enterLine[c]);
+					const int out = quantiser.level(leaveLine[c]);
+					if( in != out ) {
+						++columnCoarse[c * COARSE + in / FINE];
+						--columnCoarse[c * COARSE + out / FINE];
+						++columnFine[static_cast<size_t>(c) * LEVELS + in];
+						--columnFine[static_cast<size_t>(c) * LEVELS + out];
+					}
+				}
+			}
+		}
+
+		// the window histogram of the first output pixel; fine bins are filled on demand
+		for( int b = 0; b < COARSE; ++b ) {
+			kernelCoarse[b] = 0;
+			kernelValid[b] = INT_MIN;
+		}
+		for( int k = -radius; k <= radius; ++k ) {
+			const unsigned short* coarse = &columnCoarse[(clampIndex(x + k, width) - firstColumn) * COARSE];
+			for( int b = 0; b < COARSE; ++b ) {
+				kernelCoarse[b] += coarse[b];
+			}
+		}
+
+		float* out = dst + static_cast<long long>(j) * dstStride;
+		for( int i = 0; i < columns; ++i ) {
+			const int px = x + i;
+			if( i > 0 ) {
+				const int enter = clampIndex(px + radius, width) - firstColumn;
+				const int leave = clampIndex(px - radius - 1, width) - firstColumn;
+				if( enter != leave ) {
+					const unsigned short* in = &columnCoarse[enter * COARSE];
+					const unsigned short* gone = &columnCoarse[leave * COARSE];
+					for( int b = 0; b < COARSE; ++b ) {
+						kernelCoarse[b] += in[b] - gone[b];
+					}
+				}
+			}
+
+			// coarse bin holding the median
+			int below = 0;
+			int bin = 0;
+			while( below + kernelCoarse[bin] <= half ) {
+				below += kernelCoarse[bin];
+				++bin;
+			}
+
+			// bring that bin's fine histogram up to this pixel, from scratch if it is too far behind
+			int* fine = &kernelFine[bin * FINE];
+			if( INT_MIN == kernelValid[bin] || px - kernelValid[bin] > window ) {
+				for( int f = 0; f < FINE; ++f ) {
+					fine[f] = 0;
+				}
+				for( int k = -radius; k <= radius; ++k ) {
+					const unsigned short* column = &columnFine[static_cast<size_t>(clampIndex(px + k, width) - firstColumn) * LEVELS + bin * FINE];
+					for( int f = 0; f < FINE; ++f ) {
+						fine[f] += column[f];
+					}
+				}
+			} else {
+				for( int cx = kernelValid[bin] + 1; cx <= px; ++cx ) {
+					const int enter = clampIndex(cx + radius, width) - firstColumn;
+					const int leave = clampIndex(cx - radius - 1, width) - firstColumn;
+					if( enter == leave ) {
+						continue;
+					}
+					const unsigned short* in = &columnFine[static_cast<size_t>(enter) * LEVELS + bin * FINE];
+					const unsigned short* gone = &columnFine[static_cast<size_t>(leave) * LEVELS + bin * FINE];
+					for( int f = 0; f < FINE; ++f ) {
+						fine[f] += in[f] - gone[f];
+					}
+				}
+			}
+			kernelValid[bin] = px;
+
+			int level = 0;
+			while( below + fine[level] <= half ) {
+				below += fine[level];
+				++level;
+			}
+			out[i] = quantiser.value(bin * FINE + level);
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,32 @@
+#ifndef __rank_filter__
+#define __rank_filter__
+
+#include <vector>
+
+// square rank filters whose cost per pixel does not depend on the radius.  samples outside
+// the source are clamped to its edges, like the other neighbourhood filters.
+class RankFilter {
+public:
+	// running maximum (dilate) or minimum (erode) of 2*radius+1 samples along a line, using
+	// van Herk / Gil-Werman: "A fast algorithm for local minimum and maximum filters on
+	// rectangular and octagonal kernels", Pattern Recognition Letters 13 (1992).
+	// dst[i*dstStride] is the extremum of src[clamp(first+i+k)*srcStride] for k in [-radius, radius],
+	// positions being clamped to [0, length).
+	static void extremum( const float* src, int srcStride, int length, int first, int count, int radius, bool maximum,
+		float* dst, int dstStride, std::vector<float>& scratch );
+
+	// median of the (2*radius+1)^2 window, using Perreault & Hebert: "Median filtering in
+	// constant time", IEEE Trans. Image Processing 16 (2007).  values are quantised to LEVELS
+	// steps over [low, high] (the rest is clamped, nan counts as low), so the result is within
+	// half a step of the true median.  src is a row-major width*height plane; the columns*rows
+	// outputs start at (x, y) in it, which may lie outside, and go to dst with dstStride per row.
+	static void median( const float* src, int width, int height, int x, int y, int columns, int rows, int radius,
+		float low, float high, float* dst, int dstStride );
+
+	enum { COARSE = 64, FINE = 64, LEVELS = COARSE * FINE };
+
+private:
+	RankFilter();
+};
+
+#endif /* __rank_filter__ */
\ No newline at end of file
@@ -0,0 +1,154 @@
+#include "RecursiveGaussian.hpp"
+#include <cmath>
+
+RecursiveGaussian::RecursiveGaussian()
+	: _identity(true), _B(1.0), _b1(0.0), _b2(0.0), _b3(0.0) {
+	for( int i = 0; i < 9; ++i ) {
+		_M[i] = 0.0;
+	}
+}
+
+RecursiveGaussian::~RecursiveGaussian() {
+}
+
+void RecursiveGaussian::setSigma( float sigma ) {
+	// below 0.5 the approximation breaks down and the blur is invisible anyway
+	_identity = (sigma < 0.5f);
+	if( _identity ) {
+		_B = 1.0;
+		_b1 = _b2 = _b3 = 0.0;
+		return;
+	}
+
+	// eq. 11b of the paper
+	const double s = static_cast<double>(sigma);
+	const double q = (s >= 2.5) ? (0.98711 * s - 0.96330) : (3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * s));
+	const double q2 = q * q;
+	const double q3 = q2 * q;
+
+	// eq. 8c of the paper
+	const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+	const double b1 = 2.44413 * q + 2.85619 * q2 + 1.26661 * q3;
+	const double b2 = -(1.4281 * q2 + 1.26661 * q3);
+	const double b3 = 0.422205 * q3;
+
+	_b1 = b1 / b0;
+	_b2 = b2 / b0;
+	_b3 = b3 / b0;
+	_B = 1.0 - (_b1 + _b2 + _b3);
+
+	// boundary matrix for a signal that continues with its edge value forever
+	const double a1 = _b1;
+	const double a2 = _b2;
+	const double a3 = _b3;
+	const double scale = 1.0 / ((1.0 + a1 - a2 + a3) * (1.0 - a1 - a2 - a3) * (1.0 + a2 + (a1 - a3) * a3));
+	_M[0] = scale * (-a3 * a1 + 1.0 - a3 * a3 - a2);
+	_M[1] = scale * (a3 + a1) * (a2 + a3 * a1);
+	_M[2] = scale * a3 * (a1 + a3 * a2);
+	_M[3] = scale * (a1 + a3 * a2);
+	_M[4] = -scale * (a2 - 1.0) * (a2 + a3 * a1);
+	_M[5] = -scale * a3 * (a3 * a1 + a3 * a3 + a2 - 1.0);
+	_M[6] = scale * (a3 * a1 + a2 + a1 * a1 - a2 * a2);
+	_M[7] = scale * (a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a3 * a2 + a3);
+	_M[8] = scale * a3 * (a1 + a3 * a2);
+}
+
+bool RecursiveGaussian::isIdentity() const {
+	return _identity;
+}
+
+void RecursiveGaussian::filterLine( float* data, int count ) const {
+	if( _identity || count <= 0 ) {
+		return;
+	}
+
+	// the causal pass starts from the steady state of a constant signal equal to the first
+	// sample, and the anticausal pass from the exact state for a signal clamped past its end
+	const double last = data[count - 1];
+	double w1 = data[0];
+	double w2 = w1;
+	double w3 = w1;
+	for( int i = 0; i < count; ++i ) {
+		const double w = _B * data[i] + _b1 * w1 + _b2 * w2 + _b3 * w3;
+		data[i] = static_cast<float>(w);
+		w3 = w2;
+		w2 = w1;
+		w1 = w;
+	}
+
+	double y1;
+	double y2;
+	double y3;
+	anticausalStart(last, w1, w2, w3, y1, y2, y3);
+	data[count - 1] = static_cast<float>(y1);
+	for( int i = count - 2; i >= 0; --i ) {
+		const double y = _B * data[i] + _b1 * y1 + _b2 * y2 + _b3 * y3;
+		data[i] = static_cast<float>(y);
+		y3 = y2;
+		y2 = y1;
+		y1 = y;
+	}
+}
+
+void RecursiveGaussian::filterColumns( float* data, int width, int height, int left, int right, double* state ) const {
+	if( _identity || height <= 0 || right <= left ) {
+		return;
+	}
+
+	const int count = right - left;
+	double* w1 = state;
+	double* w2 = state + count;
+	double* w3 = state + count * 2;
+	double* last = state + count * 3;
+
+	// causal pass, top to bottom
+	const float* first = data + left;
+	const float* bottom = data + static_cast<size_t>(height - 1) * width + left;
+	for( int i = 0; i < count; ++i ) {
+		w1[i] = w2[i] = w3[i] = first[i];
+		last[i] = bottom[i];
+	}
+	for( int y = 0; y < height; ++y ) {
+		float* row = data + static_cast<size_t>(y) * width + left;
+		for( int i = 0; i < count; ++i ) {
+			const double w = _B * row[i] + _b1 * w1[i] + _b2 * w2[i] + _b3 * w3[i];
+			row[i] = static_cast<float>(w);
+			w3[i] = w;
+		}
+		// rotate the history so that w3 (now holding this row) becomes w1
+		double* tmp = w3;
+		w3 = w2;
+		w2 = w1;
+		w1 = tmp;
+	}
+
+	// anticausal pass, bottom to top
+	float* row = data + static_cast<size_t>(height - 1) * width + left;
+	for( int i = 0; i < count; ++i ) {
+		anticausalStart(last[i], w1[i], w2[i], w3[i], w1[i], w2[i], w3[i]);
+		row[i] = static_cast<float>(w1[i]);
+	}
+	for( int y = height - 2; y >= 0; --y ) {
+		row = data + static_cast<size_t>(y) * width + left;
+		for( int i = 0; i < count; ++i ) {
+			const double w = _B * row[i] + _b1 * w1[i] + _b2 * w2[i] + _b3 * w3[i];
+			row[i] = static_cast<float>(w);
+			w3[i] = w;
+		}
+		double* tmp = w3;
+		w3 = w2;
+		w2 = w1;
+		w1 = tmp;
+	}
+}
+
+void RecursiveGaussian::anticausalStart( double xn, double w1, double w2, double w3, double& y1, double& y2, double& y3 ) const {
+	// the paper works on the unnormalized filter; with unit dc gain on both passes its
+	// u+ and v+ both become xn and the correction is scaled by B
+	const double u0 = w1 - xn;
+	const double u1 = w2 - xn;
+	const double u2 = w3 - xn;
+	y1 = xn + _B * (_M[0] * u0 + _M[1] * u1 + _M[2] * u2);
+	y2 = xn + _B * (_M[3] * u0 + _M[4] * u1 + _M[5] * u2);
+	y3 = xn + _B * (_M[6] * u0 + _M[7] * u1 + _M[8] * u2);
+}
\ No newline at end of file
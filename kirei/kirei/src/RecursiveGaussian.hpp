@@ -0,0 +1,39 @@
+#ifndef __recursive_gaussian__
+#define __recursive_gaussian__
+
+// Young & van Vliet recursive approximation of a gaussian blur.
+// "Recursive implementation of the Gaussian filter", Signal Processing 44 (1995).
+// A causal and an anticausal third order IIR pass together approximate a gaussian
+// of any sigma with the same handful of multiply-adds per sample.
+class RecursiveGaussian {
+public:
+	RecursiveGaussian();
+	~RecursiveGaussian();
+
+	void setSigma( float sigma );
+	bool isIdentity() const;
+
+	// filters one contiguous line in place
+	void filterLine( float* data, int count ) const;
+
+	// filters columns [left, right) of a row-major plane in place, walking down rows so that
+	// memory is accessed a row at a time.  state must hold 4*(right-left) doubles.
+	void filterColumns( float* data, int width, int height, int left, int right, double* state ) const;
+
+private:
+	// anticausal start values y[n-1], y[n], y[n+1] for a line whose causal pass ended with w1..w3
+	// and whose last input sample was xn; see Triggs & Sdika, "Boundary conditions for
+	// Young-van Vliet recursive filtering", IEEE Trans. Signal Processing 54 (2006).
+	void anticausalStart( double xn, double w1, double w2, double w3, double& y1, double& y2, double& y3 ) const;
+
+private:
+	bool _identity;
+	// coefficients normalized by b0, in double to keep the poles stable for large sigma
+	double _B;
+	double _b1;
+	double _b2;
+	double _b3;
+	double _M[9];
+};
+
+#endif /* __recursive_gaussian__ */
\ No newline at end of file
@@ -0,0 +1,164 @@
+#include "Remap.hpp"
+#include "CpuFeatures.hpp"
+#include <cstddef>
+#include <emmintrin.h>
+
+static void bilinearScalar( const float* plane, int width, int height, float originX, float originY, const float* xs, const float* ys, int start, int count, float* dst ) {
+	const int lastX0 = (width > 1) ? width - 2 : 0;
+	const int lastY0 = (height > 1) ? height - 2 : 0;
+	for( int i = start; i < count; ++i ) {
+		const float x = xs[i] - originX;
+		const float y = ys[i] - originY;
+		const int x0 = (static_cast<int>(x) < lastX0) ? static_cast<int>(x) : lastX0;
+		const int y0 = (static_cast<int>(y) < lastY0) ? static_cast<int>(y) : lastY0;
+		const int x1 = (x0 + 1 < width) ? x0 + 1 : x0;
+		const int y1 = (y0 + 1 < height) ? y0 + 1 : y0;
+		const float fx = x - static_cast<float>(x0);
+		const float fy = y - static_cast<float>(y0);
+		const float* top = plane + static_cast<size_t>(y0) * width;
+		const float* bottom = plane + static_cast<size_t>(y1) * width;
+		const float upper = top[x0] + (top[x1] - top[x0]) * fx;
+		const float lower = bottom[x0] + (bottom[x1] - bottom[x0]) * fx;
+		dst[i] = upper + (lower - upper) * fy;
+	}
+}
+
+static void bilinearSSE( const float* plane, int width, int height, float originX, float originY, const float* xs, const float* ys, int count, float* dst ) {
+	// positions are never negative, so truncating min(x, last corner) is the clamped floor.  a
+	// plane one pixel across has no second corner and takes the scalar path.
+	int i = 0;
+	if( width > 1 && height > 1 ) {
+		const __m128 lastX0 = _mm_set1_ps(static_cast<float>(width - 2));
+		const __m128 lastY0 = _mm_set1_ps(static_cast<float>(height - 2));
+		const __m128 left = _mm_set1_ps(originX);
+		const __m128 bottom = _mm_set1_ps(originY);
+		int x0[4];
+		int y0[4];
+		for( ; i + 4 <= count; i += 4 ) {
+			const __m128 x = _mm_sub_ps(_mm_loadu_ps(xs + i), left);
+			const __m128 y = _mm_sub_ps(_mm_loadu_ps(ys + i), bottom);
+			const __m128i ix = _mm_cvttps_epi32(_mm_min_ps(x, lastX0));
+			const __m128i iy = _mm_cvttps_epi32(_mm_min_ps(y, lastY0));
+			const __m128 fx = _mm_sub_ps(x, _mm_cvtepi32_ps(ix));
+			const __m128 fy = _mm_sub_ps(y, _mm_cvtepi32_ps(iy));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(x0), ix);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(y0), iy);
+
+			const float* t0 = plane + static_cast<size_t>(y0[0]) * width + x0[0];
+			const float* t1 = plane + static_cast<size_t>(y0[1]) * width + x0[1];
+			const float* t2 = plane + static_cast<size_t>(y0[2]) * width + x0[2];
+			const float* t3 = plane + static_cast<size_t>(y0[3]) * width + x0[3];
+			const __m128 topLeft = _mm_setr_ps(t0[0], t1[0], t2[0], t3[0]);
+			const __m128 topRight = _mm_setr_ps(t0[1], t1[1], t2[1], t3[1]);
+			const __m128 bottomLeft = _mm_setr_ps(t0[width], t1[width], t2[width], t3[width]);
+			const __m128 bottomRight = _mm_setr_ps(t0[width + 1], t1[width + 1], t2[width + 1], t3[width + 1]);
+
+			const __m128 upper = _mm_add_ps(topLeft, _mm_mul_ps(_mm_sub_ps(topRight, topLeft), fx));
+			const __m128 lower = _mm_add_ps(bottomLeft, _mm_mul_ps(_mm_sub_ps(bottomRight, bottomLeft), fx));
+			_mm_storeu_ps(dst + i, _mm_add_ps(upper, _mm_mul_ps(_mm_sub_ps(lower, upper), fy)));
+		}
+	}
+	bilinearScalar(plane, width, height, originX, originY, xs, ys, i, count, dst);
+}
+
+static void radialScalar( const float* scales, int steps, float invStep, float centreX, float centreY, float invNorm, int x, int y, int start, int count,
+	const float* low, const float* high, float* xs, float* ys, float* bounds ) {
+	const float dy = static_cast<float>(y) + 0.5f - centreY;
+	const float dy2 = (dy * invNorm) * (dy * invNorm);
+	for( int i = start; i < count; ++i ) {
+		const float dx = static_cast<float>(x + i) + 0.5f - centreX;
+		const float r2 = (dx * invNorm) * (dx * invNorm) + dy2;
+		const float t = (r2 * invStep < static_cast<float>(steps)) ? r2 * invStep : static_cast<float>(steps);
+		const int entry = static_cast<int>(t);
+		const float scale = scales[entry] + (scales[entry + 1] - scales[entry]) * (t - static_cast<float>(entry));
+		const float sx = centreX + dx * scale - 0.5f;
+		const float sy = centreY + dy * scale - 0.5f;
+		// written so that a nan lands on low
+		xs[i] = (sx > low[0]) ? ((sx < high[0]) ? sx : high[0]) : low[0];
+		ys[i] = (sy > low[1]) ? ((sy < high[1]) ? sy : high[1]) : low[1];
+		bounds[0] = (xs[i] < bounds[0]) ? xs[i] : bounds[0];
+		bounds[1] = (ys[i] < bounds[1]) ? ys[i] : bounds[1];
+		bounds[2] = (xs[i] > bounds[2]) ? xs[i] : bounds[2];
+		bounds[3] = (ys[i] > bounds[3]) ? ys[i] : bounds[3];
+	}
+}
+
+static void radialSSE( const float* scales, int steps, float invStep, float centreX, float centreY, float invNorm, int x, int y, int count,
+	const float* low, const float* high, float* xs, float* ys, float* bounds ) {
+	const float dy = static_cast<float>(y) + 0.5f - centreY;
+	const float dyScalar2 = (dy * invNorm) * (dy * invNorm);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 centreXs = _mm_set1_ps(centreX);
+	const __m128 centreYs = _mm_set1_ps(centreY);
+	const __m128 norm = _mm_set1_ps(invNorm);
+	const __m128 dys = _mm_set1_ps(dy);
+	const __m128 dy2 = _mm_set1_ps(dyScalar2);
+	const __m128 entries = _mm_set1_ps(invStep);
+	const __m128 last = _mm_set1_ps(static_cast<float>(steps));
+	const __m128 lowX = _mm_set1_ps(low[0]);
+	const __m128 lowY = _mm_set1_ps(low[1]);
+	const __m128 highX = _mm_set1_ps(high[0]);
+	const __m128 highY = _mm_set1_ps(high[1]);
+	const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+	__m128 minX = _mm_set1_ps(bounds[0]);
+	__m128 minY = _mm_set1_ps(bounds[1]);
+	__m128 maxX = _mm_set1_ps(bounds[2]);
+	__m128 maxY = _mm_set1_ps(bounds[3]);
+	int entry[4];
+
+	int i = 0;
+	for( ; i + 4 <= count; i += 4 ) {
+		const __m128 px = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x + i), lanes));
+		const __m128 dx = _mm_sub_ps(_mm_add_ps(px, half), centreXs);
+		const __m128 nx = _mm_mul_ps(dx, norm);
+		const __m128 t = _mm_min_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(nx, nx), dy2), entries), last);
+		const __m128i it = _mm_cvttps_epi32(t);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(entry), it);
+		const __m128 below = _mm_setr_ps(scales[entry[0]], scales[entry[1]], scales[entry[2]], scales[entry[3]]);
+		const __m128 above = _mm_setr_ps(scales[entry[0] + 1], scales[entry[1] + 1], scales[entry[2] + 1], scales[entry[3] + 1]);
+		const __m128 scale = _mm_add_ps(below, _mm_mul_ps(_mm_sub_ps(above, below), _mm_sub_ps(t, _mm_cvtepi32_ps(it))));
+
+		// max takes its second operand when the first is nan
+		const __m128 sx = _mm_sub_ps(_mm_add_ps(centreXs, _mm_mul_ps(dx, scale)), half);
+		const __m128 sy = _mm_sub_ps(_mm_add_ps(centreYs, _mm_mul_ps(dys, scale)), half);
+		const __m128 cx = _mm_min_ps(_mm_max_ps(sx, lowX), highX);
+		const __m128 cy = _mm_min_ps(_mm_max_ps(sy, lowY), highY);
+		_mm_storeu_ps(xs + i, cx);
+		_mm_storeu_ps(ys + i, cy);
+		minX = _mm_min_ps(minX, cx);
+		minY = _mm_min_ps(minY, cy);
+		maxX = _mm_max_ps(maxX, cx);
+		maxY = _mm_max_ps(maxY, cy);
+	}
+
+	float lows[8];
+	float highs[8];
+	_mm_storeu_ps(lows, minX);
+	_mm_storeu_ps(lows + 4, minY);
+	_mm_storeu_ps(highs, maxX);
+	_mm_storeu_ps(highs + 4, maxY);
+	for( int k = 0; k < 4; ++k ) {
+		bounds[0] = (lows[k] < bounds[0]) ? lows[k] : bounds[0];
+		bounds[1] = (lows[k + 4] < bounds[1]) ? lows[k + 4] : bounds[1];
+		bounds[2] = (highs[k] > bounds[2]) ? highs[k] : bounds[2];
+		bounds[3] = (highs[k + 4] > bounds[3]) ? highs[k + 4] : bounds[3];
+	}
+	radialScalar(scales, steps, invStep, centreX, centreY, invNorm, x, y, i, count, low, high, xs, ys, bounds);
+}
+
+void Remap::bilinear( const float* plane, int width, int height, float originX, float originY, const float* xs, const float* ys, int count, float* dst ) {
+	if( CpuFeatures::hasSSE2() ) {
+		bilinearSSE(plane, width, height, originX, originY, xs, ys, count, dst);
+	} else {
+		bilinearScalar(plane, width, height, originX, originY, xs, ys, 0, count, dst);
+	}
+}
+
+void Remap::radial( const float* scales, int steps, float invStep, float centreX, float centreY, float invNorm, int x, int y, int count,
+	const float* low, const float* high, float* xs, float* ys, float* bounds ) {
+	if( CpuFeatures::hasSSE2() ) {
+		radialSSE(scales, steps, invStep, centreX, centreY, invNorm, x, y, count, low, high, xs, ys, bounds);
+	} else {
+		radialScalar(scales, steps, invStep, centreX, centreY, invNorm, x, y, 0, count, low, high, xs, ys, bounds);
+	}
+}
\ No newline at end of file
@@ -0,0 +1,27 @@
+#ifndef __remap__
+#define __remap__
+
+// remapping a plane: where each pixel reads from, and bilinear reads of a plane at those
+// positions, as an stmap does.  the sse2 paths work on four pixels at a time, loading table
+// entries and corners one by one (sse2 has no gather), with the same operations in the same
+// order as the scalar paths, so both give identical bits.
+class Remap {
+public:
+	// dst[i] is the plane read at (xs[i] - originX, ys[i] - originY).  plane is row-major
+	// width*height, and the positions must already lie within it, at most width-1 and height-1
+	// past the origin.
+	static void bilinear( const float* plane, int width, int height, float originX, float originY, const float* xs, const float* ys, int count, float* dst );
+
+	// the positions of a radial remap along row y: for pixel x + i, xs[i] and ys[i] are the centre
+	// plus the offset of the pixel's centre from it, scaled by scales[] interpolated at the
+	// squared, normalised radius times invStep (at most steps, the table having steps+2 entries).
+	// they are clamped to [low, high] per axis, a nan landing on low, and bounds (min x, min y,
+	// max x, max y) is widened to cover them.
+	static void radial( const float* scales, int steps, float invStep, float centreX, float centreY, float invNorm, int x, int y, int count,
+		const float* low, const float* high, float* xs, float* ys, float* bounds );
+
+private:
+	Remap();
+};
+
+#endif /* __remap__ */
\ No newline at end of file
@@ -1,7 +1,18 @@
 #include "Kirei.hpp"
+#include "PointKernels.hpp"
+#include "RankFilter.hpp"
+#include "Fft.hpp"
+#include "Grain.hpp"
+#include "Remap.hpp"
 #include <DDImage/Knobs.h>
 #include <DDImage/Row.h>
-#include <DDImage/Tile.h>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <climits>
+#include <iostream>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 static const char* CLASS = "Kirei";
 static const char* HELP = "Kirei da yo ne.";
@@ -18,6 +29,15 @@ static const char* FILTER_TYPES[] = {
 	"Temperature",
 	"Channel Mixer",
 	"Playground",
+	"Gaussian Blur",
+	"Convolve",
+	"Stack",
+	"Median",
+	"Erode",
+	"Dilate",
+	"Lens Blur",
+	"Grain",
+	"Lens Distortion",
 	0
 };
 
@@ -33,10 +53,74 @@ struct FilterTypes {
 		EdgeEnhance,
 		Temperature,
 		ChannelMixer,
-		Playground
+		Playground,
+		GaussianBlur,
+		Convolve,
+		Stack,
+		Median,
+		Erode,
+		Dilate,
+		LensBlur,
+		Grain,
+		LensDistortion
 	};
 };
 
+static const char* LUT_MODES[] = {
+	"Off",
+	"Bake",
+	"Import",
+	0
+};
+
+struct LutModes {
+	enum Type {
+		Off=0,
+		Bake,
+		Import
+	};
+};
+
+static const char* LENS_SHAPES[] = {
+	"Disc",
+	"Hexagon",
+	"Kernel Input",
+	0
+};
+
+struct LensShapes {
+	enum Type {
+		Disc=0,
+		Hexagon,
+		KernelInput
+	};
+};
+
+static const char* BALANCE_MODES[] = {
+	"Kelvin",
+	"Gray World",
+	"White Patch",
+	0
+};
+
+struct BalanceModes {
+	enum Type {
+		Kelvin=0,
+		GrayWorld,
+		WhitePatch
+	};
+};
+
+static const char* LUT_SIZES[] = {
+	"33",
+	"65",
+	0
+};
+static const int LUT_SIZE_VALUES[] = { 33, 65 };
+
+// rgb of a black body from 1000K to 10000K in 100K steps
+static const float BLACK_BODY_RGB[] = { 1.0f, 0.0337f, 0.0f, 1.0f, 0.0592f, 0.0f, 1.0f, 0.0846f, 0.0f, 1.0f, 0.1096f, 0.0f, 1.0f, 0.1341f, 0.0f, 1.0f, 0.1578f, 0.0f, 1.0f, 0.1806f, 0.0f, 1.0f, 0.2025f, 0.0f, 1.0f, 0.2235f, 0.0f, 1.0f, 0.2434f, 0.0f, 1.0f, 0.2647f, 0.0033f, 1.0f, 0.2889f, 0.012f, 1.0f, 0.3126f, 0.0219f, 1.0f, 0.336f, 0.0331f, 1.0f, 0.3589f, 0.0454f, 1.0f, 0.3814f, 0.0588f, 1.0f, 0.4034f, 0.0734f, 1.0f, 0.425f, 0.0889f, 1.0f, 0.4461f, 0.1054f, 1.0f, 0.4668f, 0.1229f, 1.0f, 0.487f, 0.1411f, 1.0f, 0.5067f, 0.1602f, 1.0f, 0.5259f, 0.18f, 1.0f, 0.5447f, 0.2005f, 1.0f, 0.563f, 0.2216f, 1.0f, 0.5809f, 0.2433f, 1.0f, 0.5983f, 0.2655f, 1.0f, 0.6153f, 0.2881f, 1.0f, 0.6318f, 0.3112f, 1.0f, 0.648f, 0.3346f, 1.0f, 0.6636f, 0.3583f, 1.0f, 0.6789f, 0.3823f, 1.0f, 0.6938f, 0.4066f, 1.0f, 0.7083f, 0.431f, 1.0f, 0.7223f, 0.4556f, 1.0f, 0.736f, 0.4803f, 1.0f, 0.7494f, 0.5051f, 1.0f, 0.7623f, 0.5299f, 1.0f, 0.775f, 0.5548f, 1.0f, 0.7872f, 0.5797f, 1.0f, 0.7992f, 0.6045f, 1.0f, 0.8108f, 0.6293f, 1.0f, 0.8221f, 0.6541f, 1.0f, 0.833f, 0.6787f, 1.0f, 0.8437f, 0.7032f, 1.0f, 0.8541f, 0.7277f, 1.0f, 0.8642f, 0.7519f, 1.0f, 0.874f, 0.776f, 1.0f, 0.8836f, 0.8f, 1.0f, 0.8929f, 0.8238f, 1.0f, 0.9019f, 0.8473f, 1.0f, 0.9107f, 0.8707f, 1.0f, 0.9193f, 0.8939f, 1.0f, 0.9276f, 0.9168f, 1.0f, 0.9357f, 0.9396f, 1.0f, 0.9436f, 0.9621f, 1.0f, 0.9513f, 0.9844f, 0.9937f, 0.9526f, 1.0f, 0.9726f, 0.9395f, 1.0f, 0.9526f, 0.927f, 1.0f, 0.9337f, 0.915f, 1.0f, 0.9157f, 0.9035f, 1.0f, 0.8986f, 0.8925f, 1.0f, 0.8823f, 0.8819f, 1.0f, 0.8668f, 0.8718f, 1.0f, 0.852f, 0.8621f, 1.0f, 0.8379f, 0.8527f, 1.0f, 0.8244f, 0.8437f, 1.0f, 0.8115f, 0.8351f, 1.0f, 0.7992f, 0.8268f, 1.0f, 0.7874f, 0.8187f, 1.0f, 0.7761f, 0.811f, 1.0f, 0.7652f, 0.8035f, 1.0f, 0.7548f, 0.7963f, 1.0f, 0.7449f, 0.7894f, 1.0f, 0.7353f, 0.7827f, 1.0f, 0.726f, 0.7762f, 1.0f, 0.7172f, 0.7699f, 1.0f, 0.7086f, 0.7638f, 1.0f, 0.7004f, 0.7579f, 1.0f, 0.6925f, 0.7522f, 1.0f, 0.6848f, 0.7467f, 1.0f, 0.6774f, 0.7414f, 1.0f, 0.6703f, 0.7362f, 1.0f, 0.6635f, 0.7311f, 1.0f, 0.6568f, 0.7263f, 1.0f, 0.6504f, 0.7215f, 1.0f, 0.6442f, 0.7169f, 1.0f, 0.6382f, 0.7124f, 1.0f, 0.6324f, 0.7081f, 1.0f, 0.6268f, 0.7039f, 1.0f };
+
 namespace ccmath {
 	template<typename T>
 	inline T minimum( T a, T b ) {
@@ -78,6 +162,16 @@ namespace ccmath {
 	}
 }
 
+// modification time of a file, or false if it cannot be read
+static bool fileTime( const char* path, long long& time ) {
+	struct stat info;
+	if( nullptr == path || 0 != stat(path, &info) ) {
+		return false;
+	}
+	time = static_cast<long long>(info.st_mtime);
+	return true;
+}
+
 static DD::Image::Iop* build( Node* node ) {
 	return new Kirei(node);
 }
@@ -86,22 +180,60 @@ const DD::Image::Iop::Description Kirei::description(CLASS, "KasumiL5x/Kirei", b
 
 Kirei::Kirei( Node* node )
 	: PixelIop(node) {
-	_inputWidth = 1;
-	_inputHeight = 1;
 	_filterType = 0;
+	_engine = &Kirei::pointFilter<CopyKernel>;
+
+	_tiled = false;
+	_identity = false;
+	for( int i = 0; i < STACK_SIZE; ++i ) {
+		_stack[i] = FilterTypes::Passthrough;
+	}
+	_spatialType = FilterTypes::Passthrough;
+
+	_lutMode = LutModes::Off;
+	_lutSize = 0;
+	_lutDomainMin = 0.0f;
+	_lutDomainMax = 1.0f;
+	_lutFile = "";
+	_lutExportFile = "";
+	_lutImportedTime = 0;
 
 	_vignetteRadius = 0.75f;
 	_vignetteSoftness = 0.45f;
 
 	_thresholdLuminanceLimit = 0.5f;
+	_thresholdAuto = false;
 
 	_blurSize = 4;
 
+	_gaussianSigma = 4.0f;
+	_planeRequested = false;
+	_tilesClock = 0;
+
+	_rankRadius = 1;
+
+	_lensShape = LensShapes::Disc;
+	_lensSize = 20.0f;
+	_lensSpectrum.radius = 0;
+	_lensSpectrum.size = 0;
+
+	_distortion = 0.05f;
+	_distortionOuter = 0.0f;
+	_aberration = 0.002f;
+	_distortionTable.invStep = 0.0f;
+	_distortionTable.pad = 0;
+
+	_convolveKernel = "0 0 0\n0 1 0\n0 0 0";
+
 	_sharpenStrength = 1.0f;
 
 	_edgeEnhanceStrength = 1.0f;
 
 	_temperature = 6650.0f;
+	_balanceMode = BalanceModes::Kelvin;
+
+	_statsNeeded = false;
+	_statsOldest = 0;
 
 	_channelMixerBlueGreen = 0.0f;
 	_channelMixerBGIntoRed = 0.0f;
@@ -109,9 +241,37 @@ Kirei::Kirei( Node* node )
 	_channelMixerRBIntoGreen = 0.0f;
 	_channelMixerGreenRed = 0.0f;
 	_channelMixerGRIntoBlue = 0.0f;
+
+	_grainAmount = 0.05f;
+	_grainSize = 0;
+	_grainResponse = 0.5f;
+	_grainSeed = 0;
+
+	snapshotParams(_params);
+	_params.frame = 0;
+	_params.formatX = 0;
+	_params.formatY = 0;
+	_params.formatWidth = 1;
+	_params.formatHeight = 1;
 }
 
 Kirei::~Kirei() {
+	for( size_t i = 0; i < _blurStates.size(); ++i ) {
+		delete _blurStates[i];
+	}
+	_blurStates.clear();
+	for( size_t i = 0; i < _convolveStates.size(); ++i ) {
+		delete _convolveStates[i];
+	}
+	_convolveStates.clear();
+	for( size_t i = 0; i < _grainStates.size(); ++i ) {
+		delete _grainStates[i];
+	}
+	_grainStates.clear();
+	for( size_t i = 0; i < _tileWorks.size(); ++i ) {
+		delete _tileWorks[i];
+	}
+	_tileWorks.clear();
 }
 
 int Kirei::minimum_inputs() const {
@@ -119,10 +279,19 @@ int Kirei::minimum_inputs() const {
 }
 
 int Kirei::maximum_inputs() const {
-	return 1;
+	return 2;
+}
+
+const char* Kirei::input_label( int input, char* buffer ) const {
+	return (1 == input) ? "kernel" : nullptr;
 }
 
 void Kirei::in_channels( int input, DD::Image::ChannelSet& channels ) const {
+	// a transparent node passes the request on as it is
+	if( _identity ) {
+		return;
+	}
+
 	// turn on other color channels if any are requested
 	DD::Image::ChannelSet done;
 	foreach(z, channels) {
@@ -139,37 +308,162 @@ void Kirei::in_channels( int input, DD::Image::ChannelSet& channels ) const {
 }
 
 void Kirei::_validate( bool for_real ) {
-	const DD::Image::Box& inputBox = input0().requestedBox();
-	_inputWidth = inputBox.w();
-	_inputHeight = inputBox.h();
-	printf("requested box {x:%d; y:%d; w:%d; h:%d}\n", inputBox.x(), inputBox.y(), _inputWidth, _inputHeight);
+	snapshotParams(_params);
+	input0().validate(for_real);
+	const DD::Image::Format& format = input0().format();
+	_params.formatX = format.x();
+	_params.formatY = format.y();
+	_params.formatWidth = ccmath::maximum<int>(1, format.w());
+	_params.formatHeight = ccmath::maximum<int>(1, format.h());
+	_params.frame = static_cast<int>(floor(outputContext().frame()));
+
+	// the lens kernel image has to be known before the padding can be worked out
+	if( usesLensInput() ) {
+		input1().validate(for_real);
+	}
+
+	// knobs or inputs may have changed, so any running blur sums and cached rows are stale
+	resetBlurStates();
+	resetConvolveStates();
+	resetGrainStates();
+
+	// work out which neighbourhood filter runs and fold the stack's point ops.  with a lut, a
+	// single point filter is run as a one-slot stack so that it can be baked too.
+	_stackSteps.clear();
+	_spatialType = isSpatial(_params.filterType) ? _params.filterType : static_cast<int>(FilterTypes::Passthrough);
+	if( FilterTypes::Stack == _params.filterType ) {
+		buildStack(_params.stack, STACK_SIZE, _stackSteps, _spatialType);
+	} else if( LutModes::Off != _lutMode && !isSpatial(_params.filterType) ) {
+		buildStack(&_params.filterType, 1, _stackSteps, _spatialType);
+	}
+	applyLutMode(_stackSteps);
+
+	// sigma may have changed; the cached frame itself is keyed on the hash
+	_gaussian.setSigma(_params.gaussianSigma);
+
+	// kernels are built once here rather than on every row
+	updateConvolution();
+	updateDistortion();
+
+	// settings that change nothing make the node transparent: no channels are written, so the
+	// input rows are forwarded without pixel_engine running or any padding being requested
+	_identity = isIdentity();
+	if( _identity ) {
+		_spatialType = FilterTypes::Passthrough;
+	}
+	set_out_channels(_identity ? DD::Image::Mask_None : DD::Image::Mask_All);
+
+	// the statistics are looked up (or reduced) in _open, as the input hash may be new
+	_statsNeeded = !_identity && usesFrameStats();
 
-	set_out_channels(DD::Image::Mask_All);
+	{
+		DD::Image::Guard guard(_planeLock);
+		_planeRequested = false;
+		_planeChannels = DD::Image::Mask_None;
+		if( FilterTypes::GaussianBlur != _spatialType ) {
+			_planeFrame.reset();
+		}
+	}
+	if( !isTiled() ) {
+		resetTiles();
+	}
 
-	if( FilterTypes::Blur == _filterType ) {
-		info_.pad(_blurSize);
-	} else if( FilterTypes::Sharpen == _filterType ) {
-		info_.pad(1);
-	} else if( FilterTypes::EdgeEnhance == _filterType ) {
-		info_.pad(1);
+	// distortion moves pixels within the frame rather than spreading them past its edges
+	if( FilterTypes::Passthrough != _spatialType && FilterTypes::LensDistortion != _spatialType ) {
+		info_.pad(spatialPad());
 	}
 
+	_engine = selectEngine();
+
 	PixelIop::_validate(for_real);
 }
 
 void Kirei::_request( int x, int y, int r, int t, DD::Image::ChannelMask channels, int count ) {
-	if( FilterTypes::Blur == _filterType ) {
-		input(0)->request(x-_blurSize, y-_blurSize, r+_blurSize, t+_blurSize, channels, count);
-	} else if( FilterTypes::Sharpen == _filterType ) {
-		input(0)->request(x-1, y-1, r+1, t+1, channels, count);
-	} else if( FilterTypes::EdgeEnhance == _filterType ) {
-		input(0)->request(x-1, y-1, r+1, t+1, channels, count);
+	if( FilterTypes::Passthrough != _spatialType ) {
+		const int pad = spatialPad();
+		input(0)->request(x-pad, y-pad, r+pad, t+pad, channels, count);
+
+		// remember the padded area and colour planes so the shared frame _open builds covers every
+		// row that may be asked for.  engine threads of an earlier request may still be reading it.
+		if( FilterTypes::GaussianBlur == _spatialType ) {
+			DD::Image::Guard guard(_planeLock);
+			DD::Image::Box padded(x-pad, y-pad, r+pad, t+pad);
+			if( _planeRequested ) {
+				padded.merge(_planeRequest);
+			}
+			_planeRequest = padded;
+			_planeRequested = true;
+			foreach(z, channels) {
+				if( DD::Image::colourIndex(z) < 3 ) {
+					_planeChannels.addBrothers(z, 3);
+				}
+			}
+		}
+	}
+	if( _statsNeeded ) {
+		const DD::Image::Box& bbox = input0().info();
+		input0().request(bbox.x(), bbox.y(), bbox.r(), bbox.t(), DD::Image::Mask_RGB, count);
+	}
+	if( usesLensInput() ) {
+		const DD::Image::Box& kernelBox = input1().info();
+		input1().request(kernelBox.x(), kernelBox.y(), kernelBox.r(), kernelBox.t(), DD::Image::Mask_RGB, 1);
 	}
 	PixelIop::_request(x, y, r, t, channels, count);
 }
 
+void Kirei::_open() {
+	// the lens kernel reads the kernel input, so its spectrum is built here, once and before any
+	// engine thread starts, rather than by the first tile.  the same goes for the statistics and
+	// the gaussian's shared frame.
+	if( FilterTypes::LensBlur == _spatialType ) {
+		updateLensSpectrum();
+	}
+	if( FilterTypes::GaussianBlur == _spatialType && !_gaussian.isIdentity() ) {
+		updatePlaneFrame();
+	}
+	if( _statsNeeded ) {
+		updateFrameStats();
+	}
+	PixelIop::_open();
+}
+
 void Kirei::knobs( DD::Image::Knob_Callback f ) {
 	DD::Image::Enumeration_knob(f, &_filterType, FILTER_TYPES, "filter_type", "Filter Type");
+	DD::Image::Bool_knob(f, &_tiled, "tiled", "Tiled");
+	DD::Image::Tooltip(f, "Blur, sharpen, edge enhance, playground and convolve process cache-sized tiles instead of one row at a time.  "
+		"The first row to need a tile fetches its padded piece of the input and filters it, and the rows after it read the "
+		"finished tile, so memory stays at a couple of rows of tiles whatever the image size.  Point filters are not affected, "
+		"and median, erode, dilate, lens blur and lens distortion always work this way.");
+
+	DD::Image::BeginGroup(f, "Stack");
+		for( int i = 0; i < STACK_SIZE; ++i ) {
+			static const char* STACK_NAMES[STACK_SIZE] = { "stack_1", "stack_2", "stack_3", "stack_4", "stack_5", "stack_6" };
+			static const char* STACK_LABELS[STACK_SIZE] = { "1", "2", "3", "4", "5", "6" };
+			DD::Image::Enumeration_knob(f, &_stack[i], FILTER_TYPES, STACK_NAMES[i], STACK_LABELS[i]);
+		}
+		DD::Image::Tooltip(f, "Filters run in order in one pass when Filter Type is Stack; Passthrough leaves a slot empty.  "
+			"Point filters must come before the single neighbourhood filter allowed at the end.  "
+			"Adjacent sepia, channel mixer, temperature and invert filters are folded into one colour matrix.  "
+			"A folded run ends at each sepia or channel mixer, whose clamp is applied right after it as it would be on its own, "
+			"so the result matches running the filters one by one.  Each filter uses its own settings below.");
+	DD::Image::EndGroup(f);
+
+	DD::Image::BeginGroup(f, "LUT");
+		DD::Image::Enumeration_knob(f, &_lutMode, LUT_MODES, "lut_mode", "Mode");
+		DD::Image::Tooltip(f, "Bake: the colour filters (everything but vignette, grain and the neighbourhood filters) are sampled into "
+			"a 3D LUT when the settings change and looked up with tetrahedral interpolation.  "
+			"Import: a .cube file replaces the colour filters.  Inputs outside the domain are clamped to it, "
+			"and the hard edge of threshold becomes a ramp one lattice cell wide.");
+		DD::Image::Enumeration_knob(f, &_lutSize, LUT_SIZES, "lut_size", "Size");
+		DD::Image::Float_knob(f, &_lutDomainMin, "lut_domain_min", "Domain");
+		DD::Image::ClearFlags(f, DD::Image::Knob::ENDLINE); DD::Image::SetFlags(f, DD::Image::Knob::HIDE_ANIMATION_AND_VIEWS);
+		DD::Image::Float_knob(f, &_lutDomainMax, "lut_domain_max", "to");
+		DD::Image::ClearFlags(f, DD::Image::Knob::STARTLINE); DD::Image::SetFlags(f, DD::Image::Knob::HIDE_ANIMATION_AND_VIEWS);
+		DD::Image::File_knob(f, &_lutFile, "lut_file", "Import .cube");
+		DD::Image::File_knob(f, &_lutExportFile, "lut_export_file", "Export .cube");
+		DD::Image::Button(f, "lut_export", "Export");
+		DD::Image::Tooltip(f, "Writes the current colour filters, baked at the chosen size and domain, to the export file.");
+	DD::Image::EndGroup(f);
 
 	DD::Image::BeginGroup(f, "vignette");
 		DD::Image::Float_knob(f, &_vignetteRadius, "radius");
@@ -178,12 +472,43 @@ void Kirei::knobs( DD::Image::Knob_Callback f ) {
 
 	DD::Image::BeginGroup(f, "threshold");
 		DD::Image::Float_knob(f, &_thresholdLuminanceLimit, "luminance_limit", "Luminance Limit");
+		DD::Image::Bool_knob(f, &_thresholdAuto, "luminance_auto", "Automatic");
+		DD::Image::Tooltip(f, "Use Otsu's threshold of the frame's luminance histogram (over 0 to 1) instead of the limit above.");
 	DD::Image::EndGroup(f);
 
 	DD::Image::BeginGroup(f, "Blur");
 		DD::Image::Int_knob(f, &_blurSize, "blur_size", "Size");
 	DD::Image::EndGroup(f);
 
+	DD::Image::BeginGroup(f, "Gaussian Blur");
+		DD::Image::Float_knob(f, &_gaussianSigma, DD::Image::IRange(0.5f, 500.0f), "gaussian_sigma", "Sigma");
+		DD::Image::Tooltip(f, "Standard deviation of the gaussian in pixels.  The cost does not depend on the size.");
+	DD::Image::EndGroup(f);
+
+	DD::Image::BeginGroup(f, "Median / Erode / Dilate");
+		DD::Image::Int_knob(f, &_rankRadius, "rank_radius", "Radius");
+		DD::Image::Tooltip(f, "Half the width of the square window.  Median despeckles, erode chokes and dilate spreads; "
+			"the cost does not depend on the radius.  The median is exact to 1/4095 of the input's range.");
+	DD::Image::EndGroup(f);
+
+	DD::Image::BeginGroup(f, "Lens Blur");
+		DD::Image::Enumeration_knob(f, &_lensShape, LENS_SHAPES, "lens_shape", "Shape");
+		DD::Image::Tooltip(f, "Disc and hexagon are drawn at the given size.  Kernel Input uses the luminance of the image "
+			"in the kernel input, centred on its bbox and scaled to sum to one.");
+		DD::Image::Float_knob(f, &_lensSize, DD::Image::IRange(1.0f, 200.0f), "lens_size", "Size");
+		DD::Image::Tooltip(f, "Diameter of the disc or hexagon in pixels.  The blur is done with ffts, so large sizes stay affordable.");
+	DD::Image::EndGroup(f);
+
+	DD::Image::BeginGroup(f, "Lens Distortion");
+		DD::Image::Float_knob(f, &_distortion, DD::Image::IRange(-0.5f, 0.5f), "distortion", "Distortion");
+		DD::Image::Tooltip(f, "Radial distortion, with the radius 1 at the left and right edges of the format.  "
+			"Positive values pull the image in towards the centre (barrel), negative values push it out (pincushion).");
+		DD::Image::Float_knob(f, &_distortionOuter, DD::Image::IRange(-0.5f, 0.5f), "distortion_outer", "Outer");
+		DD::Image::Tooltip(f, "Distortion that grows with the fourth power of the radius, for the edges and corners.");
+		DD::Image::Float_knob(f, &_aberration, DD::Image::IRange(-0.02f, 0.02f), "aberration", "Aberration");
+		DD::Image::Tooltip(f, "Lateral chromatic aberration: red is scaled by one plus this and blue by one minus it, around the centre.");
+	DD::Image::EndGroup(f);
+
 	DD::Image::BeginGroup(f, "Sharpen");
 		DD::Image::Float_knob(f, &_sharpenStrength, "sharpen_strength", "Strength");
 	DD::Image::EndGroup(f);
@@ -193,6 +518,10 @@ void Kirei::knobs( DD::Image::Knob_Callback f ) {
 	DD::Image::EndGroup(f);
 
 	DD::Image::BeginGroup(f, "Temperature");
+		DD::Image::Enumeration_knob(f, &_balanceMode, BALANCE_MODES, "temperature_mode", "Mode");
+		DD::Image::Tooltip(f, "Kelvin: the colour of a black body at the temperature below.  "
+			"Gray World: gains that make the frame's red, green and blue averages equal.  "
+			"White Patch: gains that make the brightest red, green and blue values equal.");
 		DD::Image::Float_knob(f, &_temperature, DD::Image::IRange(1000.0f, 10000.0f), "temperature", "Cool/Heat");
 	DD::Image::EndGroup(f);
 
@@ -212,105 +541,326 @@ void Kirei::knobs( DD::Image::Knob_Callback f ) {
 		DD::Image::Float_knob(f, &_channelMixerGRIntoBlue, "channel_mixer_into_b", "into B");
 		DD::Image::ClearFlags(f, DD::Image::Knob::STARTLINE); DD::Image::SetFlags(f, DD::Image::Knob::HIDE_ANIMATION_AND_VIEWS);
 	DD::Image::EndGroup(f);
+
+	DD::Image::BeginGroup(f, "Grain");
+		DD::Image::Float_knob(f, &_grainAmount, DD::Image::IRange(0.0f, 0.25f), "grain_amount", "Amount");
+		DD::Image::Tooltip(f, "Standard deviation of the grain added to each channel.  The grain is the same for a given frame, "
+			"position and seed on every machine and thread.");
+		DD::Image::Int_knob(f, &_grainSize, "grain_size", "Size");
+		DD::Image::Tooltip(f, "Radius of a box blur over the noise; 0 is grain one pixel across.  The strength stays the same.");
+		DD::Image::Float_knob(f, &_grainResponse, "grain_response", "Midtones");
+		DD::Image::Tooltip(f, "How much the grain is kept to the midtones: 0 is even everywhere, 1 fades it out towards black and white.");
+		DD::Image::Int_knob(f, &_grainSeed, "grain_seed", "Seed");
+	DD::Image::EndGroup(f);
+
+	DD::Image::BeginGroup(f, "Convolve");
+		DD::Image::Multiline_String_knob(f, &_convolveKernel, "convolve_kernel", "Kernel", 7);
+		DD::Image::Tooltip(f, "Square kernel of any odd size (3x3, 5x5, 7x7, ...), one row per line with the top row first.  "
+			"Separable kernels are detected and run as two 1D passes.");
+	DD::Image::EndGroup(f);
+}
+
+int Kirei::knob_changed( DD::Image::Knob* k ) {
+	if( k->is("lut_export") ) {
+		// the export is built from the snapshot, which has to be brought up to date first
+		validate(false);
+		exportLut();
+		return 1;
+	}
+	return PixelIop::knob_changed(k);
+}
+
+void Kirei::append( DD::Image::Hash& hash ) {
+	// an imported lut may be rewritten under the same name
+	long long time = 0;
+	if( LutModes::Import == _lutMode && fileTime(_lutFile, time) ) {
+		hash.append(time);
+	}
+
+	// the grain is keyed on the frame, so a still input must not hand the next frame this one's rows
+	if( usesFrame() ) {
+		hash.append(outputContext().frame());
+	}
 }
 
 void Kirei::pixel_engine( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	switch( _filterType ) {
-		case FilterTypes::Passthrough: {
-			passthrough(in, y, x, r, channels, out);
-			break;
-		}
+	(this->*_engine)(in, y, x, r, channels, out);
+}
 
-		case FilterTypes::Vignette: {
-			vignette(in, y, x, r, channels, out);
-			break;
+// a kernel is built from the op for each row and then run over spans of three planes, where
+// in and out (which may be the same) point at pixel x and are count pixels long.
+// per-pixel kernels derive from PixelKernel and only provide pixel().
+template<class Derived>
+struct Kirei::PixelKernel {
+	void operator()( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int x, int count ) const {
+		const Derived& kernel = static_cast<const Derived&>(*this);
+		for( int i = 0; i < count; ++i ) {
+			float red = rIn[i];
+			float green = gIn[i];
+			float blue = bIn[i];
+			kernel.pixel(red, green, blue, x + i);
+			rOut[i] = red;
+			gOut[i] = green;
+			bOut[i] = blue;
 		}
+	}
+};
 
-		case FilterTypes::Invert: {
-			invert(in, y, x, r, channels, out);
-			break;
+struct Kirei::CopyKernel {
+	CopyKernel( const Kirei&, int ) {
+	}
+	void operator()( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int, int count ) const {
+		PointKernels::copy(rIn, gIn, bIn, rOut, gOut, bOut, count);
+	}
+};
+
+// the falloff only depends on the distance from the format's centre, so along a row it is
+// constant (untouched or halved) everywhere but two ramps either side of the centre.  the ramps
+// are found once per row and only their pixels work out a distance, with y^2 hoisted.
+struct Kirei::VignetteKernel {
+	float left;
+	float width;
+	float v2;
+	float radius;
+	float softness;
+	float inner; // weight closer in than the ramps, and further out
+	float outer;
+	int outerLeft; // [outerLeft, innerLeft) and [innerRight, outerRight) are the ramps
+	int innerLeft;
+	int innerRight;
+	int outerRight;
+
+	VignetteKernel( const Kirei& kirei, int y )
+		: left(static_cast<float>(kirei._params.formatX)), width(static_cast<float>(kirei._params.formatWidth)),
+		  radius(kirei._params.vignetteRadius), softness(kirei._params.vignetteSoftness) {
+		const float v = (static_cast<float>(y) - static_cast<float>(kirei._params.formatY)) / static_cast<float>(kirei._params.formatHeight) - 0.5f;
+		v2 = v * v;
+		inner = ccmath::smoothstep<float>(radius, radius - softness, -FLT_MAX);
+		outer = ccmath::smoothstep<float>(radius, radius - softness, FLT_MAX);
+
+		// the edges in pixels, from the ramp's distances.  rounding may put them a pixel out, so
+		// they are then moved until the pixels either side of them agree with the constants; if
+		// that does not settle quickly the whole row is treated as ramp.
+		const double low = ccmath::minimum<float>(radius, radius - softness);
+		const double high = ccmath::maximum<float>(radius, radius - softness);
+		const double centre = left + 0.5 * width;
+		const double innerReach = (low > 0.0 && low * low > v2) ? sqrt(low * low - v2) * width : -1.0;
+		const double outerReach = (high > 0.0 && high * high > v2) ? sqrt(high * high - v2) * width : 0.0;
+		const double limit = INT_MAX / 4;
+		innerLeft = static_cast<int>(ccmath::clamp<double>(ceil(centre - innerReach), -limit, limit));
+		innerRight = ccmath::maximum<int>(innerLeft, static_cast<int>(ccmath::clamp<double>(floor(centre + innerReach), -limit, limit)) + 1);
+		outerLeft = ccmath::minimum<int>(innerLeft, static_cast<int>(ccmath::clamp<double>(floor(centre - outerReach), -limit, limit)));
+		outerRight = ccmath::maximum<int>(innerRight, static_cast<int>(ccmath::clamp<double>(ceil(centre + outerReach), -limit, limit)) + 1);
+		int steps = 0;
+		for( ; steps < 64 && innerLeft < innerRight && weight(innerLeft) != inner; ++steps ) {
+			++innerLeft;
+		}
+		for( ; steps < 64 && innerLeft < innerRight && weight(innerRight - 1) != inner; ++steps ) {
+			--innerRight;
 		}
+		for( ; steps < 64 && weight(outerLeft - 1) != outer; ++steps ) {
+			--outerLeft;
+		}
+		for( ; steps < 64 && weight(outerRight) != outer; ++steps ) {
+			++outerRight;
+		}
+		if( steps >= 64 ) {
+			outerLeft = -static_cast<int>(limit);
+			innerLeft = innerRight = 0;
+			outerRight = static_cast<int>(limit);
+		}
+	}
+	float weight( int x ) const {
+		const float u = (static_cast<float>(x) - left) / width - 0.5f;
+		return ccmath::smoothstep<float>(radius, radius - softness, sqrtf(u * u + v2));
+	}
+	void operator()( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int x, int count ) const {
+		const int edges[5] = { outerLeft, innerLeft, innerRight, outerRight, INT_MAX };
+		const float constants[5] = { outer, 0.0f, inner, 0.0f, outer };
+		const int end = x + count;
+		int start = x;
+		for( int span = 0; span < 5 && start < end; ++span ) {
+			const int stop = ccmath::minimum<int>(end, edges[span]);
+			if( stop <= start ) {
+				continue;
+			}
+			const int i = start - x;
+			const int n = stop - start;
+			if( 1 == (span & 1) ) {
+				PointKernels::vignette(rIn + i, gIn + i, bIn + i, rOut + i, gOut + i, bOut + i, n, start, left, width, v2, radius, softness);
+			} else {
+				// lerp(c, c * w, 0.5) for a weight of exactly 0 or 1
+				const float gain = (1.0f == constants[span]) ? 1.0f : 0.5f;
+				PointKernels::gain(rIn + i, gIn + i, bIn + i, rOut + i, gOut + i, bOut + i, n, gain, gain, gain);
+			}
+			start = stop;
+		}
+	}
+};
 
-		case FilterTypes::Threshold: {
-			threshold(in, y, x, r, channels, out);
-			break;
+// the amount is scaled by how close to the midtones the pixel is, 4l(1 - l) for luminance l.
+// the noise is made once per row and span, and reused for every layer of the row.
+struct Kirei::GrainKernel {
+	const Kirei& kirei;
+	int y;
+
+	GrainKernel( const Kirei& kirei, int y )
+		: kirei(kirei), y(y) {
+	}
+	void operator()( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int x, int count ) const {
+		const Params& params = kirei._params;
+		GrainState* state = kirei.acquireGrainState(y, x, x + count);
+		if( state->y != y ) {
+			state->noise.resize(3 * count);
+			for( int c = 0; c < 3; ++c ) {
+				Grain::blurred(&state->noise[c * count], x, y, count, params.grainSize, params.frame, c, static_cast<unsigned int>(params.grainSeed), state->windows[c]);
+			}
+			state->y = y;
 		}
+		const float* rNoise = &state->noise[0];
+		PointKernels::grain(rIn, gIn, bIn, rOut, gOut, bOut, count, rNoise, rNoise + count, rNoise + 2 * count, params.grainAmount, params.grainResponse);
+		kirei.releaseGrainState(state);
+	}
 
-		case FilterTypes::Sepia: {
-			sepia(in, y, x, r, channels, out);
-			break;
+private:
+	GrainKernel& operator=( const GrainKernel& );
+};
+
+struct Kirei::InvertKernel {
+	InvertKernel( const Kirei&, int ) {
+	}
+	void operator()( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int, int count ) const {
+		PointKernels::invert(rIn, gIn, bIn, rOut, gOut, bOut, count);
+	}
+};
+
+struct Kirei::ThresholdKernel : public Kirei::PixelKernel<Kirei::ThresholdKernel> {
+	const Kirei& kirei;
+	float limit;
+
+	ThresholdKernel( const Kirei& kirei, int )
+		: kirei(kirei), limit(kirei._params.thresholdAuto ? kirei._stats.threshold : kirei._params.thresholdLuminanceLimit) {
+	}
+	void pixel( float& r, float& g, float& b, int ) const {
+		r = g = b = (kirei.pixelLuminance(r, g, b) < limit) ? 0.0f : 1.0f;
+	}
+
+private:
+	ThresholdKernel& operator=( const ThresholdKernel& );
+};
+
+struct Kirei::SepiaKernel {
+	SepiaKernel( const Kirei&, int ) {
+	}
+	void operator()( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int, int count ) const {
+		PointKernels::sepia(rIn, gIn, bIn, rOut, gOut, bOut, count);
+	}
+};
+
+struct Kirei::TemperatureKernel {
+	float gains[3];
+
+	TemperatureKernel( const Kirei& kirei, int ) {
+		kirei.temperatureGains(gains[0], gains[1], gains[2]);
+	}
+	void operator()( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int, int count ) const {
+		PointKernels::gain(rIn, gIn, bIn, rOut, gOut, bOut, count, gains[0], gains[1], gains[2]);
+	}
+};
+
+struct Kirei::MixKernel {
+	const Kirei& kirei;
+
+	MixKernel( const Kirei& kirei, int )
+		: kirei(kirei) {
+	}
+	void operator()( const float* rIn, const float* gIn, const float* bIn, float* rOut, float* gOut, float* bOut, int, int count ) const {
+		PointKernels::mix(rIn, gIn, bIn, rOut, gOut, bOut, count,
+			kirei._params.channelMixerBGIntoRed, kirei._params.channelMixerBlueGreen, kirei._params.channelMixerRBIntoGreen, kirei._params.channelMixerRedBlue, kirei._params.channelMixerGRIntoBlue, kirei._params.channelMixerGreenRed);
+	}
+
+private:
+	MixKernel& operator=( const MixKernel& );
+};
+
+Kirei::RowEngine Kirei::selectEngine() const {
+	// not normally called for a transparent node, but a copy is still correct
+	if( _identity ) {
+		return &Kirei::pointFilter<CopyKernel>;
+	}
+	// a single filter with a lut in front of or in place of it runs as a stack
+	if( !_stackSteps.empty() ) {
+		return &Kirei::stack;
+	}
+	if( isTiled() ) {
+		return &Kirei::tiled;
+	}
+
+	switch( _params.filterType ) {
+		case FilterTypes::Vignette: {
+			return &Kirei::pointFilter<VignetteKernel>;
 		}
 
-		case FilterTypes::Blur: {
-			blur(in, y, x, r, channels, out);
-			break;
+		case FilterTypes::Invert: {
+			return &Kirei::pointFilter<InvertKernel>;
 		}
 
-		case FilterTypes::Sharpen: {
-			sharpen(in, y, x, r, channels, out);
-			break;
+		case FilterTypes::Threshold: {
+			return &Kirei::pointFilter<ThresholdKernel>;
 		}
 
-		case FilterTypes::EdgeEnhance: {
-			edgeEnhance(in, y, x, r, channels, out);
-			break;
+		case FilterTypes::Sepia: {
+			return &Kirei::pointFilter<SepiaKernel>;
 		}
 
 		case FilterTypes::Temperature: {
-			temperature(in, y, x, r, channels, out);
-			break;
+			return &Kirei::pointFilter<TemperatureKernel>;
 		}
 
 		case FilterTypes::ChannelMixer: {
-			mixChannels(in, y, x, r, channels, out);
-			break;
+			return &Kirei::pointFilter<MixKernel>;
 		}
 
-		case FilterTypes::Playground: {
-			playground(in, y, x, r, channels, out);
-			break;
+		case FilterTypes::Grain: {
+			return &Kirei::pointFilter<GrainKernel>;
 		}
-	}
-}
 
-void Kirei::passthrough( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
-			continue;
+		case FilterTypes::Blur: {
+			return &Kirei::blur;
 		}
 
-		if( DD::Image::colourIndex(z) >= 3 ) {
-			out.copy(in, z, x, r);
-			continue;
+		case FilterTypes::Sharpen:
+		case FilterTypes::EdgeEnhance:
+		case FilterTypes::Playground:
+		case FilterTypes::Convolve: {
+			return &Kirei::convolve;
 		}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
+		case FilterTypes::GaussianBlur: {
+			return &Kirei::gaussianBlur;
+		}
 
-		const float* rIn = in[rChan] + x;
-		const float* gIn = in[gChan] + x;
-		const float* bIn = in[bChan] + x;
-		const float* end = rIn + (r - x);
+		case FilterTypes::Median:
+		case FilterTypes::Erode:
+		case FilterTypes::Dilate:
+		case FilterTypes::LensBlur:
+		case FilterTypes::LensDistortion: {
+			return &Kirei::tiled;
+		}
 
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
+		case FilterTypes::Stack: {
+			return &Kirei::stack;
+		}
 
-		while( rIn < end ) {
-			*rOut++= *rIn++;
-			*gOut++= *gIn++;
-			*bOut++= *bIn++;
+		default: {
+			return &Kirei::pointFilter<CopyKernel>;
 		}
 	}
 }
 
-void Kirei::vignette( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	const DD::Image::Vector2 SCREEN_SIZE = DD::Image::Vector2(static_cast<float>(_inputWidth), static_cast<float>(_inputHeight));
+template<class Kernel>
+void Kirei::pointFilter( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
+	const Kernel kernel(*this, y);
 
 	DD::Image::ChannelSet done;
 	foreach(z, channels) {
@@ -333,109 +883,1403 @@ void Kirei::vignette( const DD::Image::Row &in, int y, int x, int r, DD::Image::
 		const float* rIn = in[rChan] + x;
 		const float* gIn = in[gChan] + x;
 		const float* bIn = in[bChan] + x;
-		const float* end = rIn + (r - x);
 
 		float* rOut = out.writable(rChan) + x;
 		float* gOut = out.writable(gChan) + x;
 		float* bOut = out.writable(bChan) + x;
 
-		int currX = x;
-		while( rIn < end ) {
-			const float RADIUS = _vignetteRadius;
-			const float SOFTNESS = _vignetteSoftness;
-			const DD::Image::Vector2 position = DD::Image::Vector2(static_cast<float>(currX), static_cast<float>(y)) / SCREEN_SIZE - DD::Image::Vector2(0.5f, 0.5f);
-			const float len = position.length();
-			const float vignette = ccmath::smoothstep<float>(RADIUS, RADIUS - SOFTNESS, len);
-
-			const float currRed = *rIn++;
-			const float currGreen = *gIn++;
-			const float currBlue = *bIn++;
-
-			*rOut++= ccmath::lerp<float>(currRed, currRed * vignette, 0.5f);
-			*gOut++= ccmath::lerp<float>(currGreen, currGreen * vignette, 0.5f);
-			*bOut++= ccmath::lerp<float>(currBlue, currBlue * vignette, 0.5f);
+		kernel(rIn, gIn, bIn, rOut, gOut, bOut, x, r - x);
+	}
+}
 
-			currX += 1;
+void Kirei::blur( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
+	// separable box blur using running sums, so the cost per pixel does not depend on _params.blurSize.
+	// vertically, each thread keeps the column sums of its last row and slides them down by one row
+	// (add the row entering the window, subtract the one leaving it).  horizontally, a running sum
+	// is slid along the column sums.  edges are clamped to the input bbox.
+	const int size = ccmath::maximum<int>(0, _params.blurSize);
+	const DD::Image::Box& box = input0().info();
+	if( box.w() <= 0 || box.h() <= 0 ) {
+		foreach(z, channels) {
+			out.erase(z);
 		}
+		return;
 	}
-}
 
-void Kirei::invert( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
-			continue;
+	BlurState* state = acquireBlurState(y, x, r, channels);
+
+	if( !state->valid ) {
+		// start of a new run of rows; sum the full window once
+		state->y = y;
+		state->x = x;
+		state->r = r;
+		state->left = ccmath::clamp<int>(x - size, box.x(), box.r() - 1);
+		state->right = ccmath::clamp<int>(r + size - 1, box.x(), box.r() - 1) + 1;
+		state->channels = channels;
+		state->planes.clear();
+		DD::Image::ChannelSet done;
+		foreach(z, channels) {
+			if( DD::Image::colourIndex(z) < 3 && !(done & z) ) {
+				done.addBrothers(z, 3);
+				for( int i = 0; i < 3; ++i ) {
+					state->planes.push_back(DD::Image::brother(z, i));
+				}
+			}
+		}
+		const int width = state->right - state->left;
+		state->sums.assign(state->planes.size() * width, 0.0);
+
+		// the ring also holds the row leaving the window on the next step
+		prepareRowRing(state->ring, state->left, state->right, channels, 2 * size + 2);
+		for( int py = -size; py <= size; ++py ) {
+			const DD::Image::Row& row = ringRow(state->ring, ccmath::clamp<int>(y + py, box.y(), box.t() - 1));
+			if( Op::aborted() ) {
+				releaseBlurState(state);
+				return;
+			}
+			for( size_t p = 0; p < state->planes.size(); ++p ) {
+				double* sums = &state->sums[p * width] - state->left;
+				const float* src = row[state->planes[p]];
+				for( int currX = state->left; currX < state->right; ++currX ) {
+					sums[currX] += src[currX];
+				}
+			}
+		}
+		state->valid = true;
+	} else if( state->y != y ) {
+		// next row of the run; only the entering and leaving rows are read
+		const int enterY = ccmath::clamp<int>(y + size, box.y(), box.t() - 1);
+		const int leaveY = ccmath::clamp<int>(y - size - 1, box.y(), box.t() - 1);
+		if( enterY != leaveY ) {
+			const DD::Image::Row& enter = ringRow(state->ring, enterY);
+			const DD::Image::Row& leave = ringRow(state->ring, leaveY);
+			if( Op::aborted() ) {
+				state->valid = false;
+				releaseBlurState(state);
+				return;
+			}
+			const int width = state->right - state->left;
+			for( size_t p = 0; p < state->planes.size(); ++p ) {
+				double* sums = &state->sums[p * width] - state->left;
+				const float* enterPtr = enter[state->planes[p]];
+				const float* leavePtr = leave[state->planes[p]];
+				for( int currX = state->left; currX < state->right; ++currX ) {
+					sums[currX] += static_cast<double>(enterPtr[currX]) - static_cast<double>(leavePtr[currX]);
+				}
+			}
 		}
+		state->y = y;
+	}
 
+	const double area = static_cast<double>(2 * size + 1) * static_cast<double>(2 * size + 1);
+	const double invArea = 1.0 / area;
+	const int width = state->right - state->left;
+	const int lastX = state->right - 1;
+
+	foreach(z, channels) {
 		if( DD::Image::colourIndex(z) >= 3 ) {
 			out.copy(in, z, x, r);
 			continue;
 		}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
-
-		const float* rIn = in[rChan] + x;
-		const float* gIn = in[gChan] + x;
-		const float* bIn = in[bChan] + x;
-		const float* end = rIn + (r - x);
-
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
+		size_t plane = 0;
+		while( state->planes[plane] != z ) {
+			++plane;
+		}
+		const double* sums = &state->sums[plane * width] - state->left;
+		float* outPtr = out.writable(z) + x;
 
-		while( rIn < end ) {
-			*rOut++= 1.0f - *rIn++;
-			*gOut++= 1.0f - *gIn++;
-			*bOut++= 1.0f - *bIn++;
+		// prime the running sum for the first output pixel and then slide it along the row
+		double sum = 0.0;
+		for( int px = -size; px <= size; ++px ) {
+			sum += sums[ccmath::clamp<int>(x + px, state->left, lastX)];
+		}
+		for( int currX = x; currX < r; ++currX ) {
+			*outPtr++= static_cast<float>(sum * invArea);
+			sum += sums[ccmath::clamp<int>(currX + size + 1, state->left, lastX)] - sums[ccmath::clamp<int>(currX - size, state->left, lastX)];
 		}
 	}
+
+	releaseBlurState(state);
 }
 
-void Kirei::threshold( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
-			continue;
-		}
+Kirei::BlurState* Kirei::acquireBlurState( int y, int x, int r, DD::Image::ChannelMask channels ) {
+	DD::Image::Guard guard(_blurStatesLock);
 
-		if( DD::Image::colourIndex(z) >= 3 ) {
-			out.copy(in, z, x, r);
+	// prefer a state that was left on the previous (or same) row of this span so it can be slid
+	BlurState* spare = nullptr;
+	for( size_t i = 0; i < _blurStates.size(); ++i ) {
+		BlurState* state = _blurStates[i];
+		if( state->inUse ) {
 			continue;
 		}
+		if( state->valid && state->x == x && state->r == r && state->channels == channels && (state->y == y || state->y == y - 1) ) {
+			state->inUse = true;
+			return state;
+		}
+		if( nullptr == spare || !state->valid ) {
+			spare = state;
+		}
+	}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
+	if( nullptr == spare ) {
+		spare = new BlurState();
+		_blurStates.push_back(spare);
+	}
+	spare->inUse = true;
+	spare->valid = false;
+	return spare;
+}
 
-		const float* rIn = in[rChan] + x;
-		const float* gIn = in[gChan] + x;
-		const float* bIn = in[bChan] + x;
-		const float* end = rIn + (r - x);
+void Kirei::releaseBlurState( BlurState* state ) {
+	DD::Image::Guard guard(_blurStatesLock);
+	state->inUse = false;
+}
+
+void Kirei::resetBlurStates() {
+	DD::Image::Guard guard(_blurStatesLock);
+	for( size_t i = 0; i < _blurStates.size(); ++i ) {
+		_blurStates[i]->valid = false;
+		clearRowRing(_blurStates[i]->ring);
+	}
+}
+
+Kirei::RowRing::RowRing()
+	: x(0), r(0) {
+}
+
+Kirei::RowRing::~RowRing() {
+	for( size_t i = 0; i < rows.size(); ++i ) {
+		delete rows[i];
+	}
+}
+
+void Kirei::prepareRowRing( RowRing& ring, int x, int r, DD::Image::ChannelMask channels, int capacity ) {
+	// rows already held are kept when the span and channels still match
+	if( ring.x == x && ring.r == r && ring.channels == channels && static_cast<int>(ring.rows.size()) == capacity ) {
+		return;
+	}
+
+	for( size_t i = 0; i < ring.rows.size(); ++i ) {
+		delete ring.rows[i];
+	}
+	ring.x = x;
+	ring.r = r;
+	ring.channels = channels;
+	ring.rows.resize(capacity);
+	for( int i = 0; i < capacity; ++i ) {
+		ring.rows[i] = new DD::Image::Row(x, r);
+	}
+	ring.ys.assign(capacity, INT_MIN);
+}
+
+void Kirei::clearRowRing( RowRing& ring ) {
+	ring.ys.assign(ring.ys.size(), INT_MIN);
+}
+
+const DD::Image::Row& Kirei::ringRow( RowRing& ring, int y ) {
+	const int capacity = static_cast<int>(ring.rows.size());
+	const int slot = ((y % capacity) + capacity) % capacity;
+	if( ring.ys[slot] != y ) {
+		fetchRow(y, ring.x, ring.r, ring.channels, *ring.rows[slot]);
+		ring.ys[slot] = Op::aborted() ? INT_MIN : y;
+	}
+	return *ring.rows[slot];
+}
+
+void Kirei::convolve( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
+	const int radius = _convolution.radius();
+	const DD::Image::Box& box = input0().info();
+	if( box.w() <= 0 || box.h() <= 0 ) {
+		foreach(z, channels) {
+			out.erase(z);
+		}
+		return;
+	}
+
+	// columns outside the input bbox are clamped by the engine, rows here
+	const int size = _convolution.size();
+	const int left = ccmath::clamp<int>(x - radius, box.x(), box.r() - 1);
+	const int right = ccmath::clamp<int>(r + radius - 1, box.x(), box.r() - 1) + 1;
+	ConvolveState* state = acquireConvolveState(y, left, right, channels);
+	prepareRowRing(state->ring, left, right, channels, size);
+	state->y = y;
+	std::vector<const DD::Image::Row*>& lines = state->lines;
+	std::vector<const float*>& rows = state->rows;
+	lines.resize(size);
+	rows.resize(size);
+	for( int k = 0; k < size; ++k ) {
+		// kernel rows run top to bottom
+		lines[k] = &ringRow(state->ring, ccmath::clamp<int>(y + radius - k, box.y(), box.t() - 1));
+	}
+
+	if( !Op::aborted() ) {
+		foreach(z, channels) {
+			if( DD::Image::colourIndex(z) >= 3 ) {
+				out.copy(in, z, x, r);
+				continue;
+			}
+
+			for( int k = 0; k < size; ++k ) {
+				rows[k] = (*lines[k])[z];
+			}
+			_convolution.apply(&rows[0], left, right, x, r, out.writable(z) + x, state->scratch);
+		}
+	}
+
+	releaseConvolveState(state);
+}
+
+Kirei::ConvolveState* Kirei::acquireConvolveState( int y, int left, int right, DD::Image::ChannelMask channels ) {
+	DD::Image::Guard guard(_convolveStatesLock);
+
+	// prefer the ring that served the previous row of this span, as it holds all but one of the rows
+	ConvolveState* spare = nullptr;
+	for( size_t i = 0; i < _convolveStates.size(); ++i ) {
+		ConvolveState* state = _convolveStates[i];
+		if( state->inUse ) {
+			continue;
+		}
+		const RowRing& ring = state->ring;
+		if( ring.x == left && ring.r == right && ring.channels == channels && (state->y == y || state->y == y - 1) ) {
+			state->inUse = true;
+			return state;
+		}
+		if( nullptr == spare ) {
+			spare = state;
+		}
+	}
+
+	if( nullptr == spare ) {
+		spare = new ConvolveState();
+		_convolveStates.push_back(spare);
+	}
+	spare->inUse = true;
+	spare->y = INT_MIN;
+	return spare;
+}
+
+void Kirei::releaseConvolveState( ConvolveState* state ) {
+	DD::Image::Guard guard(_convolveStatesLock);
+	state->inUse = false;
+}
+
+void Kirei::resetConvolveStates() {
+	DD::Image::Guard guard(_convolveStatesLock);
+	for( size_t i = 0; i < _convolveStates.size(); ++i ) {
+		_convolveStates[i]->y = INT_MIN;
+		clearRowRing(_convolveStates[i]->ring);
+	}
+}
+
+Kirei::GrainState* Kirei::acquireGrainState( int y, int x, int r ) const {
+	DD::Image::Guard guard(_grainStatesLock);
+
+	// prefer the state that made this row or the one before it, so its box sums can be slid
+	GrainState* spare = nullptr;
+	for( size_t i = 0; i < _grainStates.size(); ++i ) {
+		GrainState* state = _grainStates[i];
+		if( state->inUse ) {
+			continue;
+		}
+		if( state->x == x && state->r == r && (state->y == y || state->y == y - 1) ) {
+			state->inUse = true;
+			return state;
+		}
+		if( nullptr == spare ) {
+			spare = state;
+		}
+	}
+
+	if( nullptr == spare ) {
+		spare = new GrainState();
+		_grainStates.push_back(spare);
+	}
+	spare->inUse = true;
+	spare->y = INT_MIN;
+	spare->x = x;
+	spare->r = r;
+	return spare;
+}
+
+void Kirei::releaseGrainState( GrainState* state ) const {
+	DD::Image::Guard guard(_grainStatesLock);
+	state->inUse = false;
+}
+
+void Kirei::resetGrainStates() {
+	DD::Image::Guard guard(_grainStatesLock);
+	for( size_t i = 0; i < _grainStates.size(); ++i ) {
+		_grainStates[i]->y = INT_MIN;
+		for( int c = 0; c < 3; ++c ) {
+			_grainStates[i]->windows[c].valid = false;
+		}
+	}
+}
+
+void Kirei::updateConvolution() {
+	switch( _spatialType ) {
+		case FilterTypes::Sharpen: {
+			// http://cis.k.hosei.ac.jp/~wakahara/sharpen.c
+			// the pixel minus strength times the 8-neighbour laplacian
+			const float s = _params.sharpenStrength;
+			const float kernel[9] = {
+				-s,        -s, -s,
+				-s, 1.0f+8.0f*s, -s,
+				-s,        -s, -s
+			};
+			_convolution.setKernel(kernel, 3);
+			break;
+		}
+
+		case FilterTypes::EdgeEnhance: {
+			// left neighbour, plus strength times the difference to the pixel below
+			const float s = _params.edgeEnhanceStrength;
+			const float kernel[9] = {
+				0.0f, 0.0f, 0.0f,
+				1.0f,    s, 0.0f,
+				0.0f,   -s, 0.0f
+			};
+			_convolution.setKernel(kernel, 3);
+			break;
+		}
+
+		case FilterTypes::Playground: {
+			// http://docs.gimp.org/en/plug-in-convmatrix.html
+			const float kernel[9] = {
+				0.0f,  1.0f, 0.0f,
+				1.0f, -4.0f, 1.0f,
+				0.0f,  1.0f, 0.0f
+			};
+			_convolution.setKernel(kernel, 3);
+			break;
+		}
+
+		case FilterTypes::Convolve: {
+			// any run of numbers; commas, brackets and newlines are just separators
+			std::vector<float> kernel;
+			const char* text = (nullptr == _convolveKernel) ? "" : _convolveKernel;
+			while( *text != '\0' ) {
+				char* next = nullptr;
+				const double value = strtod(text, &next);
+				if( next == text ) {
+					++text;
+					continue;
+				}
+				kernel.push_back(static_cast<float>(value));
+				text = next;
+			}
+			const int size = static_cast<int>(sqrt(static_cast<double>(kernel.size())) + 0.5);
+			if( kernel.empty() || size * size != static_cast<int>(kernel.size()) || !_convolution.setKernel(&kernel[0], size) ) {
+				_convolution.setKernel(nullptr, 0);
+				error("Convolve kernel must be a square of odd size (3x3, 5x5, ...); got %d values.", static_cast<int>(kernel.size()));
+			}
+			break;
+		}
+
+		default: {
+			_convolution.setKernel(nullptr, 0);
+		}
+	}
+}
+
+bool Kirei::isIdentity() const {
+	// any stack step or lut changes the colour
+	if( !_stackSteps.empty() ) {
+		return false;
+	}
+
+	switch( _spatialType ) {
+		case FilterTypes::Passthrough: {
+			break;
+		}
+
+		case FilterTypes::Blur: {
+			return _params.blurSize <= 0;
+		}
+
+		case FilterTypes::GaussianBlur: {
+			return _gaussian.isIdentity();
+		}
+
+		case FilterTypes::Median:
+		case FilterTypes::Erode:
+		case FilterTypes::Dilate: {
+			return _params.rankRadius <= 0;
+		}
+
+		case FilterTypes::LensBlur: {
+			return !usesLensInput() && 0 == lensRadius();
+		}
+
+		case FilterTypes::LensDistortion: {
+			return 0.0f == _params.distortion && 0.0f == _params.distortionOuter && 0.0f == _params.aberration;
+		}
+
+		default: {
+			return isConvolution() && _convolution.isIdentity();
+		}
+	}
+
+	switch( _params.filterType ) {
+		case FilterTypes::Passthrough:
+		case FilterTypes::Stack: {
+			return true;
+		}
+
+		case FilterTypes::Vignette: {
+			return isVignetteIdentity();
+		}
+
+		case FilterTypes::Grain: {
+			return 0.0f == _params.grainAmount;
+		}
+
+		// the channel mixer clamps to [0, 1] even with no mixing, so it is never an identity
+		default: {
+			return false;
+		}
+	}
+}
+
+bool Kirei::isVignetteIdentity() const {
+	// with a positive softness the falloff only gets darker further out, so the farthest corner
+	// of the bbox decides.  the weight is worked out exactly as the kernel does.
+	const DD::Image::Box& box = input0().info();
+	if( !(_params.vignetteSoftness > 0.0f) || box.w() <= 0 || box.h() <= 0 ) {
+		return false;
+	}
+	const int xs[2] = { box.x(), box.r() - 1 };
+	const int ys[2] = { box.y(), box.t() - 1 };
+	for( int i = 0; i < 4; ++i ) {
+		if( VignetteKernel(*this, ys[i >> 1]).weight(xs[i & 1]) != 1.0f ) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Kirei::isConvolution() const {
+	return FilterTypes::Sharpen == _spatialType || FilterTypes::EdgeEnhance == _spatialType || FilterTypes::Playground == _spatialType || FilterTypes::Convolve == _spatialType;
+}
+
+bool Kirei::isRankFilter() const {
+	return FilterTypes::Median == _spatialType || FilterTypes::Erode == _spatialType || FilterTypes::Dilate == _spatialType;
+}
+
+bool Kirei::usesLensInput() const {
+	return FilterTypes::LensBlur == _spatialType && LensShapes::KernelInput == _params.lensShape && nullptr != input(1);
+}
+
+bool Kirei::usesFrame() const {
+	// read from the knobs, as the hash is built before _validate takes its snapshot
+	if( FilterTypes::Grain == _filterType ) {
+		return true;
+	}
+	if( FilterTypes::Stack == _filterType ) {
+		for( int i = 0; i < STACK_SIZE; ++i ) {
+			if( FilterTypes::Grain == _stack[i] ) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+bool Kirei::isSpatial( int filterType ) {
+	switch( filterType ) {
+		case FilterTypes::Blur:
+		case FilterTypes::Sharpen:
+		case FilterTypes::EdgeEnhance:
+		case FilterTypes::Playground:
+		case FilterTypes::GaussianBlur:
+		case FilterTypes::Convolve:
+		case FilterTypes::Median:
+		case FilterTypes::Erode:
+		case FilterTypes::Dilate:
+		case FilterTypes::LensBlur:
+		case FilterTypes::LensDistortion: {
+			return true;
+		}
+
+		default: {
+			return false;
+		}
+	}
+}
+
+void Kirei::gaussianBlur( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
+	// a recursive filter needs the whole line, so _open blurs the padded request area once (in
+	// parallel) and every row then just reads its span from that shared frame
+	if( _gaussian.isIdentity() ) {
+		pointStage(in, y, x, r, channels, out);
+		return;
+	}
+
+	std::shared_ptr<PlaneFrame> frame;
+	{
+		DD::Image::Guard guard(_planeLock);
+		frame = _planeFrame;
+	}
+	planeRow(*frame, in, y, x, r, channels, out);
+}
+
+void Kirei::tiled( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
+	// the row is put together from the tiles it crosses, filtering any that are not ready yet.
+	// rows and columns outside the output area repeat its edges.
+	const DD::Image::Box& area = info_;
+	if( input0().info().w() <= 0 || input0().info().h() <= 0 || area.w() <= 0 || area.h() <= 0 ) {
+		foreach(z, channels) {
+			out.erase(z);
+		}
+		return;
+	}
+
+	const int width = tileWidth();
+	const int height = tileHeight();
+	const int rowY = ccmath::clamp<int>(y, area.y(), area.t() - 1);
+	const int tileY = area.y() + ((rowY - area.y()) / height) * height;
+	const int first = area.x() + ((ccmath::clamp<int>(x, area.x(), area.r() - 1) - area.x()) / width) * width;
+	const int last = area.x() + ((ccmath::clamp<int>(r - 1, area.x(), area.r() - 1) - area.x()) / width) * width;
+
+	foreach(z, channels) {
+		if( DD::Image::colourIndex(z) >= 3 ) {
+			out.copy(in, z, x, r);
+		}
+	}
+
+	for( int tileX = first; tileX <= last; tileX += width ) {
+		const std::shared_ptr<PlaneFrame> tile = acquireTile(tileX, tileY, channels);
+		if( !tile ) {
+			return;
+		}
+
+		const DD::Image::Box& box = tile->box;
+		const int start = (tileX == first) ? x : box.x();
+		const int end = (tileX == last) ? r : box.r();
+		const size_t planeSize = static_cast<size_t>(box.w()) * box.h();
+		for( size_t p = 0; p < tile->planes.size(); ++p ) {
+			const DD::Image::Channel z = tile->planes[p];
+			if( !(channels & z) ) {
+				continue;
+			}
+			const float* src = &tile->data[p * planeSize + static_cast<size_t>(rowY - box.y()) * box.w()] - box.x();
+			float* outPtr = out.writable(z);
+			for( int currX = start; currX < end; ++currX ) {
+				outPtr[currX] = src[ccmath::clamp<int>(currX, box.x(), box.r() - 1)];
+			}
+		}
+	}
+}
+
+int Kirei::tileWidth() const {
+	// lens blur tiles are its fft blocks.  the others grow with the pad, so the overlap fetched
+	// around a tile is never more than the tile itself.
+	if( FilterTypes::LensBlur == _spatialType ) {
+		return ccmath::maximum<int>(1, _lensSpectrum.size - 2 * _lensSpectrum.radius);
+	}
+	if( FilterTypes::LensDistortion == _spatialType ) {
+		return TILE_WIDTH;
+	}
+	return ccmath::maximum<int>(TILE_WIDTH, 2 * spatialPad());
+}
+
+int Kirei::tileHeight() const {
+	if( FilterTypes::LensBlur == _spatialType ) {
+		return tileWidth();
+	}
+	if( FilterTypes::LensDistortion == _spatialType ) {
+		return TILE_HEIGHT;
+	}
+	return ccmath::maximum<int>(TILE_HEIGHT, 2 * spatialPad());
+}
+
+std::shared_ptr<Kirei::PlaneFrame> Kirei::acquireTile( int tileX, int tileY, DD::Image::ChannelMask channels ) {
+	std::shared_ptr<PlaneFrame> tile;
+	{
+		DD::Image::Guard guard(_tilesLock);
+		if( _tilesHash != hash() ) {
+			_tiles.clear();
+			_tilesHash = hash();
+		}
+
+		// a tile without every colour plane needed is replaced by one with all of them
+		const std::pair<int, int> key(tileX, tileY);
+		std::map<std::pair<int, int>, std::shared_ptr<PlaneFrame> >::iterator found = _tiles.find(key);
+		DD::Image::ChannelSet needed;
+		bool complete = found != _tiles.end();
+		if( complete ) {
+			needed = found->second->channels;
+		}
+		foreach(z, channels) {
+			if( DD::Image::colourIndex(z) < 3 && !(needed & z) ) {
+				needed.addBrothers(z, 3);
+				complete = false;
+			}
+		}
+
+		if( complete ) {
+			tile = found->second;
+			tile->lastUse = ++_tilesClock;
+		} else {
+			const DD::Image::Box& area = info_;
+			tile.reset(new PlaneFrame());
+			tile->hash = _tilesHash;
+			tile->box.set(tileX, tileY, ccmath::minimum<int>(area.r(), tileX + tileWidth()), ccmath::minimum<int>(area.t(), tileY + tileHeight()));
+			tile->channels = needed;
+			foreach(z, needed) {
+				tile->planes.push_back(z);
+			}
+			tile->ready = false;
+			tile->lastUse = ++_tilesClock;
+			_tiles[key] = tile;
+
+			// past two rows of tiles across the area (and one per thread), the least recently
+			// used tile goes.  rows still reading or filtering it keep it alive.
+			const int columns = (area.w() + tileWidth() - 1) / tileWidth();
+			const size_t capacity = static_cast<size_t>(2 * columns) + DD::Image::Thread::numThreads;
+			while( _tiles.size() > capacity ) {
+				std::map<std::pair<int, int>, std::shared_ptr<PlaneFrame> >::iterator oldest = _tiles.begin();
+				for( std::map<std::pair<int, int>, std::shared_ptr<PlaneFrame> >::iterator it = _tiles.begin(); it != _tiles.end(); ++it ) {
+					if( it->second->lastUse < oldest->second->lastUse ) {
+						oldest = it;
+					}
+				}
+				_tiles.erase(oldest);
+			}
+		}
+	}
+
+	// the first row to get here filters the tile; the others wait for it.  one that was aborted
+	// is filtered again by the next row to need it.
+	DD::Image::Guard guard(tile->lock);
+	if( !tile->ready ) {
+		tile->ready = filterTile(*tile);
+	}
+	return tile->ready ? tile : std::shared_ptr<PlaneFrame>();
+}
+
+bool Kirei::filterTile( PlaneFrame& tile ) {
+	TileWork* work = acquireTileWork();
+	const DD::Image::Box& box = tile.box;
+	tile.data.resize(tile.planes.size() * static_cast<size_t>(box.w()) * box.h());
+
+	// the input the tile reads, clamped to the bbox the same way the row path clamps.  the
+	// distortion works out where its pixels land first.
+	if( FilterTypes::LensDistortion == _spatialType ) {
+		distortionSource(tile, *work);
+	} else {
+		const DD::Image::Box& bbox = input0().info();
+		const int pad = (FilterTypes::LensBlur == _spatialType) ? _lensSpectrum.radius : spatialPad();
+		work->sourceBox.set(ccmath::clamp<int>(box.x() - pad, bbox.x(), bbox.r() - 1), ccmath::clamp<int>(box.y() - pad, bbox.y(), bbox.t() - 1),
+			ccmath::clamp<int>(box.r() - 1 + pad, bbox.x(), bbox.r() - 1) + 1, ccmath::clamp<int>(box.t() - 1 + pad, bbox.y(), bbox.t() - 1) + 1);
+	}
+	const bool fetched = fetchTileSource(tile, *work);
+
+	if( fetched ) {
+		switch( _spatialType ) {
+			case FilterTypes::Blur: {
+				tiledBlur(tile, *work);
+				break;
+			}
+
+			case FilterTypes::Median:
+			case FilterTypes::Erode:
+			case FilterTypes::Dilate: {
+				tiledRank(tile, *work);
+				break;
+			}
+
+			case FilterTypes::LensBlur: {
+				tiledLens(tile, *work);
+				break;
+			}
+
+			case FilterTypes::LensDistortion: {
+				tiledDistort(tile, *work);
+				break;
+			}
+
+			default: {
+				tiledConvolve(tile, *work);
+			}
+		}
+	}
+
+	releaseTileWork(work);
+	return fetched && !Op::aborted();
+}
+
+bool Kirei::fetchTileSource( const PlaneFrame& tile, TileWork& work ) {
+	// every row of the tile's input is fetched (and has the point stage applied) once
+	const DD::Image::Box& source = work.sourceBox;
+	const int width = source.w();
+	const size_t planeSize = static_cast<size_t>(width) * source.h();
+	const bool findRange = FilterTypes::Median == _spatialType;
+	work.source.resize(tile.planes.size() * planeSize);
+	work.low.assign(tile.planes.size(), FLT_MAX);
+	work.high.assign(tile.planes.size(), -FLT_MAX);
+
+	DD::Image::Row row(source.x(), source.r());
+	for( int y = source.y(); y < source.t(); ++y ) {
+		fetchRow(y, source.x(), source.r(), tile.channels, row);
+		if( Op::aborted() ) {
+			return false;
+		}
+		for( size_t p = 0; p < tile.planes.size(); ++p ) {
+			float* dst = &work.source[p * planeSize + static_cast<size_t>(y - source.y()) * width];
+			const float* src = row[tile.planes[p]] + source.x();
+			for( int i = 0; i < width; ++i ) {
+				dst[i] = src[i];
+			}
+			if( findRange ) {
+				// infinities and nans are left out so they cannot stretch the median's levels
+				for( int i = 0; i < width; ++i ) {
+					if( src[i] >= -FLT_MAX && src[i] <= FLT_MAX ) {
+						work.low[p] = ccmath::minimum<float>(work.low[p], src[i]);
+						work.high[p] = ccmath::maximum<float>(work.high[p], src[i]);
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+Kirei::TileWork* Kirei::acquireTileWork() {
+	DD::Image::Guard guard(_tileWorksLock);
+	for( size_t i = 0; i < _tileWorks.size(); ++i ) {
+		if( !_tileWorks[i]->inUse ) {
+			_tileWorks[i]->inUse = true;
+			return _tileWorks[i];
+		}
+	}
+	TileWork* work = new TileWork();
+	work->inUse = true;
+	_tileWorks.push_back(work);
+	return work;
+}
+
+void Kirei::releaseTileWork( TileWork* work ) {
+	DD::Image::Guard guard(_tileWorksLock);
+	work->inUse = false;
+}
+
+void Kirei::resetTiles() {
+	// no engine is running, so nothing is using the tiles or their working memory
+	DD::Image::Guard guard(_tilesLock);
+	_tiles.clear();
+	for( size_t i = 0; i < _tileWorks.size(); ++i ) {
+		delete _tileWorks[i];
+	}
+	_tileWorks.clear();
+}
+
+void Kirei::planeRow( const PlaneFrame& frame, const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) const {
+	const DD::Image::Box& box = frame.box;
+	const int width = box.w();
+	const size_t planeSize = static_cast<size_t>(width) * box.h();
+	const int rowIndex = ccmath::clamp<int>(y, box.y(), box.t() - 1) - box.y();
+
+	foreach(z, channels) {
+		if( DD::Image::colourIndex(z) >= 3 ) {
+			out.copy(in, z, x, r);
+			continue;
+		}
+
+		// a plane the frame was not built with (asked for by a later request) is passed through
+		size_t plane = 0;
+		while( plane < frame.planes.size() && frame.planes[plane] != z ) {
+			++plane;
+		}
+		if( plane == frame.planes.size() ) {
+			out.copy(in, z, x, r);
+			continue;
+		}
+		const float* src = &frame.data[plane * planeSize + static_cast<size_t>(rowIndex) * width] - box.x();
+		float* outPtr = out.writable(z) + x;
+		for( int currX = x; currX < r; ++currX ) {
+			*outPtr++= src[ccmath::clamp<int>(currX, box.x(), box.r() - 1)];
+		}
+	}
+}
+
+int Kirei::gaussianPad() const {
+	// the gaussian has fallen to ~1% of its peak by 3 sigma
+	return _gaussian.isIdentity() ? 0 : static_cast<int>(ceilf(3.0f * _params.gaussianSigma));
+}
+
+int Kirei::spatialPad() const {
+	switch( _spatialType ) {
+		case FilterTypes::Blur: {
+			return ccmath::maximum<int>(0, _params.blurSize);
+		}
+
+		case FilterTypes::GaussianBlur: {
+			return gaussianPad();
+		}
+
+		case FilterTypes::Median:
+		case FilterTypes::Erode:
+		case FilterTypes::Dilate: {
+			return ccmath::maximum<int>(0, _params.rankRadius);
+		}
+
+		case FilterTypes::LensBlur: {
+			return lensRadius();
+		}
+
+		case FilterTypes::LensDistortion: {
+			return _distortionTable.pad;
+		}
+
+		default: {
+			return isConvolution() ? _convolution.radius() : 0;
+		}
+	}
+}
+
+bool Kirei::isTiled() const {
+	// the rank filters, lens blur and distortion only exist in tiled form; the gaussian already works on whole frames
+	if( isRankFilter() || FilterTypes::LensBlur == _spatialType || FilterTypes::LensDistortion == _spatialType ) {
+		return true;
+	}
+	return _params.tiled && FilterTypes::Passthrough != _spatialType && FilterTypes::GaussianBlur != _spatialType;
+}
+
+void Kirei::updatePlaneFrame() {
+	DD::Image::Box request;
+	bool requested = false;
+	DD::Image::ChannelSet channels;
+	{
+		DD::Image::Guard guard(_planeLock);
+		request = _planeRequest;
+		requested = _planeRequested;
+		channels = _planeChannels;
+	}
+	if( !requested ) {
+		channels = DD::Image::Mask_RGB;
+	}
+
+	// blur the padded request area, clamped to the input bbox like the other neighbourhood filters
+	const DD::Image::Box& bbox = input0().info();
+	DD::Image::Box box = bbox;
+	if( requested ) {
+		box.intersect(request);
+	}
+	if( box.w() <= 0 || box.h() <= 0 ) {
+		box = bbox;
+	}
+	if( box.w() <= 0 || box.h() <= 0 ) {
+		box.set(bbox.x(), bbox.y(), bbox.x() + 1, bbox.y() + 1);
+	}
+
+	// reuse the current frame if it is for the same hash and area and has every colour plane needed
+	bool reuse = _planeFrame && _planeFrame->ready && _planeFrame->hash == hash() && _planeFrame->box == box;
+	if( reuse ) {
+		foreach(z, channels) {
+			if( DD::Image::colourIndex(z) < 3 && !(_planeFrame->channels & z) ) {
+				reuse = false;
+				break;
+			}
+		}
+	}
+	if( reuse ) {
+		return;
+	}
+
+	std::shared_ptr<PlaneFrame> frame(new PlaneFrame());
+	frame->hash = hash();
+	frame->box = box;
+	frame->ready = false;
+	frame->lastUse = 0;
+	if( _planeFrame && _planeFrame->ready && _planeFrame->hash == frame->hash ) {
+		frame->channels = _planeFrame->channels;
+	}
+	foreach(z, channels) {
+		if( DD::Image::colourIndex(z) < 3 ) {
+			frame->channels.addBrothers(z, 3);
+		}
+	}
+	foreach(z, frame->channels) {
+		frame->planes.push_back(z);
+	}
+	frame->data.resize(frame->planes.size() * static_cast<size_t>(box.w()) * box.h());
+
+	// rows are fetched and filtered horizontally first, then the columns are filtered in blocks
+	PlaneJob job;
+	job.kirei = this;
+	job.frame = frame.get();
+	const int threads = ccmath::maximum<int>(1, static_cast<int>(DD::Image::Thread::numThreads));
+	for( job.pass = 0; job.pass < 2; ++job.pass ) {
+		DD::Image::Thread::spawn(planeThread, threads, &job);
+		DD::Image::Thread::wait(&job);
+	}
+
+	// an aborted frame is still handed to the rows, whose output is thrown away, but it is never
+	// reused
+	frame->ready = !Op::aborted();
+	DD::Image::Guard guard(_planeLock);
+	_planeFrame = frame;
+}
+
+void Kirei::planeThread( unsigned index, unsigned nThreads, void* data ) {
+	PlaneJob* job = static_cast<PlaneJob*>(data);
+	job->kirei->gaussianPass(*job->frame, job->pass, index, nThreads);
+}
+
+void Kirei::gaussianPass( PlaneFrame& frame, int pass, unsigned index, unsigned nThreads ) {
+	const DD::Image::Box& box = frame.box;
+	const int width = box.w();
+	const int height = box.h();
+	const size_t planeSize = static_cast<size_t>(width) * height;
+
+	if( 0 == pass ) {
+		// interleave rows across threads
+		DD::Image::Row row(box.x(), box.r());
+		for( int y = box.y() + static_cast<int>(index); y < box.t(); y += static_cast<int>(nThreads) ) {
+			if( aborted() ) {
+				return;
+			}
+			fetchRow(y, box.x(), box.r(), frame.channels, row);
+			for( size_t p = 0; p < frame.planes.size(); ++p ) {
+				float* dst = &frame.data[p * planeSize + static_cast<size_t>(y - box.y()) * width];
+				const float* src = row[frame.planes[p]] + box.x();
+				for( int i = 0; i < width; ++i ) {
+					dst[i] = src[i];
+				}
+				_gaussian.filterLine(dst, width);
+			}
+		}
+	} else {
+		// contiguous blocks of columns per thread so each one walks whole cache lines
+		const int blockWidth = (width + static_cast<int>(nThreads) - 1) / static_cast<int>(nThreads);
+		const int left = ccmath::minimum<int>(width, static_cast<int>(index) * blockWidth);
+		const int right = ccmath::minimum<int>(width, left + blockWidth);
+		if( right <= left ) {
+			return;
+		}
+		std::vector<double> state(4 * (right - left));
+		for( size_t p = 0; p < frame.planes.size(); ++p ) {
+			if( aborted() ) {
+				return;
+			}
+			_gaussian.filterColumns(&frame.data[p * planeSize], width, height, left, right, &state[0]);
+		}
+	}
+}
+
+void Kirei::tiledBlur( PlaneFrame& tile, const TileWork& work ) {
+	// the row path's running sums, but over the tile's columns from its top down
+	const DD::Image::Box& box = tile.box;
+	const DD::Image::Box& source = work.sourceBox;
+	const int size = ccmath::maximum<int>(0, _params.blurSize);
+	const int sourceWidth = source.w();
+	const size_t sourceSize = static_cast<size_t>(sourceWidth) * source.h();
+	const size_t planeSize = static_cast<size_t>(box.w()) * box.h();
+	const int left = box.x();
+	const int right = box.r();
+	const int sumLeft = ccmath::clamp<int>(left - size, source.x(), source.r() - 1);
+	const int sumRight = ccmath::clamp<int>(right + size - 1, source.x(), source.r() - 1) + 1;
+	const int lastX = sumRight - 1;
+	const double invArea = 1.0 / (static_cast<double>(2 * size + 1) * static_cast<double>(2 * size + 1));
+	std::vector<double> sumData(sumRight - sumLeft);
+	double* sums = &sumData[0] - sumLeft;
+
+	for( size_t p = 0; p < tile.planes.size(); ++p ) {
+		const float* plane = &work.source[p * sourceSize] - source.x();
+		float* dst = &tile.data[p * planeSize] - box.x();
+		for( int currX = sumLeft; currX < sumRight; ++currX ) {
+			sums[currX] = 0.0;
+		}
+		for( int py = -size; py <= size; ++py ) {
+			const float* src = plane + static_cast<size_t>(ccmath::clamp<int>(box.y() + py, source.y(), source.t() - 1) - source.y()) * sourceWidth;
+			for( int currX = sumLeft; currX < sumRight; ++currX ) {
+				sums[currX] += src[currX];
+			}
+		}
+
+		for( int y = box.y(); y < box.t(); ++y ) {
+			if( y != box.y() ) {
+				const int enterY = ccmath::clamp<int>(y + size, source.y(), source.t() - 1);
+				const int leaveY = ccmath::clamp<int>(y - size - 1, source.y(), source.t() - 1);
+				if( enterY != leaveY ) {
+					const float* enterPtr = plane + static_cast<size_t>(enterY - source.y()) * sourceWidth;
+					const float* leavePtr = plane + static_cast<size_t>(leaveY - source.y()) * sourceWidth;
+					for( int currX = sumLeft; currX < sumRight; ++currX ) {
+						sums[currX] += static_cast<double>(enterPtr[currX]) - static_cast<double>(leavePtr[currX]);
+					}
+				}
+			}
+
+			float* outPtr = dst + static_cast<size_t>(y - box.y()) * box.w() + left;
+			double sum = 0.0;
+			for( int px = -size; px <= size; ++px ) {
+				sum += sums[ccmath::clamp<int>(left + px, sumLeft, lastX)];
+			}
+			for( int currX = left; currX < right; ++currX ) {
+				*outPtr++= static_cast<float>(sum * invArea);
+				sum += sums[ccmath::clamp<int>(currX + size + 1, sumLeft, lastX)] - sums[ccmath::clamp<int>(currX - size, sumLeft, lastX)];
+			}
+		}
+	}
+}
+
+void Kirei::tiledRank( PlaneFrame& tile, TileWork& work ) {
+	const DD::Image::Box& box = tile.box;
+	const DD::Image::Box& source = work.sourceBox;
+	const int radius = ccmath::maximum<int>(0, _params.rankRadius);
+	const int sourceWidth = source.w();
+	const int sourceHeight = source.h();
+	const size_t sourceSize = static_cast<size_t>(sourceWidth) * sourceHeight;
+	const size_t planeSize = static_cast<size_t>(box.w()) * box.h();
+	const int columns = box.w();
+
+	// min and max are separable: along the rows of the source into a strip, then down its columns
+	if( FilterTypes::Median != _spatialType ) {
+		work.strip.resize(static_cast<size_t>(columns) * sourceHeight);
+	}
+
+	for( size_t p = 0; p < tile.planes.size(); ++p ) {
+		const float* plane = &work.source[p * sourceSize];
+		float* dst = &tile.data[p * planeSize];
+
+		if( FilterTypes::Median == _spatialType ) {
+			// levels span what the tile reads; a plane with nothing finite in it has no range to quantise over
+			const bool finite = work.low[p] <= work.high[p];
+			RankFilter::median(plane, sourceWidth, sourceHeight, box.x() - source.x(), box.y() - source.y(), columns, box.h(), radius,
+				finite ? work.low[p] : 0.0f, finite ? work.high[p] : 0.0f, dst, box.w());
+			continue;
+		}
+
+		const bool maximum = FilterTypes::Dilate == _spatialType;
+		for( int y = 0; y < sourceHeight; ++y ) {
+			RankFilter::extremum(plane + static_cast<size_t>(y) * sourceWidth, 1, sourceWidth, box.x() - source.x(), columns, radius, maximum,
+				&work.strip[static_cast<size_t>(y) * columns], 1, work.scratch);
+		}
+		for( int i = 0; i < columns; ++i ) {
+			RankFilter::extremum(&work.strip[i], columns, sourceHeight, box.y() - source.y(), box.h(), radius, maximum, dst + i, box.w(), work.scratch);
+		}
+	}
+}
+
+void Kirei::tiledLens( PlaneFrame& tile, TileWork& work ) {
+	// overlap-save: the tile and radius pixels of clamped input around it make one fft block, which
+	// is convolved whole by multiplying spectra.  the wrap-around of the circular convolution only
+	// reaches the radius pixels at the block's edges, so its middle is the tile's result.
+	const DD::Image::Box& box = tile.box;
+	const DD::Image::Box& source = work.sourceBox;
+	const LensSpectrum& spectrum = _lensSpectrum;
+	const size_t planeSize = static_cast<size_t>(box.w()) * box.h();
+	if( spectrum.data.empty() ) {
+		tile.data.assign(tile.data.size(), 0.0f);
+		return;
+	}
+	const int radius = spectrum.radius;
+	const int n = spectrum.size;
+	const int sourceWidth = source.w();
+	const size_t sourceSize = static_cast<size_t>(sourceWidth) * source.h();
+	const int blockX = box.x() - radius;
+	const int blockY = box.y() - radius;
+	const int blockW = ccmath::minimum<int>(n, box.w() + 2 * radius);
+	const int blockH = ccmath::minimum<int>(n, box.h() + 2 * radius);
+	work.fft.resize(static_cast<size_t>(n) * n);
+
+	// two planes at a time, as the real and imaginary parts
+	for( size_t p = 0; p < tile.planes.size(); p += 2 ) {
+		if( aborted() ) {
+			return;
+		}
+		const bool pair = p + 1 < tile.planes.size();
+		const float* planeA = &work.source[p * sourceSize] - source.x();
+		const float* planeB = pair ? &work.source[(p + 1) * sourceSize] - source.x() : nullptr;
+
+		// a tile at the area's edge is smaller than the block; the rest is zero
+		work.fft.assign(work.fft.size(), Fft::Complex(0.0f, 0.0f));
+		for( int j = 0; j < blockH; ++j ) {
+			const size_t row = static_cast<size_t>(ccmath::clamp<int>(blockY + j, source.y(), source.t() - 1) - source.y()) * sourceWidth;
+			Fft::Complex* dst = &work.fft[static_cast<size_t>(j) * n];
+			for( int i = 0; i < blockW; ++i ) {
+				const int sx = ccmath::clamp<int>(blockX + i, source.x(), source.r() - 1);
+				dst[i] = Fft::Complex(planeA[row + sx], pair ? planeB[row + sx] : 0.0f);
+			}
+		}
+
+		_lensFft.transform2d(&work.fft[0], blockH, false, work.fftScratch);
+		for( size_t i = 0; i < work.fft.size(); ++i ) {
+			work.fft[i] *= spectrum.data[i];
+		}
+		_lensFft.transform2d(&work.fft[0], n, true, work.fftScratch);
+
+		for( int j = 0; j < box.h(); ++j ) {
+			const Fft::Complex* src = &work.fft[static_cast<size_t>(j + radius) * n + radius];
+			float* outA = &tile.data[p * planeSize + static_cast<size_t>(j) * box.w()];
+			float* outB = pair ? &tile.data[(p + 1) * planeSize + static_cast<size_t>(j) * box.w()] : nullptr;
+			for( int i = 0; i < box.w(); ++i ) {
+				outA[i] = src[i].real();
+				if( pair ) {
+					outB[i] = src[i].imag();
+				}
+			}
+		}
+	}
+}
+
+int Kirei::lensRadius() const {
+	if( LensShapes::KernelInput == _params.lensShape ) {
+		if( !usesLensInput() ) {
+			return 0;
+		}
+		const DD::Image::Box& kernelBox = input1().info();
+		return ccmath::maximum<int>(0, ccmath::maximum<int>(kernelBox.w(), kernelBox.h()) / 2);
+	}
+
+	// the anti-aliased edge reaches half a pixel past the shape
+	const float radius = 0.5f * _params.lensSize;
+	return (radius <= 0.5f) ? 0 : static_cast<int>(ceilf(radius + 0.5f));
+}
+
+bool Kirei::buildLensKernel( std::vector<float>& kernel, int radius ) {
+	// (2*radius+1)^2 weights, row by row from -radius, scaled to sum to one
+	const int size = 2 * radius + 1;
+	kernel.assign(static_cast<size_t>(size) * size, 0.0f);
+
+	if( LensShapes::KernelInput == _params.lensShape ) {
+		if( !usesLensInput() ) {
+			kernel[kernel.size() / 2] = 1.0f;
+			return true;
+		}
+		const DD::Image::Box& kernelBox = input1().info();
+		const int centerX = kernelBox.x() + kernelBox.w() / 2;
+		const int centerY = kernelBox.y() + kernelBox.h() / 2;
+		DD::Image::Row row(kernelBox.x(), kernelBox.r());
+		for( int y = kernelBox.y(); y < kernelBox.t(); ++y ) {
+			input1().get(y, kernelBox.x(), kernelBox.r(), DD::Image::Mask_RGB, row);
+			if( Op::aborted() ) {
+				return false;
+			}
+			const float* red = row[DD::Image::Chan_Red];
+			const float* green = row[DD::Image::Chan_Green];
+			const float* blue = row[DD::Image::Chan_Blue];
+			float* dst = &kernel[static_cast<size_t>(y - centerY + radius) * size] + radius - centerX;
+			for( int x = kernelBox.x(); x < kernelBox.r(); ++x ) {
+				dst[x] = pixelLuminance(red[x], green[x], blue[x]);
+			}
+		}
+	} else {
+		// coverage of the shape, with a one pixel ramp at its edge
+		const float shapeRadius = 0.5f * _params.lensSize;
+		const float cos30 = 0.866025404f;
+		for( int y = -radius; y <= radius; ++y ) {
+			for( int x = -radius; x <= radius; ++x ) {
+				const float ax = fabsf(static_cast<float>(x));
+				const float ay = fabsf(static_cast<float>(y));
+				// flat topped hexagon: its apothem is cos30 of its corner radius
+				const float distance = (LensShapes::Hexagon == _params.lensShape)
+					? ccmath::maximum<float>(ay, ax * cos30 + ay * 0.5f) / cos30
+					: sqrtf(ax * ax + ay * ay);
+				kernel[static_cast<size_t>(y + radius) * size + (x + radius)] = ccmath::clamp<float>(shapeRadius + 0.5f - distance, 0.0f, 1.0f);
+			}
+		}
+	}
+
+	double sum = 0.0;
+	for( size_t i = 0; i < kernel.size(); ++i ) {
+		sum += kernel[i];
+	}
+	if( !(sum > 0.0) ) {
+		warning("Lens kernel has nothing in it; leaving the image unblurred.");
+		kernel.assign(kernel.size(), 0.0f);
+		kernel[kernel.size() / 2] = 1.0f;
+		return true;
+	}
+	const float scale = static_cast<float>(1.0 / sum);
+	for( size_t i = 0; i < kernel.size(); ++i ) {
+		kernel[i] *= scale;
+	}
+	return true;
+}
+
+void Kirei::updateLensSpectrum() {
+	// tiles of at least twice the radius (and not too small, so the fft cost is spread over
+	// enough pixels) plus the spread of the kernel on both sides
+	const int radius = lensRadius();
+	const int size = Fft::goodSize(ccmath::maximum<int>(4 * radius, 2 * radius + 128));
+
+	DD::Image::Hash hash;
+	hash.append(_params.lensShape);
+	hash.append(_params.lensSize);
+	hash.append(size);
+	if( usesLensInput() ) {
+		hash.append(input1().hash());
+	}
+	if( _lensSpectrum.size == size && _lensSpectrum.radius == radius && _lensSpectrum.hash == hash && !_lensSpectrum.data.empty() ) {
+		return;
+	}
+
+	std::vector<float> kernel;
+	if( !buildLensKernel(kernel, radius) ) {
+		_lensSpectrum.data.clear();
+		return;
+	}
+
+	// the kernel is wrapped round the origin, and the 1/n^2 of the inverse transform folded in
+	_lensFft.setSize(size);
+	_lensSpectrum.data.assign(static_cast<size_t>(size) * size, Fft::Complex(0.0f, 0.0f));
+	const int width = 2 * radius + 1;
+	const float scale = 1.0f / (static_cast<float>(size) * static_cast<float>(size));
+	for( int y = -radius; y <= radius; ++y ) {
+		for( int x = -radius; x <= radius; ++x ) {
+			_lensSpectrum.data[static_cast<size_t>((y + size) % size) * size + (x + size) % size] = kernel[static_cast<size_t>(y + radius) * width + (x + radius)] * scale;
+		}
+	}
+	std::vector<Fft::Complex> scratch;
+	_lensFft.transform2d(&_lensSpectrum.data[0], size, false, scratch);
+	_lensSpectrum.hash = hash;
+	_lensSpectrum.radius = radius;
+	_lensSpectrum.size = size;
+}
+
+void Kirei::tiledConvolve( PlaneFrame& tile, TileWork& work ) {
+	const DD::Image::Box& box = tile.box;
+	const DD::Image::Box& source = work.sourceBox;
+	const int radius = _convolution.radius();
+	const int size = _convolution.size();
+	const int sourceWidth = source.w();
+	const size_t sourceSize = static_cast<size_t>(sourceWidth) * source.h();
+	const size_t planeSize = static_cast<size_t>(box.w()) * box.h();
+	work.rows.resize(size);
+
+	for( size_t p = 0; p < tile.planes.size(); ++p ) {
+		const float* plane = &work.source[p * sourceSize] - source.x();
+		for( int y = box.y(); y < box.t(); ++y ) {
+			for( int k = 0; k < size; ++k ) {
+				// kernel rows run top to bottom
+				work.rows[k] = plane + static_cast<size_t>(ccmath::clamp<int>(y + radius - k, source.y(), source.t() - 1) - source.y()) * sourceWidth;
+			}
+			float* outPtr = &tile.data[p * planeSize + static_cast<size_t>(y - box.y()) * box.w()];
+			_convolution.apply(&work.rows[0], source.x(), source.r(), box.x(), box.r(), outPtr, work.convolution);
+		}
+	}
+}
+
+float Kirei::distortionScale( float radius2, int channel ) const {
+	// red is spread out and blue pulled in by the aberration
+	static const float ABERRATION_SIGNS[3] = { 1.0f, 0.0f, -1.0f };
+	return (1.0f + radius2 * (_params.distortion + radius2 * _params.distortionOuter)) * (1.0f + ABERRATION_SIGNS[channel] * _params.aberration);
+}
+
+void Kirei::updateDistortion() {
+	if( FilterTypes::LensDistortion != _spatialType ) {
+		_distortionTable.pad = 0;
+		return;
+	}
 
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
+	// squared radii out to the bbox's furthest corner, relative to half the format's width
+	const DD::Image::Box& bbox = input0().info();
+	const double centreX = _params.formatX + 0.5 * _params.formatWidth;
+	const double centreY = _params.formatY + 0.5 * _params.formatHeight;
+	const double reachX = ccmath::maximum<double>(fabs(bbox.x() - centreX), fabs(bbox.r() - centreX));
+	const double reachY = ccmath::maximum<double>(fabs(bbox.y() - centreY), fabs(bbox.t() - centreY));
+	const double norm = 0.5 * _params.formatWidth;
+	const double furthest2 = (reachX * reachX + reachY * reachY) / (norm * norm);
+
+	DD::Image::Hash hash;
+	hash.append(_params.distortion);
+	hash.append(_params.distortionOuter);
+	hash.append(_params.aberration);
+	hash.append(furthest2);
+	hash.append(bbox.w());
+	hash.append(bbox.h());
+	if( hash == _distortionTable.hash && !_distortionTable.scales.empty() ) {
+		return;
+	}
+
+	// the step past the last entry is there for interpolating at the corner itself
+	const double step = (furthest2 > 0.0) ? furthest2 / DISTORTION_STEPS : 1.0;
+	_distortionTable.scales.resize(3 * (DISTORTION_STEPS + 2));
+	for( int c = 0; c < 3; ++c ) {
+		float* scales = &_distortionTable.scales[c * (DISTORTION_STEPS + 2)];
+		for( int i = 0; i < DISTORTION_STEPS + 2; ++i ) {
+			scales[i] = distortionScale(static_cast<float>(step * i), c);
+		}
+	}
+	_distortionTable.invStep = static_cast<float>(1.0 / step);
+	_distortionTable.hash = hash;
+
+	// the most any pixel moves sets the pad.  it may peak a little between entries, which the
+	// extra pixels cover along with the bilinear footprint.  a pad beyond the bbox's size would
+	// only read clamped edges.
+	double moved = 0.0;
+	for( int c = 0; c < 3; ++c ) {
+		const float* scales = &_distortionTable.scales[c * (DISTORTION_STEPS + 2)];
+		for( int i = 0; i <= DISTORTION_STEPS; ++i ) {
+			moved = ccmath::maximum<double>(moved, norm * sqrt(step * i) * fabs(scales[i] - 1.0));
+		}
+	}
+	// nans and infinities from silly settings get the largest pad too
+	const double largest = ccmath::maximum<int>(bbox.w(), bbox.h());
+	_distortionTable.pad = static_cast<int>((moved < largest) ? ceil(moved) + 2.0 : largest);
+}
 
-		while( rIn < end ) {
-			const float r = *rIn++;
-			const float g = *gIn++;
-			const float b = *bIn++;
-			*rOut++= *gOut++= *bOut++= (pixelLuminance(r, g, b) < _thresholdLuminanceLimit) ? 0.0f : 1.0f;
+void Kirei::distortionSource( const PlaneFrame& tile, TileWork& work ) {
+	// per channel and pixel of the tile, where it reads from.  pixel centres are at +0.5, and
+	// positions off the bbox are clamped to its edges like the other neighbourhood filters.  the
+	// tile fetches only the input its positions and their bilinear footprints cover.
+	const DD::Image::Box& box = tile.box;
+	const DD::Image::Box& bbox = input0().info();
+	const DistortionTable& table = _distortionTable;
+	const float centreX = static_cast<float>(_params.formatX + 0.5 * _params.formatWidth);
+	const float centreY = static_cast<float>(_params.formatY + 0.5 * _params.formatHeight);
+	const float invNorm = 2.0f / static_cast<float>(_params.formatWidth);
+	const float low[2] = { static_cast<float>(bbox.x()), static_cast<float>(bbox.y()) };
+	const float high[2] = { static_cast<float>(bbox.r() - 1), static_cast<float>(bbox.t() - 1) };
+	const size_t planeSize = static_cast<size_t>(box.w()) * box.h();
+	work.positions.resize(6 * planeSize);
+
+	// x then y per channel, and the box they span
+	float bounds[4] = { high[0], high[1], low[0], low[1] };
+	for( int c = 0; c < 3; ++c ) {
+		const float* scales = &table.scales[c * (DISTORTION_STEPS + 2)];
+		float* xs = &work.positions[2 * c * planeSize];
+		float* ys = xs + planeSize;
+		for( int y = box.y(); y < box.t(); ++y ) {
+			const size_t offset = static_cast<size_t>(y - box.y()) * box.w();
+			Remap::radial(scales, DISTORTION_STEPS, table.invStep, centreX, centreY, invNorm, box.x(), y, box.w(), low, high, xs + offset, ys + offset, bounds);
 		}
 	}
+
+	const int left = static_cast<int>(bounds[0]);
+	const int bottom = static_cast<int>(bounds[1]);
+	work.sourceBox.set(left, bottom, ccmath::minimum<int>(static_cast<int>(bounds[2]) + 1, bbox.r() - 1) + 1, ccmath::minimum<int>(static_cast<int>(bounds[3]) + 1, bbox.t() - 1) + 1);
+}
+
+void Kirei::tiledDistort( PlaneFrame& tile, TileWork& work ) {
+	// a bilinear read of every plane of each channel at the positions distortionSource found
+	const DD::Image::Box& box = tile.box;
+	const DD::Image::Box& source = work.sourceBox;
+	const size_t sourceSize = static_cast<size_t>(source.w()) * source.h();
+	const size_t planeSize = static_cast<size_t>(box.w()) * box.h();
+
+	for( size_t p = 0; p < tile.planes.size(); ++p ) {
+		const int c = DD::Image::colourIndex(tile.planes[p]);
+		const float* xs = &work.positions[2 * c * planeSize];
+		Remap::bilinear(&work.source[p * sourceSize], source.w(), source.h(), static_cast<float>(source.x()), static_cast<float>(source.y()),
+			xs, xs + planeSize, static_cast<int>(planeSize), &tile.data[p * planeSize]);
+	}
 }
 
-void Kirei::sepia( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	// http://stackoverflow.com/questions/1061093/how-is-a-sepia-tone-created
+void Kirei::stack( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
+	// with a neighbourhood filter at the end, the point stage is applied to its input rows as
+	// they are fetched; otherwise it runs straight from in to out
+	if( FilterTypes::Passthrough != _spatialType ) {
+		spatial(in, y, x, r, channels, out);
+	} else {
+		pointStage(in, y, x, r, channels, out);
+	}
+}
 
+void Kirei::pointStage( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
 	DD::Image::ChannelSet done;
 	foreach(z, channels) {
 		if( done & z ) {
@@ -454,336 +2298,589 @@ void Kirei::sepia( const DD::Image::Row &in, int y, int x, int r, DD::Image::Cha
 		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
 		done += bChan;
 
-		const float* rIn = in[rChan] + x;
-		const float* gIn = in[gChan] + x;
-		const float* bIn = in[bChan] + x;
-		const float* end = rIn + (r - x);
-
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
-
-		while( rIn < end ) {
-			const float r = *rIn++;
-			const float g = *gIn++;
-			const float b = *bIn++;
-
-			*rOut++= ccmath::minimum<float>((r * 0.393f) + (g * 0.769f) + (b * 0.189f), 1.0f);
-			*gOut++= ccmath::minimum<float>((r * 0.349f) + (g * 0.686f) + (b * 0.168f), 1.0f);
-			*bOut++= ccmath::minimum<float>((r * 0.272f) + (g * 0.534f) + (b * 0.131f), 1.0f);
-		}
+		out.copy(in, rChan, x, r);
+		out.copy(in, gChan, x, r);
+		out.copy(in, bChan, x, r);
+		applyStack(out.writable(rChan), out.writable(gChan), out.writable(bChan), y, x, r);
 	}
 }
 
-void Kirei::blur( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	const DD::Image::Tile tile(input0(), x - _blurSize, y - _blurSize, r + _blurSize, y + _blurSize, channels);
-	if( Op::aborted() ) {
+void Kirei::spatial( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
+	if( isTiled() ) {
+		tiled(in, y, x, r, channels, out);
 		return;
 	}
 
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
-			continue;
+	switch( _spatialType ) {
+		case FilterTypes::Blur: {
+			blur(in, y, x, r, channels, out);
+			break;
 		}
 
-		if( DD::Image::colourIndex(z) >= 3 ) {
-			out.copy(in, z, x, r);
-			continue;
+		case FilterTypes::GaussianBlur: {
+			gaussianBlur(in, y, x, r, channels, out);
+			break;
 		}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
-
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
-
-		for( int currX = x; currX < r; ++currX ) {
-			float red = 0.0f;
-			float green = 0.0f;
-			float blue = 0.0f;
-			int count = 0;
-			for( int px = -_blurSize; px <= _blurSize; ++px ) {
-				for( int py = -_blurSize; py <= _blurSize; ++py ) {
-					red += tile[rChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					green += tile[gChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					blue += tile[bChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					count += 1;
-				}
-			}
-			if( count != 0 ) {
-				red /= static_cast<float>(count);
-				green /= static_cast<float>(count);
-				blue /= static_cast<float>(count);
-			}
-
-			*rOut++= red;
-			*gOut++= green;
-			*bOut++= blue;
+		default: {
+			convolve(in, y, x, r, channels, out);
 		}
 	}
 }
 
-void Kirei::sharpen( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	// http://cis.k.hosei.ac.jp/~wakahara/sharpen.c
+void Kirei::buildStack( const int* types, int count, std::vector<StackStep>& steps, int& spatialType ) {
+	// point ops have to come first, so that they can be applied to the rows the single
+	// neighbourhood filter at the end reads
+	for( int i = 0; i < count; ++i ) {
+		const int type = types[i];
+		if( FilterTypes::Passthrough == type || FilterTypes::Stack == type ) {
+			continue;
+		}
 
-	const DD::Image::Tile tile(input0(), x - 1, y - 1, r + 1, y + 1, channels);
-	if( Op::aborted() ) {
-		return;
-	}
+		if( FilterTypes::Passthrough != spatialType ) {
+			error("Stack slot %d comes after the neighbourhood filter; only point filters may come before one neighbourhood filter.", i + 1);
+			steps.clear();
+			spatialType = FilterTypes::Passthrough;
+			return;
+		}
 
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
+		if( isSpatial(type) ) {
+			spatialType = type;
 			continue;
 		}
 
-		if( DD::Image::colourIndex(z) >= 3 ) {
-			out.copy(in, z, x, r);
-			continue;
+		// express linear colour ops as rows of r' = m0*r + m1*g + m2*b + m3
+		StackStep step;
+		step.type = FilterTypes::Passthrough;
+		step.clampLow = false;
+		step.clampHigh = false;
+		step.apply = nullptr;
+		const float identity[12] = { 1.0f, 0.0f, 0.0f, 0.0f,  0.0f, 1.0f, 0.0f, 0.0f,  0.0f, 0.0f, 1.0f, 0.0f };
+		for( int m = 0; m < 12; ++m ) {
+			step.matrix[m] = identity[m];
 		}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
+		switch( type ) {
+			case FilterTypes::Invert: {
+				const float matrix[12] = { -1.0f, 0.0f, 0.0f, 1.0f,  0.0f, -1.0f, 0.0f, 1.0f,  0.0f, 0.0f, -1.0f, 1.0f };
+				for( int m = 0; m < 12; ++m ) {
+					step.matrix[m] = matrix[m];
+				}
+				break;
+			}
 
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
+			case FilterTypes::Sepia: {
+				const float matrix[12] = { 0.393f, 0.769f, 0.189f, 0.0f,  0.349f, 0.686f, 0.168f, 0.0f,  0.272f, 0.534f, 0.131f, 0.0f };
+				for( int m = 0; m < 12; ++m ) {
+					step.matrix[m] = matrix[m];
+				}
+				step.clampHigh = true;
+				break;
+			}
 
-		const float kernel[3][3] = {
-			{1.0f,  1.0f, 1.0f},
-			{1.0f, -8.0f, 1.0f},
-			{1.0f,  1.0f, 1.0f}
-		};
+			case FilterTypes::Temperature: {
+				// gains from the frame statistics are not known until render time
+				if( BalanceModes::Kelvin != _params.balanceMode ) {
+					step.type = type;
+					steps.push_back(step);
+					continue;
+				}
+				temperatureGains(step.matrix[0], step.matrix[5], step.matrix[10]);
+				break;
+			}
 
-		for( int currX = x; currX < r; ++currX ) {
-			float red = 0.0f;
-			float green = 0.0f;
-			float blue = 0.0f;
-			for( int px = -1; px <= 1; ++px ) {
-				for( int py = -1; py <= 1; ++py ) {
-					red   += kernel[px+1][py+1] * tile[rChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					green += kernel[px+1][py+1] * tile[gChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					blue  += kernel[px+1][py+1] * tile[bChan][tile.clampy(y + py)][tile.clampx(currX + px)];
+			case FilterTypes::ChannelMixer: {
+				const float a = _params.channelMixerBGIntoRed;
+				const float b = _params.channelMixerRBIntoGreen;
+				const float c = _params.channelMixerGRIntoBlue;
+				const float matrix[12] = {
+					1.0f - a, a * _params.channelMixerBlueGreen, a * (1.0f - _params.channelMixerBlueGreen), 0.0f,
+					b * (1.0f - _params.channelMixerRedBlue), 1.0f - b, b * _params.channelMixerRedBlue, 0.0f,
+					c * _params.channelMixerGreenRed, c * (1.0f - _params.channelMixerGreenRed), 1.0f - c, 0.0f
+				};
+				for( int m = 0; m < 12; ++m ) {
+					step.matrix[m] = matrix[m];
 				}
+				step.clampLow = true;
+				step.clampHigh = true;
+				break;
 			}
 
-			*rOut++= tile[rChan][tile.clampy(y)][tile.clampx(currX)] - (red * _sharpenStrength);
-			*gOut++= tile[gChan][tile.clampy(y)][tile.clampx(currX)] - (green * _sharpenStrength);
-			*bOut++= tile[bChan][tile.clampy(y)][tile.clampx(currX)] - (blue * _sharpenStrength);
+			default: {
+				// threshold, vignette and grain are not linear in the colour, so they stay separate steps
+				step.type = type;
+				steps.push_back(step);
+				continue;
+			}
 		}
-	}
-}
 
-void Kirei::edgeEnhance( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	const DD::Image::Tile tile(input0(), x - 1, y - 1, r + 1, y + 1, channels);
-	if( Op::aborted() ) {
-		return;
+		// fold into the previous matrix if there is one: previous then this is this * previous.  a
+		// clamp only happens at the end of a folded run, so a step that clamps ends its run
+		if( !steps.empty() && FilterTypes::Passthrough == steps.back().type && !steps.back().clampLow && !steps.back().clampHigh ) {
+			StackStep& prev = steps.back();
+			float folded[12];
+			for( int row = 0; row < 3; ++row ) {
+				for( int col = 0; col < 4; ++col ) {
+					float value = (3 == col) ? step.matrix[row * 4 + 3] : 0.0f;
+					for( int k = 0; k < 3; ++k ) {
+						value += step.matrix[row * 4 + k] * prev.matrix[k * 4 + col];
+					}
+					folded[row * 4 + col] = value;
+				}
+			}
+			for( int m = 0; m < 12; ++m ) {
+				prev.matrix[m] = folded[m];
+			}
+			prev.clampLow = step.clampLow;
+			prev.clampHigh = step.clampHigh;
+		} else {
+			steps.push_back(step);
+		}
 	}
 
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
-			continue;
+	for( size_t i = 0; i < steps.size(); ++i ) {
+		StackStep& step = steps[i];
+		if( FilterTypes::Threshold == step.type ) {
+			step.apply = &Kirei::kernelStep<ThresholdKernel>;
+		} else if( FilterTypes::Vignette == step.type ) {
+			step.apply = &Kirei::kernelStep<VignetteKernel>;
+		} else if( FilterTypes::Grain == step.type ) {
+			step.apply = &Kirei::kernelStep<GrainKernel>;
+		} else if( FilterTypes::Temperature == step.type ) {
+			step.apply = &Kirei::kernelStep<TemperatureKernel>;
+		} else if( step.clampLow ) {
+			step.apply = step.clampHigh ? &Kirei::affineStep<true, true> : &Kirei::affineStep<true, false>;
+		} else {
+			step.apply = step.clampHigh ? &Kirei::affineStep<false, true> : &Kirei::affineStep<false, false>;
 		}
+	}
+}
 
-		if( DD::Image::colourIndex(z) >= 3 ) {
-			out.copy(in, z, x, r);
-			continue;
-		}
+void Kirei::applyStack( float* rPtr, float* gPtr, float* bPtr, int y, int x, int r ) const {
+	if( !_stackSteps.empty() ) {
+		applySteps(&_stackSteps[0], _stackSteps.size(), rPtr, gPtr, bPtr, y, x, r);
+	}
+}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
+void Kirei::applySteps( const StackStep* steps, size_t count, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r ) const {
+	// rPtr, gPtr and bPtr are indexed by absolute x and processed in place over [x, r)
+	for( size_t i = 0; i < count; ++i ) {
+		steps[i].apply(*this, steps[i], rPtr, gPtr, bPtr, y, x, r);
+	}
+}
 
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
+template<class Kernel>
+void Kirei::kernelStep( const Kirei& kirei, const StackStep& step, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r ) {
+	const Kernel kernel(kirei, y);
+	kernel(rPtr + x, gPtr + x, bPtr + x, rPtr + x, gPtr + x, bPtr + x, x, r - x);
+}
 
-		const float kernel[3][3] = {
-			{0.0f,  1.0f, 0.0f},
-			{-1.0f * _edgeEnhanceStrength, 1.0f * _edgeEnhanceStrength, 0.0f},
-			{0.0f,  0.0f, 0.0f}
+template<bool CLAMP_LOW, bool CLAMP_HIGH>
+void Kirei::affineStep( const Kirei& kirei, const StackStep& step, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r ) {
+	const float* m = step.matrix;
+	for( int currX = x; currX < r; ++currX ) {
+		const float red = rPtr[currX];
+		const float green = gPtr[currX];
+		const float blue = bPtr[currX];
+		float values[3] = {
+			m[0] * red + m[1] * green + m[2]  * blue + m[3],
+			m[4] * red + m[5] * green + m[6]  * blue + m[7],
+			m[8] * red + m[9] * green + m[10] * blue + m[11]
 		};
-
-		for( int currX = x; currX < r; ++currX ) {
-			float red = 0.0f;
-			float green = 0.0f;
-			float blue = 0.0f;
-			for( int px = -1; px <= 1; ++px ) {
-				for( int py = -1; py <= 1; ++py ) {
-					red   += kernel[px+1][py+1] * tile[rChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					green += kernel[px+1][py+1] * tile[gChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					blue  += kernel[px+1][py+1] * tile[bChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-				}
+		for( int c = 0; c < 3; ++c ) {
+			if( CLAMP_LOW && values[c] < 0.0f ) {
+				values[c] = 0.0f;
+			}
+			if( CLAMP_HIGH && values[c] > 1.0f ) {
+				values[c] = 1.0f;
 			}
-
-			*rOut++= red;
-			*gOut++= green;
-			*bOut++= blue;
 		}
+		rPtr[currX] = values[0];
+		gPtr[currX] = values[1];
+		bPtr[currX] = values[2];
 	}
 }
 
-void Kirei::temperature( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
-			continue;
+void Kirei::lutStep( const Kirei& kirei, const StackStep& step, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r ) {
+	step.lut->apply(rPtr + x, gPtr + x, bPtr + x, r - x);
+}
+
+void Kirei::applyLutMode( std::vector<StackStep>& steps ) {
+	if( LutModes::Bake == _lutMode ) {
+		if( !(_lutDomainMax > _lutDomainMin) ) {
+			error("The LUT domain is empty.");
+			return;
+		}
+		// every run of colour steps between vignettes (and steps driven by frame statistics) becomes one lut
+		std::vector<StackStep> baked;
+		size_t start = 0;
+		for( size_t i = 0; i <= steps.size(); ++i ) {
+			if( i < steps.size() && isBakeable(steps[i]) ) {
+				continue;
+			}
+			if( i > start ) {
+				StackStep step;
+				step.type = LUT_STEP;
+				step.apply = &Kirei::lutStep;
+				step.lut = bakeLut(&steps[start], i - start);
+				baked.push_back(step);
+			}
+			if( i < steps.size() ) {
+				baked.push_back(steps[i]);
+			}
+			start = i + 1;
+		}
+		steps.swap(baked);
+	} else if( LutModes::Import == _lutMode ) {
+		if( !importLut() ) {
+			return;
+		}
+		// the file stands in for all of the colour steps, ahead of any vignette or grain
+		std::vector<StackStep> imported(1);
+		imported[0].type = LUT_STEP;
+		imported[0].lut = _lutImported;
+		imported[0].apply = &Kirei::lutStep;
+		for( size_t i = 0; i < steps.size(); ++i ) {
+			if( FilterTypes::Vignette == steps[i].type || FilterTypes::Grain == steps[i].type ) {
+				imported.push_back(steps[i]);
+			}
 		}
+		steps.swap(imported);
+	}
+}
 
-		if( DD::Image::colourIndex(z) >= 3 ) {
-			out.copy(in, z, x, r);
-			continue;
+std::shared_ptr<ColorLut> Kirei::bakeLut( const StackStep* steps, size_t count ) const {
+	const int size = LUT_SIZE_VALUES[ccmath::clamp<int>(_lutSize, 0, 1)];
+	std::shared_ptr<ColorLut> lut(new ColorLut());
+	lut->resize(size);
+	const float domainMin[3] = { _lutDomainMin, _lutDomainMin, _lutDomainMin };
+	const float domainMax[3] = { _lutDomainMax, _lutDomainMax, _lutDomainMax };
+	lut->setDomain(domainMin, domainMax);
+
+	// one line of the lattice along red at a time, through the same code as the unbaked steps
+	std::vector<float> line(3 * size);
+	float* red = &line[0];
+	float* green = red + size;
+	float* blue = green + size;
+	for( int b = 0; b < size; ++b ) {
+		for( int g = 0; g < size; ++g ) {
+			for( int r = 0; r < size; ++r ) {
+				red[r] = lut->latticeValue(0, r);
+				green[r] = lut->latticeValue(1, g);
+				blue[r] = lut->latticeValue(2, b);
+			}
+			applySteps(steps, count, red, green, blue, 0, 0, size);
+			for( int r = 0; r < size; ++r ) {
+				lut->set(r, g, b, red[r], green[r], blue[r]);
+			}
 		}
+	}
+	return lut;
+}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
+bool Kirei::importLut() {
+	// parsing a 65^3 file is slow, so it is only reloaded when the path or the file changes
+	long long time = 0;
+	if( !fileTime(_lutFile, time) ) {
+		error("Cannot read LUT file '%s'.", _lutFile ? _lutFile : "");
+		_lutImported.reset();
+		return false;
+	}
+	if( _lutImported && _lutImportedPath == _lutFile && _lutImportedTime == time ) {
+		return true;
+	}
 
-		const float* rIn = in[rChan] + x;
-		const float* gIn = in[gChan] + x;
-		const float* bIn = in[bChan] + x;
-		const float* end = rIn + (r - x);
+	std::shared_ptr<ColorLut> lut(new ColorLut());
+	std::string message;
+	if( !lut->load(_lutFile, message) ) {
+		error("%s", message.c_str());
+		_lutImported.reset();
+		return false;
+	}
+	_lutImported = lut;
+	_lutImportedPath = _lutFile;
+	_lutImportedTime = time;
+	return true;
+}
 
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
+void Kirei::exportLut() {
+	if( nullptr == _lutExportFile || '\0' == _lutExportFile[0] ) {
+		std::cerr << "Kirei warning: No export file set for the LUT.\n";
+		return;
+	}
 
-		const float blackBodyRGB[] = { 1.0f, 0.0337f, 0.0f, 1.0f, 0.0592f, 0.0f, 1.0f, 0.0846f, 0.0f, 1.0f, 0.1096f, 0.0f, 1.0f, 0.1341f, 0.0f, 1.0f, 0.1578f, 0.0f, 1.0f, 0.1806f, 0.0f, 1.0f, 0.2025f, 0.0f, 1.0f, 0.2235f, 0.0f, 1.0f, 0.2434f, 0.0f, 1.0f, 0.2647f, 0.0033f, 1.0f, 0.2889f, 0.012f, 1.0f, 0.3126f, 0.0219f, 1.0f, 0.336f, 0.0331f, 1.0f, 0.3589f, 0.0454f, 1.0f, 0.3814f, 0.0588f, 1.0f, 0.4034f, 0.0734f, 1.0f, 0.425f, 0.0889f, 1.0f, 0.4461f, 0.1054f, 1.0f, 0.4668f, 0.1229f, 1.0f, 0.487f, 0.1411f, 1.0f, 0.5067f, 0.1602f, 1.0f, 0.5259f, 0.18f, 1.0f, 0.5447f, 0.2005f, 1.0f, 0.563f, 0.2216f, 1.0f, 0.5809f, 0.2433f, 1.0f, 0.5983f, 0.2655f, 1.0f, 0.6153f, 0.2881f, 1.0f, 0.6318f, 0.3112f, 1.0f, 0.648f, 0.3346f, 1.0f, 0.6636f, 0.3583f, 1.0f, 0.6789f, 0.3823f, 1.0f, 0.6938f, 0.4066f, 1.0f, 0.7083f, 0.431f, 1.0f, 0.7223f, 0.4556f, 1.0f, 0.736f, 0.4803f, 1.0f, 0.7494f, 0.5051f, 1.0f, 0.7623f, 0.5299f, 1.0f, 0.775f, 0.5548f, 1.0f, 0.7872f, 0.5797f, 1.0f, 0.7992f, 0.6045f, 1.0f, 0.8108f, 0.6293f, 1.0f, 0.8221f, 0.6541f, 1.0f, 0.833f, 0.6787f, 1.0f, 0.8437f, 0.7032f, 1.0f, 0.8541f, 0.7277f, 1.0f, 0.8642f, 0.7519f, 1.0f, 0.874f, 0.776f, 1.0f, 0.8836f, 0.8f, 1.0f, 0.8929f, 0.8238f, 1.0f, 0.9019f, 0.8473f, 1.0f, 0.9107f, 0.8707f, 1.0f, 0.9193f, 0.8939f, 1.0f, 0.9276f, 0.9168f, 1.0f, 0.9357f, 0.9396f, 1.0f, 0.9436f, 0.9621f, 1.0f, 0.9513f, 0.9844f, 0.9937f, 0.9526f, 1.0f, 0.9726f, 0.9395f, 1.0f, 0.9526f, 0.927f, 1.0f, 0.9337f, 0.915f, 1.0f, 0.9157f, 0.9035f, 1.0f, 0.8986f, 0.8925f, 1.0f, 0.8823f, 0.8819f, 1.0f, 0.8668f, 0.8718f, 1.0f, 0.852f, 0.8621f, 1.0f, 0.8379f, 0.8527f, 1.0f, 0.8244f, 0.8437f, 1.0f, 0.8115f, 0.8351f, 1.0f, 0.7992f, 0.8268f, 1.0f, 0.7874f, 0.8187f, 1.0f, 0.7761f, 0.811f, 1.0f, 0.7652f, 0.8035f, 1.0f, 0.7548f, 0.7963f, 1.0f, 0.7449f, 0.7894f, 1.0f, 0.7353f, 0.7827f, 1.0f, 0.726f, 0.7762f, 1.0f, 0.7172f, 0.7699f, 1.0f, 0.7086f, 0.7638f, 1.0f, 0.7004f, 0.7579f, 1.0f, 0.6925f, 0.7522f, 1.0f, 0.6848f, 0.7467f, 1.0f, 0.6774f, 0.7414f, 1.0f, 0.6703f, 0.7362f, 1.0f, 0.6635f, 0.7311f, 1.0f, 0.6568f, 0.7263f, 1.0f, 0.6504f, 0.7215f, 1.0f, 0.6442f, 0.7169f, 1.0f, 0.6382f, 0.7124f, 1.0f, 0.6324f, 0.7081f, 1.0f, 0.6268f, 0.7039f, 1.0f };
+	if( !(_lutDomainMax > _lutDomainMin) ) {
+		std::cerr << "Kirei warning: The LUT domain is empty.\n";
+		return;
+	}
 
-		while( rIn < end ) {
-			const float r = *rIn++;
-			const float g = *gIn++;
-			const float b = *bIn++;
+	// the colour filters as they would run now, whatever the lut mode
+	std::vector<StackStep> steps;
+	int spatialType = FilterTypes::Passthrough;
+	if( FilterTypes::Stack == _params.filterType ) {
+		buildStack(_params.stack, STACK_SIZE, steps, spatialType);
+	} else if( !isSpatial(_params.filterType) ) {
+		buildStack(&_params.filterType, 1, steps, spatialType);
+	}
+	std::vector<StackStep> colour;
+	for( size_t i = 0; i < steps.size(); ++i ) {
+		if( FilterTypes::Vignette == steps[i].type || FilterTypes::Grain == steps[i].type ) {
+			std::cerr << "Kirei warning: Vignette and grain depend on position and are left out of the exported LUT.\n";
+		} else if( !isBakeable(steps[i]) ) {
+			std::cerr << "Kirei warning: Automatic threshold and white balance depend on the frame and are left out of the exported LUT.\n";
+		} else {
+			colour.push_back(steps[i]);
+		}
+	}
 
-			_temperature = ccmath::maximum<float>(1000.0f, ccmath::minimum<float>(10000.0f, _temperature));
-			const int t = 3 * static_cast<int>((_temperature - 1000.0f) / 100.0f);
-			float rFactor = 1.0f / blackBodyRGB[t];
-			float gFactor = 1.0f / blackBodyRGB[t+1];
-			float bFactor = 1.0f / blackBodyRGB[t+2];
-			const float m = ccmath::maximum<float>(ccmath::maximum<float>(rFactor, gFactor), bFactor);
-			rFactor /= m;
-			gFactor /= m;
-			bFactor /= m;
+	const std::shared_ptr<ColorLut> lut = bakeLut(colour.empty() ? nullptr : &colour[0], colour.size());
+	std::string message;
+	if( !lut->save(_lutExportFile, message) ) {
+		std::cerr << "Kirei warning: " << message << "\n";
+	}
+}
 
-			*rOut++= r * rFactor;
-			*gOut++= g * gFactor;
-			*bOut++= b * bFactor;
-		}
+void Kirei::temperatureGains( float& rFactor, float& gFactor, float& bFactor ) const {
+	if( BalanceModes::Kelvin != _params.balanceMode ) {
+		const float* gains = (BalanceModes::GrayWorld == _params.balanceMode) ? _stats.grayWorld : _stats.whitePatch;
+		rFactor = gains[0];
+		gFactor = gains[1];
+		bFactor = gains[2];
+		return;
 	}
+
+	const float temperature = ccmath::maximum<float>(1000.0f, ccmath::minimum<float>(10000.0f, _params.temperature));
+	const int t = 3 * static_cast<int>((temperature - 1000.0f) / 100.0f);
+	rFactor = 1.0f / BLACK_BODY_RGB[t];
+	gFactor = 1.0f / BLACK_BODY_RGB[t+1];
+	bFactor = 1.0f / BLACK_BODY_RGB[t+2];
+	const float m = ccmath::maximum<float>(ccmath::maximum<float>(rFactor, gFactor), bFactor);
+	rFactor /= m;
+	gFactor /= m;
+	bFactor /= m;
 }
 
-void Kirei::mixChannels( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
-			continue;
+bool Kirei::isBakeable( const StackStep& step ) const {
+	switch( step.type ) {
+		case FilterTypes::Vignette:
+		case FilterTypes::Grain: {
+			return false;
 		}
 
-		if( DD::Image::colourIndex(z) >= 3 ) {
-			out.copy(in, z, x, r);
-			continue;
+		case FilterTypes::Threshold: {
+			return !_params.thresholdAuto;
 		}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
-
-		const float* rIn = in[rChan] + x;
-		const float* gIn = in[gChan] + x;
-		const float* bIn = in[bChan] + x;
-		const float* end = rIn + (r - x);
+		// only left as a separate step when its gains come from the frame
+		case FilterTypes::Temperature: {
+			return false;
+		}
 
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
+		default: {
+			return true;
+		}
+	}
+}
 
-		while( rIn < end ) {
-			const float r = *rIn++;
-			const float g = *gIn++;
-			const float b = *bIn++;
-			const float newRed   = (_channelMixerBGIntoRed   * (_channelMixerBlueGreen * g + (1.0f - _channelMixerBlueGreen) * b) + (1.0f - _channelMixerBGIntoRed)   * r);
-			const float newGreen = (_channelMixerRBIntoGreen * (_channelMixerRedBlue   * b + (1.0f - _channelMixerRedBlue)   * r) + (1.0f - _channelMixerRBIntoGreen) * g);
-			const float newBlue  = (_channelMixerGRIntoBlue  * (_channelMixerGreenRed  * r + (1.0f - _channelMixerGreenRed)  * g) + (1.0f - _channelMixerGRIntoBlue)  * b);
-			*rOut++= ccmath::clamp<float>(newRed, 0.0f, 1.0f);;
-			*gOut++= ccmath::clamp<float>(newGreen, 0.0f, 1.0f);
-			*bOut++= ccmath::clamp<float>(newBlue, 0.0f, 1.0f);
+bool Kirei::usesFrameStats() const {
+	if( _stackSteps.empty() ) {
+		return (FilterTypes::Threshold == _params.filterType && _params.thresholdAuto) || (FilterTypes::Temperature == _params.filterType && BalanceModes::Kelvin != _params.balanceMode);
+	}
+	for( size_t i = 0; i < _stackSteps.size(); ++i ) {
+		const int type = _stackSteps[i].type;
+		if( FilterTypes::Vignette != type && FilterTypes::Grain != type && !isBakeable(_stackSteps[i]) ) {
+			return true;
 		}
 	}
+	return false;
 }
 
-void Kirei::playground( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) {
-	// http://docs.gimp.org/en/plug-in-convmatrix.html
+void Kirei::updateFrameStats() {
+	const DD::Image::Hash& hash = input0().hash();
+	const std::map<unsigned long long, size_t>::const_iterator cached = _statsIndex.find(hash.value());
+	if( cached != _statsIndex.end() ) {
+		_stats = _statsCache[cached->second].stats;
+		return;
+	}
 
-	const DD::Image::Tile tile(input0(), x - 1, y - 1, r + 1, y + 1, channels);
+	FrameStats stats;
+	computeFrameStats(stats);
 	if( Op::aborted() ) {
 		return;
 	}
+	_stats = stats;
+
+	// oldest replaced first; a couple of thousand frames is a long scrub and costs a few tens of kb
+	StatsEntry entry;
+	entry.hash = hash;
+	entry.stats = stats;
+	if( _statsCache.size() < STATS_CACHE_SIZE ) {
+		_statsIndex[hash.value()] = _statsCache.size();
+		_statsCache.push_back(entry);
+		return;
+	}
+	_statsIndex.erase(_statsCache[_statsOldest].hash.value());
+	_statsCache[_statsOldest] = entry;
+	_statsIndex[hash.value()] = _statsOldest;
+	_statsOldest = (_statsOldest + 1) % STATS_CACHE_SIZE;
+}
 
-	DD::Image::ChannelSet done;
-	foreach(z, channels) {
-		if( done & z ) {
-			continue;
-		}
+void Kirei::computeFrameStats( FrameStats& stats ) {
+	stats.threshold = _params.thresholdLuminanceLimit;
+	for( int c = 0; c < 3; ++c ) {
+		stats.grayWorld[c] = 1.0f;
+		stats.whitePatch[c] = 1.0f;
+	}
 
-		if( DD::Image::colourIndex(z) >= 3 ) {
-			out.copy(in, z, x, r);
+	StatsJob job;
+	job.kirei = this;
+	job.box = input0().info();
+	if( job.box.w() <= 0 || job.box.h() <= 0 ) {
+		return;
+	}
+	job.histogram.assign(STATS_BINS, 0.0);
+	for( int c = 0; c < 3; ++c ) {
+		job.sums[c] = 0.0;
+		job.maxima[c] = 0.0f;
+	}
+	job.count = 0.0;
+	const int threads = ccmath::maximum<int>(1, static_cast<int>(DD::Image::Thread::numThreads));
+	DD::Image::Thread::spawn(statsThread, threads, &job);
+	DD::Image::Thread::wait(&job);
+	if( Op::aborted() || !(job.count > 0.0) ) {
+		return;
+	}
+
+	// otsu: the split of the luminance histogram with the largest between-class variance
+	double weighted = 0.0;
+	for( int i = 0; i < STATS_BINS; ++i ) {
+		weighted += static_cast<double>(i) * job.histogram[i];
+	}
+	double below = 0.0;
+	double belowWeighted = 0.0;
+	double best = -1.0;
+	for( int i = 0; i < STATS_BINS - 1; ++i ) {
+		below += job.histogram[i];
+		belowWeighted += static_cast<double>(i) * job.histogram[i];
+		const double above = job.count - below;
+		if( below <= 0.0 || above <= 0.0 ) {
 			continue;
 		}
+		const double difference = belowWeighted / below - (weighted - belowWeighted) / above;
+		const double variance = below * above * difference * difference;
+		if( variance > best ) {
+			best = variance;
+			stats.threshold = static_cast<float>(i + 1) / static_cast<float>(STATS_BINS);
+		}
+	}
 
-		const DD::Image::Channel rChan = DD::Image::brother(z, 0);
-		done += rChan;
-		const DD::Image::Channel gChan = DD::Image::brother(z, 1);
-		done += gChan;
-		const DD::Image::Channel bChan = DD::Image::brother(z, 2);
-		done += bChan;
+	// gray world scales the channel averages to their mean, white patch the maxima to the largest
+	const double mean = (job.sums[0] + job.sums[1] + job.sums[2]) / 3.0;
+	const float brightest = ccmath::maximum<float>(ccmath::maximum<float>(job.maxima[0], job.maxima[1]), job.maxima[2]);
+	for( int c = 0; c < 3; ++c ) {
+		if( job.sums[c] > 0.0 && mean > 0.0 ) {
+			stats.grayWorld[c] = static_cast<float>(mean / job.sums[c]);
+		}
+		if( job.maxima[c] > 0.0f ) {
+			stats.whitePatch[c] = brightest / job.maxima[c];
+		}
+	}
+}
 
-		float* rOut = out.writable(rChan) + x;
-		float* gOut = out.writable(gChan) + x;
-		float* bOut = out.writable(bChan) + x;
+void Kirei::statsThread( unsigned index, unsigned nThreads, void* data ) {
+	// each thread reduces interleaved rows on its own and merges once at the end
+	StatsJob* job = static_cast<StatsJob*>(data);
+	Kirei* kirei = job->kirei;
+	const DD::Image::Box& box = job->box;
+	std::vector<double> histogram(STATS_BINS, 0.0);
+	double sums[3] = { 0.0, 0.0, 0.0 };
+	float maxima[3] = { 0.0f, 0.0f, 0.0f };
+	double count = 0.0;
+
+	DD::Image::Row row(box.x(), box.r());
+	for( int y = box.y() + static_cast<int>(index); y < box.t(); y += static_cast<int>(nThreads) ) {
+		if( kirei->aborted() ) {
+			return;
+		}
+		kirei->input0().get(y, box.x(), box.r(), DD::Image::Mask_RGB, row);
+		const float* red = row[DD::Image::Chan_Red];
+		const float* green = row[DD::Image::Chan_Green];
+		const float* blue = row[DD::Image::Chan_Blue];
+		for( int x = box.x(); x < box.r(); ++x ) {
+			// infinities and nans would swamp the sums, so those pixels are skipped
+			const float rgb[3] = { red[x], green[x], blue[x] };
+			if( !(fabsf(rgb[0]) <= FLT_MAX && fabsf(rgb[1]) <= FLT_MAX && fabsf(rgb[2]) <= FLT_MAX) ) {
+				continue;
+			}
+			const float bin = kirei->pixelLuminance(rgb[0], rgb[1], rgb[2]) * static_cast<float>(STATS_BINS);
+			histogram[ccmath::clamp<int>(static_cast<int>(ccmath::clamp<float>(bin, 0.0f, static_cast<float>(STATS_BINS - 1))), 0, STATS_BINS - 1)] += 1.0;
+			for( int c = 0; c < 3; ++c ) {
+				sums[c] += rgb[c];
+				maxima[c] = ccmath::maximum<float>(maxima[c], rgb[c]);
+			}
+			count += 1.0;
+		}
+	}
 
-		const float kernel[3][3] = {
-			{0.0f,  1.0f, 0.0f},
-			{1.0f, -4.0f, 1.0f},
-			{0.0f,  1.0f, 0.0f}
-		};
+	DD::Image::Guard guard(job->lock);
+	for( int i = 0; i < STATS_BINS; ++i ) {
+		job->histogram[i] += histogram[i];
+	}
+	for( int c = 0; c < 3; ++c ) {
+		job->sums[c] += sums[c];
+		job->maxima[c] = ccmath::maximum<float>(job->maxima[c], maxima[c]);
+	}
+	job->count += count;
+}
 
-		for( int currX = x; currX < r; ++currX ) {
-			float red = 0.0f;
-			float green = 0.0f;
-			float blue = 0.0f;
-			for( int px = -1; px <= 1; ++px ) {
-				for( int py = -1; py <= 1; ++py ) {
-					red   += kernel[px+1][py+1] * tile[rChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					green += kernel[px+1][py+1] * tile[gChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-					blue  += kernel[px+1][py+1] * tile[bChan][tile.clampy(y + py)][tile.clampx(currX + px)];
-				}
-			}
+void Kirei::fetchRow( int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& row ) {
+	input0().get(y, x, r, channels, row);
+	if( _stackSteps.empty() ) {
+		return;
+	}
 
-			*rOut++= red;
-			*gOut++= green;
-			*bOut++= blue;
+	DD::Image::ChannelSet done;
+	foreach(z, channels) {
+		if( DD::Image::colourIndex(z) >= 3 || (done & z) ) {
+			continue;
 		}
+		done.addBrothers(z, 3);
+		applyStack(row.writable(DD::Image::brother(z, 0)), row.writable(DD::Image::brother(z, 1)), row.writable(DD::Image::brother(z, 2)), y, x, r);
+	}
+}
+
+void Kirei::snapshotParams( Params& params ) const {
+	params.filterType = _filterType;
+	params.tiled = _tiled;
+	for( int i = 0; i < STACK_SIZE; ++i ) {
+		params.stack[i] = _stack[i];
 	}
+	params.vignetteRadius = _vignetteRadius;
+	params.vignetteSoftness = _vignetteSoftness;
+	params.thresholdLuminanceLimit = _thresholdLuminanceLimit;
+	params.thresholdAuto = _thresholdAuto;
+	params.blurSize = _blurSize;
+	params.gaussianSigma = _gaussianSigma;
+	params.rankRadius = _rankRadius;
+	params.lensShape = _lensShape;
+	params.lensSize = _lensSize;
+	params.sharpenStrength = _sharpenStrength;
+	params.edgeEnhanceStrength = _edgeEnhanceStrength;
+	params.temperature = _temperature;
+	params.balanceMode = _balanceMode;
+	params.channelMixerBlueGreen = _channelMixerBlueGreen;
+	params.channelMixerBGIntoRed = _channelMixerBGIntoRed;
+	params.channelMixerRedBlue = _channelMixerRedBlue;
+	params.channelMixerRBIntoGreen = _channelMixerRBIntoGreen;
+	params.channelMixerGreenRed = _channelMixerGreenRed;
+	params.channelMixerGRIntoBlue = _channelMixerGRIntoBlue;
+	params.grainAmount = _grainAmount;
+	params.grainSize = _grainSize;
+	params.grainResponse = _grainResponse;
+	params.grainSeed = _grainSeed;
+	params.distortion = _distortion;
+	params.distortionOuter = _distortionOuter;
+	params.aberration = _aberration;
 }
 
 float Kirei::pixelLuminance( const float r, const float g, const float b ) const {
@@ -1,4 +1,14 @@
 #include <DDImage/PixelIop.h>
+#include <DDImage/Thread.h>
+#include <vector>
+#include <map>
+#include <memory>
+#include <string>
+#include "RecursiveGaussian.hpp"
+#include "Convolution.hpp"
+#include "ColorLut.hpp"
+#include "Fft.hpp"
+#include "Grain.hpp"
 
 class Kirei : public DD::Image::PixelIop {
 public:
@@ -7,37 +17,339 @@ public:
 
 	virtual int minimum_inputs() const override;
 	virtual int maximum_inputs() const override;
+	virtual const char* input_label( int input, char* buffer ) const override;
 	virtual void in_channels( int input, DD::Image::ChannelSet& channels ) const override;
 	virtual void _validate( bool for_real ) override;
 	virtual void _request( int x, int y, int r, int t, DD::Image::ChannelMask channels, int count ) override;
+	virtual void _open() override;
 	virtual void knobs( DD::Image::Knob_Callback f ) override;
+	virtual int knob_changed( DD::Image::Knob* k ) override;
+	virtual void append( DD::Image::Hash& hash ) override;
 	virtual void pixel_engine( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) override;
 
 private:
-	void passthrough( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void vignette( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void invert( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void threshold( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void sepia( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	// the row function for the current filter is picked once in _validate
+	typedef void (Kirei::*RowEngine)( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	RowEngine selectEngine() const;
+
+	// point filters are a kernel struct (defined in Kirei.cpp) run by one shared traversal of the colour triplets
+	template<class Kernel> void pointFilter( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	template<class Derived> struct PixelKernel;
+	struct CopyKernel;
+	struct VignetteKernel;
+	struct InvertKernel;
+	struct ThresholdKernel;
+	struct SepiaKernel;
+	struct TemperatureKernel;
+	struct MixKernel;
+	struct GrainKernel;
+
 	void blur( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void sharpen( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void edgeEnhance( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void playground( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void temperature( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
-	void mixChannels( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	void convolve( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	void gaussianBlur( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	void tiled( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	void stack( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	void pointStage( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
+	void spatial( const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out );
 
 private:
 	float pixelLuminance( const float r, const float g, const float b ) const;
 
+private:
+	// copy of the knobs taken at the start of _validate.  everything after it, and every engine
+	// thread, reads only this, so a knob edited mid-render cannot change a frame part way through.
+	// the lut and kernel text are turned into _stackSteps and _convolution there instead.
+	enum { STACK_SIZE = 6 };
+	struct Params {
+		int formatX; // the input's format, which the vignette is relative to
+		int formatY;
+		int formatWidth;
+		int formatHeight;
+		int frame; // whole frame the grain is keyed on
+		int filterType;
+		bool tiled;
+		int stack[STACK_SIZE];
+		float vignetteRadius;
+		float vignetteSoftness;
+		float thresholdLuminanceLimit;
+		bool thresholdAuto;
+		int blurSize;
+		float gaussianSigma;
+		int rankRadius;
+		int lensShape;
+		float lensSize;
+		float sharpenStrength;
+		float edgeEnhanceStrength;
+		float temperature;
+		int balanceMode;
+		float channelMixerBlueGreen;
+		float channelMixerBGIntoRed;
+		float channelMixerRedBlue;
+		float channelMixerRBIntoGreen;
+		float channelMixerGreenRed;
+		float channelMixerGRIntoBlue;
+		float grainAmount;
+		int grainSize;
+		float grainResponse;
+		int grainSeed;
+		float distortion;
+		float distortionOuter;
+		float aberration;
+	};
+	void snapshotParams( Params& params ) const;
+
+private:
+	// builds _convolution from the preset or custom kernel of the current spatial filter
+	void updateConvolution();
+	bool isIdentity() const;
+	bool isVignetteIdentity() const;
+	bool isConvolution() const;
+	bool isRankFilter() const;
+	bool usesLensInput() const;
+	bool usesFrame() const;
+	static bool isSpatial( int filterType );
+
+	// one step of the stack's point stage.  runs of linear colour ops are folded into a single
+	// 3x4 affine matrix, each run ending at an op that clamps; threshold and vignette stay as
+	// their own steps, and LUT_STEP runs a lut.
+	enum { LUT_STEP = -1 };
+	struct StackStep;
+	typedef void (*StepFunction)( const Kirei& kirei, const StackStep& step, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r );
+	struct StackStep {
+		int type;
+		float matrix[12];
+		bool clampLow;
+		bool clampHigh;
+		std::shared_ptr<ColorLut> lut;
+		StepFunction apply; // specialised for the step's type and clamps
+	};
+	template<class Kernel> static void kernelStep( const Kirei& kirei, const StackStep& step, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r );
+	template<bool CLAMP_LOW, bool CLAMP_HIGH> static void affineStep( const Kirei& kirei, const StackStep& step, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r );
+	static void lutStep( const Kirei& kirei, const StackStep& step, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r );
+	void buildStack( const int* types, int count, std::vector<StackStep>& steps, int& spatialType );
+	void applyStack( float* rPtr, float* gPtr, float* bPtr, int y, int x, int r ) const;
+	void applySteps( const StackStep* steps, size_t count, float* rPtr, float* gPtr, float* bPtr, int y, int x, int r ) const;
+
+	// 3d lut versions of the colour steps (everything but vignette)
+	void applyLutMode( std::vector<StackStep>& steps );
+	std::shared_ptr<ColorLut> bakeLut( const StackStep* steps, size_t count ) const;
+	bool importLut();
+	void exportLut();
+	void temperatureGains( float& rFactor, float& gFactor, float& bFactor ) const;
+	bool isBakeable( const StackStep& step ) const;
+
+	// whole-frame statistics behind the automatic threshold and white balance.  they are reduced
+	// over the input bbox once per input hash (in parallel, from _open) and remembered, so
+	// revisited frames cost nothing.
+	struct FrameStats {
+		float threshold;
+		float grayWorld[3];
+		float whitePatch[3];
+	};
+	struct StatsEntry {
+		DD::Image::Hash hash;
+		FrameStats stats;
+	};
+	struct StatsJob {
+		Kirei* kirei;
+		DD::Image::Box box;
+		DD::Image::Lock lock;
+		std::vector<double> histogram;
+		double sums[3];
+		float maxima[3];
+		double count;
+	};
+	enum { STATS_BINS = 1024, STATS_CACHE_SIZE = 2048 };
+	bool usesFrameStats() const;
+	void updateFrameStats();
+	void computeFrameStats( FrameStats& stats );
+	static void statsThread( unsigned index, unsigned nThreads, void* data );
+
+	// reads an input row for a spatial filter, with the stack's point stage already applied
+	void fetchRow( int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& row );
+
+private:
+	// input rows kept across calls, so that a thread moving down one row only fetches the row
+	// entering its window.  row y lives in slot y % capacity and a slot holding another row is
+	// refetched, so rows arriving out of order simply cost a full refetch.
+	struct RowRing {
+		int x;
+		int r;
+		DD::Image::ChannelSet channels;
+		std::vector<DD::Image::Row*> rows;
+		std::vector<int> ys;
+
+		RowRing();
+		~RowRing();
+	private:
+		RowRing( const RowRing& );
+		RowRing& operator=( const RowRing& );
+	};
+	void prepareRowRing( RowRing& ring, int x, int r, DD::Image::ChannelMask channels, int capacity );
+	void clearRowRing( RowRing& ring );
+	const DD::Image::Row& ringRow( RowRing& ring, int y );
+
+	// running column sums of the blur window for one thread's run of consecutive rows
+	struct BlurState {
+		bool inUse;
+		bool valid;
+		int y;
+		int x;
+		int r;
+		int left;
+		int right;
+		DD::Image::ChannelSet channels;
+		std::vector<DD::Image::Channel> planes;
+		std::vector<double> sums;
+		RowRing ring;
+	};
+	BlurState* acquireBlurState( int y, int x, int r, DD::Image::ChannelMask channels );
+	void releaseBlurState( BlurState* state );
+	void resetBlurStates();
+
+	// input rows of the convolution window for one thread's run of consecutive rows
+	struct ConvolveState {
+		bool inUse;
+		int y;
+		RowRing ring;
+		std::vector<const DD::Image::Row*> lines;
+		std::vector<const float*> rows;
+		Convolution::Scratch scratch;
+	};
+	ConvolveState* acquireConvolveState( int y, int left, int right, DD::Image::ChannelMask channels );
+	void releaseConvolveState( ConvolveState* state );
+	void resetConvolveStates();
+
+	// grain of one thread's run of consecutive rows: the running box sums of each channel and
+	// the noise of the last row.  grain is also run from the const stack, so the pool is mutable.
+	struct GrainState {
+		bool inUse;
+		int y;
+		int x;
+		int r;
+		Grain::Window windows[3];
+		std::vector<float> noise;
+	};
+	GrainState* acquireGrainState( int y, int x, int r ) const;
+	void releaseGrainState( GrainState* state ) const;
+	void resetGrainStates();
+
+	// whole (padded) request area of the gaussian, computed once and shared by all rows and
+	// threads.  tiled mode keeps one of these per tile instead.
+	struct PlaneFrame {
+		DD::Image::Hash hash;
+		DD::Image::Box box;
+		DD::Image::ChannelSet channels;
+		std::vector<DD::Image::Channel> planes;
+		std::vector<float> data;
+		DD::Image::Lock lock; // tiled mode: guards ready and the filtering of data
+		bool ready;
+		unsigned long long lastUse; // tiled mode: under _tilesLock
+	};
+	struct PlaneJob {
+		Kirei* kirei;
+		PlaneFrame* frame;
+		int pass;
+	};
+	int gaussianPad() const;
+	int spatialPad() const;
+	bool isTiled() const;
+	void updatePlaneFrame();
+	void planeRow( const PlaneFrame& frame, const DD::Image::Row &in, int y, int x, int r, DD::Image::ChannelMask channels, DD::Image::Row& out ) const;
+	static void planeThread( unsigned index, unsigned nThreads, void* data );
+	void gaussianPass( PlaneFrame& frame, int pass, unsigned index, unsigned nThreads );
+
+	// tiled mode: the output area is cut into tiles on a fixed grid, and the first row to need a
+	// tile fetches its padded piece of the input and filters it.  rows that need a tile being
+	// filtered wait for it.  a couple of rows of finished tiles are kept for the rows that follow,
+	// so memory depends on the width and the pad but not on the height.
+	struct TileWork {
+		bool inUse;
+		DD::Image::Box sourceBox; // input the tile reads, within the input bbox
+		std::vector<float> source;
+		std::vector<float> low;   // median: finite range of each source plane
+		std::vector<float> high;
+		std::vector<float> scratch;
+		std::vector<float> strip;
+		std::vector<float> positions; // distortion: where each pixel of the tile reads from, x then y per channel
+		std::vector<const float*> rows;
+		Convolution::Scratch convolution;
+		std::vector<Fft::Complex> fft;
+		std::vector<Fft::Complex> fftScratch;
+	};
+	int tileWidth() const;
+	int tileHeight() const;
+	std::shared_ptr<PlaneFrame> acquireTile( int tileX, int tileY, DD::Image::ChannelMask channels );
+	bool filterTile( PlaneFrame& tile );
+	bool fetchTileSource( const PlaneFrame& tile, TileWork& work );
+	TileWork* acquireTileWork();
+	void releaseTileWork( TileWork* work );
+	void resetTiles();
+	void tiledBlur( PlaneFrame& tile, const TileWork& work );
+	void tiledRank( PlaneFrame& tile, TileWork& work );
+	void tiledLens( PlaneFrame& tile, TileWork& work );
+
+	// spectrum of the lens blur kernel at the fft size used for its tiles, kept until the
+	// kernel knobs or kernel image change
+	struct LensSpectrum {
+		DD::Image::Hash hash;
+		int radius;
+		int size;
+		std::vector<Fft::Complex> data;
+	};
+	int lensRadius() const;
+	bool buildLensKernel( std::vector<float>& kernel, int radius );
+	void updateLensSpectrum();
+	void tiledConvolve( PlaneFrame& tile, TileWork& work );
+
+	// radial lens distortion with lateral chromatic aberration.  each channel samples the source
+	// at the centre plus the pixel's offset scaled by a polynomial in the squared radius.  the
+	// polynomial is tabled per channel over the squared radii of the bbox, and each pixel
+	// interpolates the table.
+	enum { DISTORTION_STEPS = 1024 };
+	struct DistortionTable {
+		DD::Image::Hash hash;
+		float invStep; // table entries per unit of squared radius
+		int pad;       // furthest any pixel moves, with its bilinear footprint
+		std::vector<float> scales; // DISTORTION_STEPS+2 per channel, from a squared radius of 0
+	};
+	float distortionScale( float radius2, int channel ) const;
+	void updateDistortion();
+	void distortionSource( const PlaneFrame& tile, TileWork& work );
+	void tiledDistort( PlaneFrame& tile, TileWork& work );
+
 public:
 	virtual const char* Class() const override;
 	virtual const char* node_help() const override;
 	static const DD::Image::Iop::Description description;
 
 private:
-	int _inputWidth;
-	int _inputHeight;
+	Params _params;
 	int _filterType;
+	RowEngine _engine;
+
+	// tiled mode
+	enum { TILE_WIDTH = 256, TILE_HEIGHT = 64 };
+	bool _tiled;
+
+	// set in _validate when the settings change nothing, making the node transparent
+	bool _identity;
+
+	// stack
+	int _stack[STACK_SIZE];
+	std::vector<StackStep> _stackSteps;
+	int _spatialType; // neighbourhood filter being run, on its own or at the end of the stack
+
+	// 3d lut
+	int _lutMode;
+	int _lutSize;
+	float _lutDomainMin;
+	float _lutDomainMax;
+	const char* _lutFile;
+	const char* _lutExportFile;
+	std::shared_ptr<ColorLut> _lutImported;
+	std::string _lutImportedPath;
+	long long _lutImportedTime;
 
 	// vignette
 	float _vignetteRadius;
@@ -45,9 +357,52 @@ private:
 
 	// threshold
 	float _thresholdLuminanceLimit;
+	bool _thresholdAuto;
 
 	// blur
 	int _blurSize;
+	std::vector<BlurState*> _blurStates;
+	DD::Image::Lock _blurStatesLock;
+
+	// gaussian blur
+	float _gaussianSigma;
+	RecursiveGaussian _gaussian;
+
+	// median, erode and dilate
+	int _rankRadius;
+
+	// lens blur
+	int _lensShape;
+	float _lensSize;
+	Fft _lensFft;
+	LensSpectrum _lensSpectrum; // built in _open
+
+	// lens distortion
+	float _distortion;
+	float _distortionOuter;
+	float _aberration;
+	DistortionTable _distortionTable; // rebuilt in _validate when the lens knobs, format or bbox change
+
+	// shared frame of the gaussian, built in _open from the area and planes _request asked for
+	DD::Image::Box _planeRequest;
+	bool _planeRequested;
+	DD::Image::ChannelSet _planeChannels;
+	std::shared_ptr<PlaneFrame> _planeFrame;
+	DD::Image::Lock _planeLock;
+
+	// tiles of tiled mode by their corner, all for the hash in _tilesHash
+	std::map<std::pair<int, int>, std::shared_ptr<PlaneFrame> > _tiles;
+	DD::Image::Hash _tilesHash;
+	unsigned long long _tilesClock;
+	DD::Image::Lock _tilesLock;
+	std::vector<TileWork*> _tileWorks;
+	DD::Image::Lock _tileWorksLock;
+
+	// sharpen, edge enhance, playground and custom kernels all run through this
+	Convolution _convolution;
+	const char* _convolveKernel;
+	std::vector<ConvolveState*> _convolveStates;
+	DD::Image::Lock _convolveStatesLock;
 
 	// sharpen
 	float _sharpenStrength;
@@ -57,6 +412,14 @@ private:
 
 	// temperature
 	float _temperature;
+	int _balanceMode;
+
+	// statistics of the current frame, for the automatic threshold and balance
+	bool _statsNeeded;
+	FrameStats _stats; // set in _open
+	std::vector<StatsEntry> _statsCache; // up to STATS_CACHE_SIZE, the oldest replaced once full
+	std::map<unsigned long long, size_t> _statsIndex; // slot of each cached hash
+	size_t _statsOldest;
 
 	// channel mixer
 	float _channelMixerBlueGreen;
@@ -65,4 +428,12 @@ private:
 	float _channelMixerRBIntoGreen;
 	float _channelMixerGreenRed;
 	float _channelMixerGRIntoBlue;
+
+	// grain
+	float _grainAmount;
+	int _grainSize;
+	float _grainResponse;
+	int _grainSeed;
+	mutable std::vector<GrainState*> _grainStates;
+	mutable DD::Image::Lock _grainStatesLock;
 };
\ No newline at end of file
@@ -0,0 +1,127 @@
+import os
+import subprocess
+import sys
+import tempfile
+import time
+import nuke
+
+# Benchmarks for Kirei, run from a terminal.  Every render runs in a fresh NUKE so that its peak memory is its own.
+#   nuke -t KireiBenchmark.py                     neighbourhood filters row by row and tiled at 2K, 4K and 8K
+#   nuke -t KireiBenchmark.py --threads 1,2,4,8   every filter at 4K on each thread count, with its speed-up over the first
+
+SIZES = [('2K', 2048, 1556), ('4K', 4096, 3112), ('8K', 8192, 6224)]
+SETTINGS = {
+	'Blur': {'blur_size': 10},
+	'Sharpen': {'sharpen_strength': 1.0},
+	'Edge Enhance': {'edge_enhance_strength': 1.0},
+	'Gaussian Blur': {'gaussian_sigma': 10.0},
+	'Convolve': {'convolve_kernel': '1 2 1\n2 4 2\n1 2 1'},
+	'Median': {'rank_radius': 5},
+	'Erode': {'rank_radius': 5},
+	'Dilate': {'rank_radius': 5},
+	'Lens Blur': {'lens_size': 41.0},
+	'Grain': {'grain_amount': 0.1, 'grain_size': 2},
+	'Lens Distortion': {'distortion': 0.2, 'aberration': 0.02}
+}
+TILED_FILTERS = ['Blur', 'Sharpen', 'Median', 'Lens Blur', 'Lens Distortion']
+ALL_FILTERS = ['Vignette', 'Invert', 'Threshold', 'Sepia', 'Blur', 'Sharpen', 'Edge Enhance', 'Temperature', 'Channel Mixer', 'Playground',
+	'Gaussian Blur', 'Convolve', 'Median', 'Erode', 'Dilate', 'Lens Blur', 'Grain', 'Lens Distortion']
+
+def peak_memory_mb():
+	"""Peak resident memory of this process in megabytes, or None where it cannot be read."""
+	try:
+		import resource
+	except ImportError:
+		return None
+	peak = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+	# linux reports kilobytes, mac bytes
+	if sys.platform == 'darwin':
+		return peak / (1024.0 * 1024.0)
+	return peak / 1024.0
+#end
+
+def render_one(size_index, filter_name, tiled):
+	"""Renders one frame of one configuration in this process and prints its time and peak memory."""
+	name, width, height = SIZES[size_index]
+
+	bench_format = nuke.addFormat('%d %d 1 kirei_bench_%s' % (width, height, name))
+	source = nuke.nodes.CheckerBoard2(format=bench_format.name())
+	kirei = nuke.nodes.Kirei(inputs=[source])
+	kirei['filter_type'].setValue(filter_name)
+	kirei['tiled'].setValue(tiled)
+	for knob, value in SETTINGS.get(filter_name, {}).items():
+		kirei[knob].setValue(value)
+	#end
+
+	# uncompressed, so the write costs the same in every mode
+	file_name = os.path.join(tempfile.gettempdir(), 'kirei_bench.exr').replace('\\', '/')
+	write = nuke.nodes.Write(inputs=[kirei], file=file_name, file_type='exr')
+	write['compression'].setValue('none')
+
+	start = time.time()
+	nuke.execute(write, 1, 1)
+	seconds = time.time() - start
+	peak = peak_memory_mb()
+	print 'RESULT %.3f %s' % (seconds, ('%.0f' % peak) if peak is not None else 'n/a')
+#end
+
+def render_child(size_index, filter_name, tiled, threads=None):
+	"""Runs render_one in a fresh NUKE, returning (seconds, peak MB) or None if it failed."""
+	args = [nuke.EXE_PATH]
+	if threads is not None:
+		args += ['-m', str(threads)]
+	args += ['-t', os.path.abspath(__file__), '--one', str(size_index), filter_name, str(int(tiled))]
+	output = subprocess.Popen(args, stdout=subprocess.PIPE).communicate()[0]
+	result = [line for line in output.splitlines() if line.startswith('RESULT')]
+	if not result:
+		print 'Warning: %s failed to render.' % (' '.join(args[1:]))
+		return None
+	#end
+	seconds, peak = result[-1].split()[1:3]
+	return float(seconds), peak
+#end
+
+def run_tiled():
+	"""Compares row and tiled mode for the neighbourhood filters at every size."""
+	print '%-16s %-4s %-6s %10s %10s %10s' % ('filter', 'size', 'mode', 'seconds', 'Mpix/s', 'peak MB')
+	for filter_name in TILED_FILTERS:
+		for size_index in range(len(SIZES)):
+			for mode_name, tiled in [('rows', False), ('tiled', True)]:
+				result = render_child(size_index, filter_name, tiled)
+				if result is None:
+					continue
+				#end
+				pixels = SIZES[size_index][1] * SIZES[size_index][2]
+				print '%-16s %-4s %-6s %10.3f %10.1f %10s' % (filter_name, SIZES[size_index][0], mode_name, result[0], pixels / result[0] / 1e6, result[1])
+			#end
+		#end
+	#end
+#end
+
+def run_scaling(thread_counts):
+	"""Renders every filter at 4K on each thread count and prints its speed-up over the first count."""
+	print '%-16s %s' % ('filter', ' '.join(['%8s' % ('%d thr' % threads) for threads in thread_counts]))
+	for filter_name in ALL_FILTERS:
+		times = []
+		for threads in thread_counts:
+			result = render_child(1, filter_name, False, threads)
+			times.append(result[0] if result is not None else None)
+		#end
+		cells = []
+		for seconds in times:
+			if seconds is None or times[0] is None:
+				cells.append('%8s' % 'n/a')
+			else:
+				cells.append('%7.2fx' % (times[0] / seconds))
+		#end
+		print '%-16s %s' % (filter_name, ' '.join(cells))
+	#end
+#end
+
+if len(sys.argv) >= 5 and '--one' == sys.argv[1]:
+	render_one(int(sys.argv[2]), sys.argv[3], bool(int(sys.argv[4])))
+elif len(sys.argv) >= 3 and '--threads' == sys.argv[1]:
+	run_scaling([int(threads) for threads in sys.argv[2].split(',')])
+else:
+	run_tiled()
+#end
\ No newline at end of file